@@ -0,0 +1,542 @@
+/* huffbench - times each stage of the codec on synthetic data and on files
+
+   huffbench [-n bytes] [-r repeats] [-l limit] [-c] [-s seed] [file...]
+
+   Every data set goes through counting, building the tree, building the encoder, encoding, draining the encoder,
+   decoding and draining the decoder, and the one-shot functions (order-1 too), each timed on its own - the best of
+   the repeats is kept - and the decoded data is checked against the original
+   Output is CSV on stdout, one row per data set and stage:
+     data,bytes,stage,seconds,mb_per_s,ns_per_symbol,ratio,allocs,alloc_bytes
+   The tree stage is so short that it's run many times over, and its seconds are per run
+   -c uses the original counts format instead of canonical streams
+
+   huff.c is built into this file rather than linked, so its allocations can be counted and its internals timed
+
+   On Linux: cc -O2 -o huffbench bench.c -lpthread -lm */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "huff.h"
+
+/* Every allocation huff.c makes goes through these */
+static size_t BenchAllocCount;
+static size_t BenchAllocBytes;
+static void *BenchMalloc(size_t size);
+static void *BenchCalloc(size_t count, size_t size);
+static void *BenchRealloc(void *p, size_t size);
+
+#define malloc(size) BenchMalloc(size)
+#define calloc(count, size) BenchCalloc(count, size)
+#define realloc(p, size) BenchRealloc(p, size)
+#include "huff.c"
+#undef malloc
+#undef calloc
+#undef realloc
+
+/* Times a stage has to run for, at least, to be worth timing */
+#define BENCH_MIN_SECONDS 0.05
+
+struct BenchOptions
+{
+  size_t size;
+  int repeats;
+  int maxCodeLength;
+  int counts;
+  uint64_t seed;
+};
+
+/* What one stage did, for one row of output */
+struct BenchResult
+{
+  double seconds;
+  size_t symbols;
+  size_t allocs;
+  size_t allocBytes;
+};
+
+static int BenchParseOptions(int argc, char **argv, struct BenchOptions *options, int *firstFile);
+static double BenchNow(void);
+static uint64_t BenchRandom(uint64_t *state);
+/* Uniform on [0, 1) */
+static double BenchRandomUnit(uint64_t *state);
+/* Fills |data| from a distribution over the 256 byte values given by |weights| */
+static void BenchFillWeighted(uint8_t *data, size_t size, const double *weights, uint64_t *state);
+static void BenchFillUniform(uint8_t *data, size_t size, uint64_t *state);
+static void BenchFillSkewed(uint8_t *data, size_t size, uint64_t *state);
+static void BenchFillZipf(uint8_t *data, size_t size, uint64_t *state);
+static void BenchFillSingle(uint8_t *data, size_t size, uint64_t *state);
+/* Byte i shows up in proportion to the ith Fibonacci number, which makes for the deepest tree there can be */
+static void BenchFillFibonacci(uint8_t *data, size_t size, uint64_t *state);
+static uint8_t *BenchReadFile(const char *name, size_t *size);
+/* Runs every stage over |data|, printing a row for each
+   Returns 0, or -1 if something failed */
+static int BenchRun(const char *name, const uint8_t *data, size_t size, const struct BenchOptions *options);
+static void BenchPrint(const char *name, size_t size, const char *stage, const struct BenchResult *result,
+                       double ratio);
+/* Keeps a stage's numbers if it beat the repeats before it */
+static void BenchStop(struct BenchResult *best, double seconds, size_t allocs, size_t allocBytes, size_t symbols);
+
+int main(int argc, char **argv)
+{
+  static const struct
+  {
+    const char *name;
+    void (*fill)(uint8_t *data, size_t size, uint64_t *state);
+  } sets[] = {
+    { "uniform", BenchFillUniform },
+    { "skewed", BenchFillSkewed },
+    { "zipf", BenchFillZipf },
+    { "single", BenchFillSingle },
+    { "fibonacci", BenchFillFibonacci }
+  };
+  struct BenchOptions options;
+  uint8_t *data;
+  int firstFile;
+  int ret = 0;
+  int i;
+
+  if (BenchParseOptions(argc, argv, &options, &firstFile)) {
+    fprintf(stderr, "usage: huffbench [-n bytes] [-r repeats] [-l limit] [-c] [-s seed] [file...]\n");
+    return 2;
+  }
+
+  printf("data,bytes,stage,seconds,mb_per_s,ns_per_symbol,ratio,allocs,alloc_bytes\n");
+
+  data = malloc(options.size);
+  if (data == NULL && options.size > 0) {
+    fprintf(stderr, "huffbench: out of memory\n");
+    return 1;
+  }
+  for (i = 0; i < (int)(sizeof(sets)/sizeof(sets[0])); i++) {
+    uint64_t state = options.seed;
+
+    sets[i].fill(data, options.size, &state);
+    if (BenchRun(sets[i].name, data, options.size, &options))
+      ret = 1;
+  }
+  free(data);
+
+  for (i = firstFile; i < argc; i++) {
+    size_t size;
+
+    data = BenchReadFile(argv[i], &size);
+    if (data == NULL) {
+      fprintf(stderr, "huffbench: couldn't read %s\n", argv[i]);
+      ret = 1;
+      continue;
+    }
+    if (BenchRun(argv[i], data, size, &options))
+      ret = 1;
+    free(data);
+  }
+
+  return ret;
+}
+
+static int BenchParseOptions(int argc, char **argv, struct BenchOptions *options, int *firstFile)
+{
+  int i;
+
+  options->size = 16*1024*1024;
+  options->repeats = 5;
+  options->maxCodeLength = 0;
+  options->counts = 0;
+  options->seed = 1;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    const char *arg = argv[i];
+
+    if (strcmp(arg, "-c") == 0) {
+      options->counts = 1;
+    } else if (i + 1 < argc && strcmp(arg, "-n") == 0) {
+      options->size = (size_t)strtoull(argv[++i], NULL, 10);
+    } else if (i + 1 < argc && strcmp(arg, "-r") == 0) {
+      options->repeats = atoi(argv[++i]);
+      if (options->repeats < 1)
+        return -1;
+    } else if (i + 1 < argc && strcmp(arg, "-l") == 0) {
+      options->maxCodeLength = atoi(argv[++i]);
+      if (options->maxCodeLength < HUFF_MINCODELENGTH || options->maxCodeLength > HUFF_MAXCODELENGTH)
+        return -1;
+    } else if (i + 1 < argc && strcmp(arg, "-s") == 0) {
+      options->seed = (uint64_t)strtoull(argv[++i], NULL, 10);
+    } else {
+      return -1;
+    }
+  }
+
+  /* The counts format only takes what a 32 bit count can hold */
+  if (options->counts && options->size > HUFF_COUNTS_MAX)
+    return -1;
+
+  *firstFile = i;
+  return 0;
+}
+static double BenchNow(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+static uint64_t BenchRandom(uint64_t *state)
+{
+  /* xorshift64* - the state can't be 0 */
+  uint64_t x = *state ? *state : 0x9E3779B97F4A7C15ull;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1Dull;
+}
+static double BenchRandomUnit(uint64_t *state)
+{
+  return (double)(BenchRandom(state) >> 11) / 9007199254740992.0;
+}
+static void BenchFillWeighted(uint8_t *data, size_t size, const double *weights, uint64_t *state)
+{
+  double cumulative[256];
+  double total = 0;
+  size_t i;
+  int c;
+
+  for (c = 0; c < 256; c++) {
+    total += weights[c];
+    cumulative[c] = total;
+  }
+
+  for (i = 0; i < size; i++) {
+    double u = BenchRandomUnit(state) * total;
+    int lo = 0;
+    int hi = 255;
+
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (cumulative[mid] > u)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    data[i] = (uint8_t)lo;
+  }
+}
+static void BenchFillUniform(uint8_t *data, size_t size, uint64_t *state)
+{
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    data[i] = (uint8_t)(BenchRandom(state) >> 56);
+}
+static void BenchFillSkewed(uint8_t *data, size_t size, uint64_t *state)
+{
+  double weights[256];
+  int c;
+
+  /* Each byte value a little less likely than the one before, like text or small integers */
+  for (c = 0; c < 256; c++)
+    weights[c] = exp(-c / 16.0);
+
+  BenchFillWeighted(data, size, weights, state);
+}
+static void BenchFillZipf(uint8_t *data, size_t size, uint64_t *state)
+{
+  double weights[256];
+  int c;
+
+  for (c = 0; c < 256; c++)
+    weights[c] = 1.0 / (c + 1);
+
+  BenchFillWeighted(data, size, weights, state);
+}
+static void BenchFillSingle(uint8_t *data, size_t size, uint64_t *state)
+{
+  (void)state;
+
+  memset(data, 'x', size);
+}
+static void BenchFillFibonacci(uint8_t *data, size_t size, uint64_t *state)
+{
+  size_t pos = 0;
+  size_t a = 1;
+  size_t b = 1;
+  size_t i;
+  int c;
+
+  /* Exact Fibonacci counts for as many byte values as fit, with the rest going to the last one */
+  for (c = 0; c < 256 && pos < size; c++) {
+    size_t count = (a <= size - pos) ? a : size - pos;
+    size_t next = a + b;
+
+    memset(data + pos, c, count);
+    pos += count;
+    a = b;
+    b = next;
+  }
+
+  /* Shuffle, so the runs don't flatter the coder */
+  for (i = size; i > 1; i--) {
+    size_t j = (size_t)(BenchRandom(state) % i);
+    uint8_t swap = data[i - 1];
+    data[i - 1] = data[j];
+    data[j] = swap;
+  }
+}
+static uint8_t *BenchReadFile(const char *name, size_t *size)
+{
+  FILE *file;
+  uint8_t *data;
+  long length;
+
+  file = fopen(name, "rb");
+  if (file == NULL)
+    return NULL;
+
+  if (fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return NULL;
+  }
+
+  data = malloc(length > 0 ? (size_t)length : 1);
+  if (data == NULL || fread(data, 1, (size_t)length, file) != (size_t)length) {
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+
+  fclose(file);
+  *size = (size_t)length;
+  return data;
+}
+
+static int BenchRun(const char *name, const uint8_t *data, size_t size, const struct BenchOptions *options)
+{
+  struct BenchResult count;
+  struct BenchResult tree;
+  struct BenchResult encoderInit;
+  struct BenchResult encode;
+  struct BenchResult encoderDrain;
+  struct BenchResult decode;
+  struct BenchResult decoderDrain;
+  struct BenchResult compress;
+  struct BenchResult decompress;
+  struct BenchResult compressContext;
+  struct BenchResult decompressContext;
+  HuffCounter counter = NULL;
+  uint8_t *encoded = NULL;
+  uint8_t *decoded = NULL;
+  uint8_t *oneShot = NULL;
+  size_t encodedSize = 0;
+  size_t oneShotSize = 0;
+  size_t contextSize = 0;
+  double ratio;
+  double start;
+  int ret = -1;
+  int rep;
+
+  count.seconds = tree.seconds = encoderInit.seconds = encode.seconds = encoderDrain.seconds = -1;
+  decode.seconds = decoderDrain.seconds = compress.seconds = decompress.seconds = -1;
+  compressContext.seconds = decompressContext.seconds = -1;
+
+  decoded = malloc(size > 0 ? size : 1);
+  oneShot = malloc(HuffCompressBound(size));
+  if (decoded == NULL || oneShot == NULL)
+    goto out;
+
+  for (rep = 0; rep < options->repeats; rep++) {
+    size_t allocStart;
+    size_t allocBytesStart;
+    HuffEncoder encoder;
+    HuffDecoder decoder;
+    size_t processed;
+    size_t written;
+    int runs;
+    int res;
+
+    if (counter != NULL)
+      HuffCounterDestroy(counter);
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    counter = HuffCounterInit();
+    if (counter == NULL || HuffCounterFeedData64(counter, data, size) != HUFF_SUCCESS)
+      goto out;
+    BenchStop(&count, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart, size);
+
+    /* However many runs it takes to be measurable, one tree at a time */
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    for (runs = 0; runs == 0 || BenchNow() - start < BENCH_MIN_SECONDS; runs++) {
+      HuffTree huffTree = HuffTreeInit(counter, 0);
+      if (huffTree == NULL)
+        goto out;
+      HuffTreeDestroy(huffTree);
+    }
+    BenchStop(&tree, (BenchNow() - start) / runs, (BenchAllocCount - allocStart) / runs,
+              (BenchAllocBytes - allocBytesStart) / runs, 0);
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    if (options->counts)
+      encoder = HuffEncoderInit(counter, 0);
+    else
+      encoder = HuffEncoderInitCanonical(counter, 0, options->maxCodeLength);
+    if (encoder == NULL)
+      goto out;
+    BenchStop(&encoderInit, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart, 0);
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    res = HuffEncoderFeedData64(encoder, data, size, &processed);
+    if (res != HUFF_SUCCESS || processed != size || HuffEncoderEndData(encoder) != HUFF_SUCCESS) {
+      HuffEncoderDestroy(encoder);
+      goto out;
+    }
+    BenchStop(&encode, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart, size);
+
+    free(encoded);
+    encodedSize = HuffEncoderByteCount64(encoder);
+    encoded = malloc(encodedSize);
+    if (encoded == NULL) {
+      HuffEncoderDestroy(encoder);
+      goto out;
+    }
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    written = HuffEncoderWriteBytes64(encoder, encoded, encodedSize);
+    BenchStop(&encoderDrain, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart, size);
+    HuffEncoderDestroy(encoder);
+    if (written != encodedSize)
+      goto out;
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    decoder = HuffDecoderInit(0);
+    if (decoder == NULL)
+      goto out;
+    res = HuffDecoderFeedData64(decoder, encoded, encodedSize, &processed);
+    if (res != HUFF_SUCCESS || HuffDecoderByteCount64(decoder) != size) {
+      HuffDecoderDestroy(decoder);
+      goto out;
+    }
+    BenchStop(&decode, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart, size);
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    written = HuffDecoderWriteBytes64(decoder, decoded, size);
+    BenchStop(&decoderDrain, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart, size);
+    HuffDecoderDestroy(decoder);
+    if (written != size || memcmp(decoded, data, size) != 0)
+      goto out;
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    if (HuffCompress(data, size, oneShot, HuffCompressBound(size), &oneShotSize) != HUFF_SUCCESS)
+      goto out;
+    BenchStop(&compress, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart, size);
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    if (HuffDecompress(oneShot, oneShotSize, decoded, size, &written) != HUFF_SUCCESS)
+      goto out;
+    BenchStop(&decompress, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart, size);
+    if (written != size || memcmp(decoded, data, size) != 0)
+      goto out;
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    if (HuffCompressContext(data, size, oneShot, HuffCompressBound(size), &contextSize) != HUFF_SUCCESS)
+      goto out;
+    BenchStop(&compressContext, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart,
+              size);
+
+    allocStart = BenchAllocCount;
+    allocBytesStart = BenchAllocBytes;
+    start = BenchNow();
+    if (HuffDecompress(oneShot, contextSize, decoded, size, &written) != HUFF_SUCCESS)
+      goto out;
+    BenchStop(&decompressContext, BenchNow() - start, BenchAllocCount - allocStart, BenchAllocBytes - allocBytesStart,
+              size);
+    if (written != size || memcmp(decoded, data, size) != 0)
+      goto out;
+  }
+
+  ratio = (size > 0) ? (double)encodedSize / (double)size : 0;
+  BenchPrint(name, size, "count", &count, ratio);
+  BenchPrint(name, size, "tree", &tree, ratio);
+  BenchPrint(name, size, "encoder_init", &encoderInit, ratio);
+  BenchPrint(name, size, "encode", &encode, ratio);
+  BenchPrint(name, size, "encoder_drain", &encoderDrain, ratio);
+  BenchPrint(name, size, "decode", &decode, ratio);
+  BenchPrint(name, size, "decoder_drain", &decoderDrain, ratio);
+  ratio = (size > 0) ? (double)oneShotSize / (double)size : 0;
+  BenchPrint(name, size, "compress", &compress, ratio);
+  BenchPrint(name, size, "decompress", &decompress, ratio);
+  ratio = (size > 0) ? (double)contextSize / (double)size : 0;
+  BenchPrint(name, size, "compress_order1", &compressContext, ratio);
+  BenchPrint(name, size, "decompress_order1", &decompressContext, ratio);
+  fflush(stdout);
+
+  ret = 0;
+out:
+  if (ret != 0)
+    fprintf(stderr, "huffbench: %s failed\n", name);
+  if (counter != NULL)
+    HuffCounterDestroy(counter);
+  free(encoded);
+  free(decoded);
+  free(oneShot);
+  return ret;
+}
+static void BenchPrint(const char *name, size_t size, const char *stage, const struct BenchResult *result,
+                       double ratio)
+{
+  printf("%s,%llu,%s,%.9f,", name, (unsigned long long)size, stage, result->seconds);
+  /* Stages that don't go through the data have no rate */
+  if (result->symbols > 0 && result->seconds > 0)
+    printf("%.2f,%.3f,", (double)result->symbols / result->seconds / 1e6, result->seconds * 1e9 / (double)result->symbols);
+  else
+    printf(",,");
+  printf("%.6f,%llu,%llu\n", ratio, (unsigned long long)result->allocs, (unsigned long long)result->allocBytes);
+}
+static void BenchStop(struct BenchResult *best, double seconds, size_t allocs, size_t allocBytes, size_t symbols)
+{
+  if (best->seconds < 0 || seconds < best->seconds)
+    best->seconds = seconds;
+  best->symbols = symbols;
+  best->allocs = allocs;
+  best->allocBytes = allocBytes;
+}
+
+static void *BenchMalloc(size_t size)
+{
+  BenchAllocCount++;
+  BenchAllocBytes += size;
+  return malloc(size);
+}
+static void *BenchCalloc(size_t count, size_t size)
+{
+  BenchAllocCount++;
+  BenchAllocBytes += count*size;
+  return calloc(count, size);
+}
+static void *BenchRealloc(void *p, size_t size)
+{
+  BenchAllocCount++;
+  BenchAllocBytes += size;
+  return realloc(p, size);
+}
@@ -0,0 +1,83 @@
+/* huffcheck - checks behaviour the round trips in huffbench can't see
+
+   huffcheck
+
+   Prints a line to stderr for each check that fails, and exits with 1 if any did
+   Covers:
+     canonical encoders turning down bytes their counter never saw, on the direct path, on the general one and
+     through an encode stream - each has to give HUFF_BADDATA at that byte rather than dropping it
+
+   On Linux: cc -O2 -o huffcheck check.c huff.c -lpthread */
+#include <stdio.h>
+
+#include "huff.h"
+
+/* Returns 0 if the check passed, -1 otherwise */
+static int CheckUncountedFeed(HuffCounter counter, int initialBufferSize);
+static int CheckUncountedStream(HuffCounter counter);
+
+static const uint8_t CheckCounted[] = "aaaabbbc";
+/* The 'Z' at index 3 was never counted */
+static const uint8_t CheckUncounted[] = "aaaZbbbc";
+
+int main(void)
+{
+  HuffCounter counter;
+  int ret = 0;
+
+  counter = HuffCounterInit();
+  if (counter == NULL || HuffCounterFeedData(counter, CheckCounted, 8) != HUFF_SUCCESS) {
+    fprintf(stderr, "huffcheck: couldn't count\n");
+    return 1;
+  }
+
+  /* A big buffer keeps the encoder on its direct path, a 1 byte one sends it through the general one */
+  if (CheckUncountedFeed(counter, 4096)) {
+    fprintf(stderr, "huffcheck: encoder took an uncounted byte on its direct path\n");
+    ret = 1;
+  }
+  if (CheckUncountedFeed(counter, 1)) {
+    fprintf(stderr, "huffcheck: encoder took an uncounted byte on its general path\n");
+    ret = 1;
+  }
+  if (CheckUncountedStream(counter)) {
+    fprintf(stderr, "huffcheck: encode stream took an uncounted byte\n");
+    ret = 1;
+  }
+
+  HuffCounterDestroy(counter);
+  return ret;
+}
+
+static int CheckUncountedFeed(HuffCounter counter, int initialBufferSize)
+{
+  HuffEncoder encoder;
+  int processed = -1;
+  int res;
+
+  encoder = HuffEncoderInitCanonical(counter, initialBufferSize, 0);
+  if (encoder == NULL)
+    return -1;
+  res = HuffEncoderFeedData(encoder, CheckUncounted, 8, &processed);
+  HuffEncoderDestroy(encoder);
+
+  return (res == HUFF_BADDATA && processed == 3) ? 0 : -1;
+}
+
+static int CheckUncountedStream(HuffCounter counter)
+{
+  uint8_t out[64];
+  HuffStream stream;
+  int res;
+
+  if (HuffEncodeStreamInit(&stream, counter, 0) != HUFF_SUCCESS)
+    return -1;
+  stream.nextIn = CheckUncounted;
+  stream.availIn = 8;
+  stream.nextOut = out;
+  stream.availOut = sizeof(out);
+  res = HuffEncodeStream(&stream, HUFF_FINISH);
+  HuffEncodeStreamEnd(&stream);
+
+  return (res == HUFF_BADDATA && stream.totalIn == 3) ? 0 : -1;
+}
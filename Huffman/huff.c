@@ -6,325 +6,295 @@
 #include <limits.h>
 #include <assert.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #define HUFF_EOF_CHAR 256
 #define HUFF_BUFFER_START 1024
 
-typedef int32_t ctr;
-#define CTR_MAX INT32_MAX
-
-/* Generic internal data structures */
-
-/* Linked list */
-struct Node
-{
-  void *data;
-  struct Node *next;
-  struct Node *prev;
-};
-struct List_
-{
-  /* Points to a dummy starting node */
-  struct Node *first;
-  /* Points to a dummy ending node */
-  struct Node *last;
-  int size;
-};
-typedef struct List_ *List;
-
-static List ListInit(void);
-static void ListDestroy(List l);
-static int ListSize(List l);
-static void *ListData(List l, int index);
-static int ListInsert(List l, void *data, int index);
-/* Returns the removed item */
-static void *ListRemove(List l, int index);
-/* Pass -1 as |index| to get the dummy first node
-   Pass size as |index| to get the dummy last node */
-static struct Node *ListNode_(List l, int index);
-
-static List ListInit(void)
-{
-  List l;
-
-  l = malloc(sizeof(*l));
-  if (l == NULL)
-    goto out;
-
-  l->first = malloc(sizeof(*(l->first)));
-  if (l->first == NULL)
-    goto out1;
-
-  l->last = malloc(sizeof(*(l->last)));
-  if (l->last == NULL)
-    goto out2;
-  
-  l->first->data = NULL;
-  l->first->next = l->last;
-  l->first->prev = NULL;
-
-  l->last->data = NULL;
-  l->last->prev = l->first;
-  l->last->next = NULL;
-
-  l->size = 0;
-  return l;
-
-out2:
-  free(l->first);
-  l->first = NULL;
-out1:
-  free(l);
-  l = NULL;
-out:
-  return NULL;
-}
-static void ListDestroy(List l)
+/* Number of fraction bits in the fixed point logs HuffCounterEntropyBound works with */
+#define HUFF_LOG2_FRACTION_BITS 16
+
+/* Counts are 64 bit, but the total is held well under that, so the sums package-merge makes of them
+   (at most one total per level) can't overflow */
+typedef int64_t ctr;
+#define CTR_MAX (((ctr)1 << 56) - 1)
+
+/* Stream formats
+   The original format starts with the 256 symbol counts
+   Every other format starts with "HUF" and a format byte with the top bit set - a counts header
+   can never start that way, since its first count would be negative
+   Adaptive streams have nothing after that but the code
+   Format 6 belongs to the blocks of the C++ front end in huff.hpp */
+#define HUFF_FORMAT_COUNTS 0
+#define HUFF_FORMAT_CANONICAL 1
+#define HUFF_FORMAT_FRAMED 2
+#define HUFF_FORMAT_ADAPTIVE 3
+#define HUFF_FORMAT_CONTEXT 4
+#define HUFF_FORMAT_SYMBOLS 5
+#define HUFF_MAGIC_SIZE 4
+#define HUFF_FORMAT_FLAG 0x80
+
+/* Counts headers hold 4 byte counts, so streams in that format can't hold more than this */
+#define HUFF_COUNTS_MAX INT32_MAX
+#define HUFF_COUNTS_WIDTH 4
+
+/* Sizes of the headers in bytes */
+#define HUFF_COUNTS_HEADER_SIZE (256*HUFF_COUNTS_WIDTH)
+/* Magic, longest length, then at most 10 bits per symbol */
+#define HUFF_CANONICAL_HEADER_MAX (HUFF_MAGIC_SIZE + 1 + (257*10 + 7)/8)
+/* Big enough for any header */
+#define HUFF_HEADER_MAX HUFF_COUNTS_HEADER_SIZE
+/* Magic, then the block size */
+#define HUFF_FRAME_HEADER_SIZE (HUFF_MAGIC_SIZE + 4)
+/* Block type, then the uncompressed and compressed sizes */
+#define HUFF_BLOCK_HEADER_SIZE (1 + 4 + 4)
+
+/* Block types
+   A frame is a run of blocks ending in an end block, which is just the type byte */
+#define HUFF_BLOCK_END 0
+#define HUFF_BLOCK_HUFFMAN 1
+#define HUFF_BLOCK_INDEX 2
+#define HUFF_BLOCK_STREAMS 3
+#define HUFF_BLOCK_REPEAT 4
+#define HUFF_BLOCK_STORED 5
+#define HUFF_BLOCK_SINGLE 6
+#define HUFF_BLOCK_RUNS 7
+
+/* Interleaved stream blocks split their symbols round-robin across this many bitstreams */
+#define HUFF_STREAM_COUNT 4
+/* Codes in interleaved stream blocks are no longer than this, so every one of them decodes with one lookup */
+#define HUFF_STREAM_MAX_LENGTH HUFF_DECODE_ROOT_BITS
+
+/* Splitting frames looks at the data this many bytes at a time, so no block it cuts is shorter (bar the last) */
+#define HUFF_SPLIT_WINDOW (16*1024)
+/* Most uncompressed bytes between a repeat block and the block with its table, which keeps the compressed distance
+   well within the 4 bytes it's written in */
+#define HUFF_REPEAT_MAX_DISTANCE ((uint64_t)1 << 30)
+
+/* Order-1 streams have at most this many tables, so the decoder's tables for them stay in cache */
+#define HUFF_CONTEXT_MAX_TABLES 32
+/* Codes in order-1 streams are no longer than this, so every one of them decodes with one lookup */
+#define HUFF_CONTEXT_MAX_LENGTH HUFF_DECODE_ROOT_BITS
+/* Only this many of the busiest contexts are tried out with tables of their own */
+#define HUFF_CONTEXT_CANDIDATES 64
+/* Magic, the uncompressed length, then the number of tables */
+#define HUFF_CONTEXT_HEADER_SIZE (HUFF_MAGIC_SIZE + 8 + 1)
+/* The fixed part, the context map at 5 bits a context, then every table's canonical header without its magic */
+#define HUFF_CONTEXT_HEADER_MAX \
+  (HUFF_CONTEXT_HEADER_SIZE + 256*5/8 + HUFF_CONTEXT_MAX_TABLES*(HUFF_CANONICAL_HEADER_MAX - HUFF_MAGIC_SIZE))
+
+/* Codes in symbol streams are no longer than this, so their decode tables never need more than two levels */
+#define HUFF_SYMBOL_MAX_LENGTH 20
+/* Number of index bits in the first level of a symbol stream's decode table */
+#define HUFF_SYMBOL_ROOT_BITS 12
+/* Magic, the alphabet size less one (2 bytes), then the size of the rest of the header (4 bytes) */
+#define HUFF_SYMBOL_HEADER_SIZE (HUFF_MAGIC_SIZE + 2 + 4)
+/* The fixed part, the length limit, then at most 10 bits for each of |count| symbols */
+#define HUFF_SYMBOL_HEADER_MAX(count) (HUFF_SYMBOL_HEADER_SIZE + 1 + ((size_t)(count)*10 + 7)/8)
+/* Most symbols the encoder codes between making sure its buffer has room for them */
+#define HUFF_SYMBOL_CHUNK 4096
+
+/* Longest code length a canonical header can describe */
+#define HUFF_CANONICAL_MAX_LENGTH HUFF_MAXCODELENGTH
+
+/* Longest code the encoder adds to its bit buffer in one go
+   With at most 7 bits left over after each flush, this keeps everything within 64 bits */
+#define HUFF_CODE_INLINE_BITS 56
+
+/* Number of index bits in the first level of a decode table */
+#define HUFF_DECODE_ROOT_BITS 11
+/* Codes from the first level that one refill is sure to hold, since a refill leaves at least 56 bits */
+#define HUFF_DECODE_BATCH (56/HUFF_DECODE_ROOT_BITS)
+
+/* Number of separate histograms the counter spreads its increments over, so that runs of the same byte don't
+   wait on each other's stores, and how much data it takes before that's worth clearing them for */
+#define HUFF_HISTOGRAM_TABLES 4
+#define HUFF_HISTOGRAM_MIN_LENGTH 1024
+/* Most bytes the histograms take before being added up, so their 32 bit counts can't wrap */
+#define HUFF_HISTOGRAM_CHUNK ((size_t)1 << 30)
+
+/* Least amount of data worth handing to a thread of its own */
+#define HUFF_THREAD_MIN_LENGTH (256*1024)
+
+/* Byte order helpers */
+static uint64_t HuffLoadLE64_(const uint8_t *p);
+static void HuffStoreLE64_(uint8_t *p, uint64_t v);
+static uint32_t HuffLoadLE32_(const uint8_t *p);
+static void HuffStoreLE32_(uint8_t *p, uint32_t v);
+
+/* Loads 8 bytes as a little-endian value, regardless of the host byte order
+   Compilers turn this into a single load on little-endian targets */
+static uint64_t HuffLoadLE64_(const uint8_t *p)
 {
-  struct Node *last;
-  struct Node *cur;
-  assert(l != NULL);
-
-  /* Walk the list, freeing the nodes */
-  cur = l->first;
-  
-  while (cur != NULL) {
-    last = cur;
-    cur = cur->next;
-    free(last);
-    last = NULL;
-  }
-
-  free(l);
-  l = NULL;
+  return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+         ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
 }
-static int ListSize(List l)
+/* Stores 8 bytes as a little-endian value, the counterpart of HuffLoadLE64_ */
+static void HuffStoreLE64_(uint8_t *p, uint64_t v)
 {
-  assert(l != NULL);
-
-  return l->size;
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+  p[4] = (uint8_t)(v >> 32);
+  p[5] = (uint8_t)(v >> 40);
+  p[6] = (uint8_t)(v >> 48);
+  p[7] = (uint8_t)(v >> 56);
 }
-static void *ListData(List l, int index)
+static uint32_t HuffLoadLE32_(const uint8_t *p)
 {
-  struct Node *n;
-  assert(l != NULL);
-  assert(index >= 0);
-  assert(index < l->size);
-
-  n = ListNode_(l, index);
-  assert(n != NULL);
-
-  return n->data;
+  return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
 }
-static int ListInsert(List l, void *data, int index)
+static void HuffStoreLE32_(uint8_t *p, uint32_t v)
 {
-  struct Node *before;
-  struct Node *at;
-  struct Node *after;
-  assert(l != NULL);
-  assert(index >= 0);
-  assert(index <= l->size);
-  /* Shouldn't ever happen for this project, but still... undefined behavior */
-  assert(l->size != INT_MAX);
-  
-  before = ListNode_(l, index-1);
-  assert(before != NULL);
-
-  after = before->next;
-  assert(after != NULL);
-
-  at = malloc(sizeof(*at));
-  if (at == NULL)
-    return -1;
-  
-  at->data = data;
-  at->prev = before;
-  at->next = after;
-
-  before ->next = at;
-  after->prev = at;
-
-  l->size++;
-  return 0;
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
 }
-static void *ListRemove(List l, int index)
-{
-  struct Node *before;
-  struct Node *at;
-  struct Node *after;
-  void *ret;
-  assert(l != NULL);
-  assert(index >= 0);
-  assert(index < l->size);
-
-  at = ListNode_(l, index);
-  assert(at != NULL);
-
-  before = at->prev;
-  after = at->next;
-  assert(before != NULL);
-  assert(after != NULL);
 
-  ret = at->data;
-  free(at);
-  at = NULL;
+/* Clamps a length to something the int-sized internals can take, for going through big buffers a piece at a time */
+static int HuffClamp_(size_t length);
 
-  before->next = after;
-  after->prev = before;
-
-  l->size--;
-  return ret;
-}
-static struct Node *ListNode_(List l, int index)
+static int HuffClamp_(size_t length)
 {
-  int useFirst;
-  struct Node *cur;
-  assert(l != NULL);
-  assert(index >= -1);
-  assert(index <= l->size);
-
-  useFirst = (index < l->size/2);
-  if (useFirst) {
-    int thisIdx = -1;
-    cur = l->first;
-    while (thisIdx < index) {
-      cur = cur->next;
-      thisIdx++;
-      assert(cur != NULL);
-    }
-  } else {
-    int thisIdx = l->size;
-    cur = l->last;
-    while (thisIdx > index) {
-      cur = cur->prev;
-      thisIdx--;
-      assert(cur != NULL);
-    }
-  }
-
-  return cur;
+  return (length > INT_MAX) ? INT_MAX : (int)length;
 }
 
-/* Priority queue wrapper interface for above list */
-struct PriorityQueueItem
-{
-  void *data;
-  ctr priority;
-};
-struct PriorityQueue_
+/* Threads
+   Just enough to run the same function over an array of jobs, one thread per job
+   The calling thread takes the first job, and any job whose thread couldn't be started is run on the calling
+   thread too - the jobs are independent, so the results don't depend on how they were spread out */
+typedef void (*HuffJobFunc_)(void *job);
+struct HuffThread_
 {
-  List l;
+#ifdef _WIN32
+  HANDLE handle;
+#else
+  pthread_t handle;
+#endif
+  HuffJobFunc_ func;
+  void *job;
+  int started;
 };
-typedef struct PriorityQueue_ *PriorityQueue;
 
-static PriorityQueue PriorityQueueInit(void);
-static void PriorityQueueDestroy(PriorityQueue pq);
-/* Returns -1 if there isn't enough memory
-   0 otherwise */
-static int PriorityQueueInsert(PriorityQueue pq, void *data, ctr priority);
-static void *PriorityQueueRemoveMin(PriorityQueue pq);
-static int PriorityQueueSize(PriorityQueue pq);
+static void HuffRunJobs_(HuffJobFunc_ func, void *jobs, size_t jobSize, int jobCount);
+#ifdef _WIN32
+static DWORD WINAPI HuffThreadMain_(LPVOID arg);
+#else
+static void *HuffThreadMain_(void *arg);
+#endif
 
-static PriorityQueue PriorityQueueInit(void)
+static void HuffRunJobs_(HuffJobFunc_ func, void *jobs, size_t jobSize, int jobCount)
 {
-  PriorityQueue pq;
-
-  pq = malloc(sizeof(*pq));
-  if (pq == NULL)
-    return NULL;
-
-  pq->l = ListInit();
-  if (pq->l == NULL) {
-    free(pq);
-    pq = NULL;
+  struct HuffThread_ *threads = NULL;
+  int i;
+  assert(func != NULL);
+  assert(jobs != NULL);
+  assert(jobCount > 0);
+
+  if (jobCount > 1)
+    threads = malloc((jobCount - 1)*sizeof(*threads));
+
+  for (i = 1; i < jobCount && threads != NULL; i++) {
+    struct HuffThread_ *thread = &threads[i - 1];
+    thread->func = func;
+    thread->job = (uint8_t *)jobs + i*jobSize;
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, HuffThreadMain_, thread, 0, NULL);
+    thread->started = (thread->handle != NULL);
+#else
+    thread->started = (pthread_create(&thread->handle, NULL, HuffThreadMain_, thread) == 0);
+#endif
   }
-  return pq;
-}
-static void PriorityQueueDestroy(PriorityQueue pq)
-{
-  assert(pq != NULL);
 
-  /* This frees all the PriorityQueueItem structs we malloc'd */
-  while (PriorityQueueSize(pq) > 0)
-    PriorityQueueRemoveMin(pq);
+  func(jobs);
 
-  ListDestroy(pq->l);
+  for (i = 1; i < jobCount; i++) {
+    if (threads != NULL && threads[i - 1].started) {
+#ifdef _WIN32
+      WaitForSingleObject(threads[i - 1].handle, INFINITE);
+      CloseHandle(threads[i - 1].handle);
+#else
+      pthread_join(threads[i - 1].handle, NULL);
+#endif
+    } else {
+      func((uint8_t *)jobs + i*jobSize);
+    }
+  }
 
-  free(pq);
+  free(threads);
 }
-static int PriorityQueueInsert(PriorityQueue pq, void *data, ctr priority)
+#ifdef _WIN32
+static DWORD WINAPI HuffThreadMain_(LPVOID arg)
+#else
+static void *HuffThreadMain_(void *arg)
+#endif
 {
-  struct PriorityQueueItem *thisItem;
-  int size;
-  int insertIdx;
-  List l;
-  int res;
-  assert(pq != NULL);
-
-  thisItem = malloc(sizeof(*thisItem));
-  if (thisItem == NULL)
-    goto out;
-  
-  thisItem->data = data;
-  thisItem->priority = priority;
+  struct HuffThread_ *thread = arg;
 
-  l = pq->l;
+  thread->func(thread->job);
 
-  size = ListSize(l);
+#ifdef _WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
 
-  if (size == 0) {
-    insertIdx = 0;
-  } else {
-    ctr lastPri;
-    int i = 0;
-
-    /* This may be unreasonably slow because of the repeated linked list random access
-       who knows though, haven't profiled */
-    do {
-      struct PriorityQueueItem *item = ListData(l, i);
-      assert(item != NULL);
-
-      lastPri = item->priority;
-      i++;
-    } while (lastPri < priority && i < size);
-
-    /* If we went off the end, insert past the current last element */
-    if (lastPri < priority)
-      insertIdx = i;
-    else
-      insertIdx = i-1;
-  }
+/* Mutexes, for the few things that are shared between threads */
+struct HuffMutex_
+{
+#ifdef _WIN32
+  CRITICAL_SECTION section;
+#else
+  pthread_mutex_t mutex;
+#endif
+};
 
-  res = ListInsert(l, thisItem, insertIdx);
-  if (res == -1)
-    goto out1;
+/* Returns 0, or -1 if the mutex couldn't be made */
+static int HuffMutexInit_(struct HuffMutex_ *mutex);
+static void HuffMutexDestroy_(struct HuffMutex_ *mutex);
+static void HuffMutexLock_(struct HuffMutex_ *mutex);
+static void HuffMutexUnlock_(struct HuffMutex_ *mutex);
 
+static int HuffMutexInit_(struct HuffMutex_ *mutex)
+{
+#ifdef _WIN32
+  InitializeCriticalSection(&mutex->section);
   return 0;
-out1:
-  free(thisItem);
-  thisItem = NULL;
-out:
-  return -1;
+#else
+  return (pthread_mutex_init(&mutex->mutex, NULL) == 0) ? 0 : -1;
+#endif
 }
-static void *PriorityQueueRemoveMin(PriorityQueue pq)
+static void HuffMutexDestroy_(struct HuffMutex_ *mutex)
 {
-  struct PriorityQueueItem *item;
-  void *ret;
-  assert(pq != NULL);
-
-  item = ListRemove(pq->l, 0);
-  assert(item != NULL);
-
-  ret = item->data;
-  free(item);
-  item = NULL;
-
-  return ret;
+#ifdef _WIN32
+  DeleteCriticalSection(&mutex->section);
+#else
+  pthread_mutex_destroy(&mutex->mutex);
+#endif
 }
-static int PriorityQueueSize(PriorityQueue pq)
+static void HuffMutexLock_(struct HuffMutex_ *mutex)
 {
-  assert(pq != NULL);
-
-  return ListSize(pq->l);
+#ifdef _WIN32
+  EnterCriticalSection(&mutex->section);
+#else
+  pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+static void HuffMutexUnlock_(struct HuffMutex_ *mutex)
+{
+#ifdef _WIN32
+  LeaveCriticalSection(&mutex->section);
+#else
+  pthread_mutex_unlock(&mutex->mutex);
+#endif
 }
 
 /* Main huff code */
@@ -337,23 +307,29 @@ struct HuffCounter_
   ctr totalCount;
 };
 
+static void HuffCounterInitState_(HuffCounter counter);
+/* Adds the number of times each byte value shows up in |data| to |counts| */
+static void HuffCounterHistogram_(const uint8_t *data, size_t length, ctr *counts);
+/* One thread's share of HuffCounterFeedDataParallel */
+struct HuffCounterJob_
+{
+  const uint8_t *data;
+  size_t length;
+  ctr counts[256];
+};
+static void HuffCounterRunJob_(void *job);
 static ctr HuffCounterCount(HuffCounter counter, uint8_t c);
 static void HuffCounterSetCount(HuffCounter counter, uint8_t c, ctr count);
 
 HuffCounter HuffCounterInit(void)
 {
   HuffCounter counter;
-  int i;
 
   counter = malloc(sizeof(*counter));
   if (counter == NULL)
     return NULL;
 
-  for (i = 0; i < 256; i++)
-    counter->counts[i] = 0;
-
-  /* One EOF will never be accounted for otherwise, so we put it here */
-  counter->totalCount = 1;
+  HuffCounterInitState_(counter);
 
   return counter;
 }
@@ -378,28 +354,149 @@ void HuffCounterDestroy(HuffCounter counter)
 }
 int HuffCounterFeedData(HuffCounter counter, const uint8_t* data, int length)
 {
-  struct HuffCounter_ workingCounter;
+  assert(length >= 0);
+
+  return HuffCounterFeedData64(counter, data, (size_t)length);
+}
+int HuffCounterFeedData64(HuffCounter counter, const uint8_t *data, size_t length)
+{
+  assert(counter != NULL);
+  assert(length == 0 || data != NULL);
+
+  /* No single count can go past the total, so checking the total up front covers all of them */
+  if (length > (uint64_t)(CTR_MAX - counter->totalCount))
+    return HUFF_TOOMUCHDATA;
+
+  HuffCounterHistogram_(data, length, counter->counts);
+  counter->totalCount += (ctr)length;
+
+  return HUFF_SUCCESS;
+}
+int HuffCounterFeedDataParallel(HuffCounter counter, const uint8_t *data, size_t length, int threadCount)
+{
+  struct HuffCounterJob_ *jobs;
+  size_t sliceLength;
+  size_t pos;
   int i;
+  int j;
   assert(counter != NULL);
-  assert(length >= 0);
+  assert(length == 0 || data != NULL);
+  assert(threadCount > 0);
 
-  /* Copy the freq counts so we can return the originals if they overflow */
-  memcpy(&workingCounter, counter, sizeof(workingCounter));
+  if (length > (uint64_t)(CTR_MAX - counter->totalCount))
+    return HUFF_TOOMUCHDATA;
 
-  for (i = 0; i < length; i++) {
-    ctr before = workingCounter.totalCount;
-    if (before == CTR_MAX) {
-      /* We would overflow */
-      return HUFF_TOOMUCHDATA;
-    } else {
-      workingCounter.counts[data[i]]++;
-      workingCounter.totalCount++;
-    }
+  /* Don't bother with threads that would hardly have anything to do */
+  if ((size_t)threadCount > length / HUFF_THREAD_MIN_LENGTH)
+    threadCount = (int)(length / HUFF_THREAD_MIN_LENGTH);
+  if (threadCount <= 1)
+    return HuffCounterFeedData64(counter, data, length);
+
+  jobs = malloc(threadCount*sizeof(*jobs));
+  if (jobs == NULL)
+    return HUFF_NOMEM;
+
+  sliceLength = length / threadCount;
+  pos = 0;
+  for (i = 0; i < threadCount; i++) {
+    jobs[i].data = data + pos;
+    jobs[i].length = (i == threadCount - 1) ? length - pos : sliceLength;
+    pos += jobs[i].length;
+  }
+
+  HuffRunJobs_(HuffCounterRunJob_, jobs, sizeof(*jobs), threadCount);
+
+  /* Adding up always happens in the same order, not that it matters for sums */
+  for (i = 0; i < threadCount; i++) {
+    for (j = 0; j < 256; j++)
+      counter->counts[j] += jobs[i].counts[j];
   }
+  counter->totalCount += (ctr)length;
+
+  free(jobs);
+  return HUFF_SUCCESS;
+}
+int HuffCounterMerge(HuffCounter into, HuffCounter from)
+{
+  int i;
+  assert(into != NULL);
+  assert(from != NULL);
+
+  /* Both totals include the EOF, which only needs counting once */
+  if (from->totalCount - 1 > CTR_MAX - into->totalCount)
+    return HUFF_TOOMUCHDATA;
+
+  for (i = 0; i < 256; i++)
+    into->counts[i] += from->counts[i];
+  into->totalCount += from->totalCount - 1;
 
-  memcpy(counter, &workingCounter, sizeof(workingCounter));
   return HUFF_SUCCESS;
 }
+static void HuffCounterInitState_(HuffCounter counter)
+{
+  int i;
+  assert(counter != NULL);
+
+  for (i = 0; i < 256; i++)
+    counter->counts[i] = 0;
+
+  /* One EOF will never be accounted for otherwise, so we put it here */
+  counter->totalCount = 1;
+}
+static void HuffCounterHistogram_(const uint8_t *data, size_t length, ctr *counts)
+{
+  uint32_t tables[HUFF_HISTOGRAM_TABLES][256];
+  size_t i;
+  int j;
+  assert(length == 0 || data != NULL);
+  assert(counts != NULL);
+
+  if (length < HUFF_HISTOGRAM_MIN_LENGTH) {
+    for (i = 0; i < length; i++)
+      counts[data[i]]++;
+    return;
+  }
+
+  /* The tables are only 32 bits wide, so they're emptied into |counts| every HUFF_HISTOGRAM_CHUNK bytes */
+  while (length > 0) {
+    size_t chunk = (length < HUFF_HISTOGRAM_CHUNK) ? length : HUFF_HISTOGRAM_CHUNK;
+
+    memset(tables, 0, sizeof(tables));
+
+    /* Eight bytes per load, each byte going to a different table than its neighbours */
+    for (i = 0; i + 8 <= chunk; i += 8) {
+      uint64_t word = HuffLoadLE64_(data + i);
+
+      tables[0][(uint8_t)word]++;
+      tables[1][(uint8_t)(word >> 8)]++;
+      tables[2][(uint8_t)(word >> 16)]++;
+      tables[3][(uint8_t)(word >> 24)]++;
+      tables[0][(uint8_t)(word >> 32)]++;
+      tables[1][(uint8_t)(word >> 40)]++;
+      tables[2][(uint8_t)(word >> 48)]++;
+      tables[3][(uint8_t)(word >> 56)]++;
+    }
+    for (; i < chunk; i++)
+      tables[0][data[i]]++;
+
+    for (i = 0; i < 256; i++) {
+      uint32_t sum = 0;
+      for (j = 0; j < HUFF_HISTOGRAM_TABLES; j++)
+        sum += tables[j][i];
+      counts[i] += (ctr)sum;
+    }
+
+    data += chunk;
+    length -= chunk;
+  }
+}
+static void HuffCounterRunJob_(void *job)
+{
+  struct HuffCounterJob_ *counterJob = job;
+
+  memset(counterJob->counts, 0, sizeof(counterJob->counts));
+  HuffCounterHistogram_(counterJob->data, counterJob->length, counterJob->counts);
+}
 static ctr HuffCounterCount(HuffCounter counter, uint8_t c)
 {
   assert(counter != NULL);
@@ -414,799 +511,6101 @@ static void HuffCounterSetCount(HuffCounter counter, uint8_t c, ctr count)
   counter->counts[c] = count;
 }
 
-/* Huffman tree */
+/* Huffman tree
+   All the nodes live in one array and refer to each other by index, so building a tree takes one allocation
+   Leafs come first, in symbol order, then the joining nodes in the order they were made - so a node's parent
+   always comes after it, and the root is last */
 struct HuffTreeNode
 {
   ctr weight;
-  int isLeaf;
-  struct HuffTreeNode *parent;
-  union {
-    struct {
-      struct HuffTreeNode *left;
-      struct HuffTreeNode *right;
-    };
-    int c;
-  };
+  /* -1 for the root */
+  int parent;
+  /* Both -1 for leafs */
+  int left;
+  int right;
+  /* Only meaningful for leafs */
+  int c;
 };
 struct HuffTree_
 {
-  struct HuffTreeNode *root;
-  struct HuffTreeNode *leafs[257];
-
-  /* Used for storing encoding information */
-  /* Initially all NULL */
-  uint8_t *leafBits[257];
-  /* Initially all 0 */
-  int leafBitLengths[257];
-
-  /* Used for storing decoding information */
-  /* Current decode position */
-  struct HuffTreeNode *decodeNode;
+  struct HuffTreeNode nodes[2*257 - 1];
+  int nodeCount;
+  int root;
+  /* Index of each symbol's leaf, -1 if it was left out */
+  int leafs[257];
 };
 typedef struct HuffTree_ *HuffTree;
 
-static HuffTree HuffTreeInit(HuffCounter counter);
+/* If |skipUnused| is set, symbols with a count of 0 are left out of the tree */
+static HuffTree HuffTreeInit(HuffCounter counter, int skipUnused);
 static void HuffTreeDestroy(HuffTree tree);
-/* Returns -1 if there isn't enough memory
-   0 otherwise */
-static int HuffTreeEncode(HuffTree tree, int in, const uint8_t **outBits, int *outBitCount);
-/* Returns 0 if no output chars are finished yet,
-   1 if an output char was finished - the output char is written to the |out| argument
-   |out| is an int so that it can hold HUFF_EOF_CHAR, in addition to uint8_t values */
-static int HuffTreeDecode(HuffTree tree, int bit, int *out);
-static void HuffTreeNodeFree_(struct HuffTreeNode *node);
+/* Sets |depths| to the number of bits in each symbol's code, or 0 for symbols that aren't in the tree */
+static void HuffTreeLeafDepths(HuffTree tree, int *depths);
+/* Fills |leafQueue| with the first |leafCount| nodes, lightest first, and higher symbols first within a weight */
+static void HuffTreeSortLeafs_(const struct HuffTreeNode *nodes, int leafCount, int *leafQueue);
 
-static HuffTree HuffTreeInit(HuffCounter counter)
+static HuffTree HuffTreeInit(HuffCounter counter, int skipUnused)
 {
   HuffTree tree;
-  PriorityQueue pq;
-  int res;
+  struct HuffTreeNode *nodes;
+  /* Leafs, lightest first */
+  int leafQueue[257];
+  int leafHead = 0;
+  int leafCount = 0;
+  /* Joining nodes - see below */
+  int joinQueue[256];
+  int joinHead = 0;
+  int joinLastGroup = 0;
+  int joinEnd = 0;
   int i;
-  struct HuffTreeNode *lastNode;
 
   tree = malloc(sizeof(*tree));
   if (tree == NULL)
-    goto out;
+    return NULL;
 
-  pq = PriorityQueueInit();
-  if (pq == NULL)
-    goto out1;
+  nodes = tree->nodes;
 
-  /* Add all the characters (plus EOF) to the priority queue with their counts as priorities */
   for (i = 0; i < 257; i++) {
-    struct HuffTreeNode *node = malloc(sizeof(*node));
     ctr count;
-    if (node == NULL)
-      goto out2;
 
     if (i == HUFF_EOF_CHAR)
       count = 1;
     else
-      count = HuffCounterCount(counter, i);
-
-    tree->leafs[i] = node;
-    node->isLeaf = 1;
-    node->c = i;
-    node->weight = count;
-    node->parent = NULL;
-
-    res = PriorityQueueInsert(pq, (void *)node, count);
-    if (res) {
-      free(node);
-      node = NULL;
-      goto out2;
+      count = HuffCounterCount(counter, (uint8_t)i);
+
+    if (skipUnused && count == 0) {
+      tree->leafs[i] = -1;
+      continue;
     }
 
-    tree->leafBits[i] = NULL;
-    tree->leafBitLengths[i] = 0;
+    tree->leafs[i] = leafCount;
+    nodes[leafCount].weight = count;
+    nodes[leafCount].parent = -1;
+    nodes[leafCount].left = -1;
+    nodes[leafCount].right = -1;
+    nodes[leafCount].c = i;
+    leafCount++;
   }
-
-  /* Build the tree by repeatedly pairing the lowest-weight nodes */
-  while (PriorityQueueSize(pq) > 1) {
-    int res;
-    struct HuffTreeNode *left;
-    struct HuffTreeNode *right;
-    struct HuffTreeNode *joiner = malloc(sizeof(*joiner));
-    if (joiner == NULL)
-      goto out2;
-
-    joiner->isLeaf = 0;
-    
-    /* Get the lowest-weight nodes */
-    left = PriorityQueueRemoveMin(pq);
-    right = PriorityQueueRemoveMin(pq);
-    assert(left != NULL);
-    assert(right != NULL);
-
-    joiner->left = left;
-    joiner->right = right;
-    joiner->parent = NULL;
-    left->parent = joiner;
-    right->parent = joiner;
+  tree->nodeCount = leafCount;
+
+  HuffTreeSortLeafs_(nodes, leafCount, leafQueue);
+
+  /* Build the tree by repeatedly pairing the lowest-weight nodes
+     Joining nodes are made in order of weight, so a second queue keeps them sorted for free
+     The tree has to come out exactly the way the old sorted-list queue built it, since counts headers
+     depend on it - that queue handed out the most recently added node first among equal weights:
+     - a joining node goes before a leaf of the same weight
+     - among joining nodes of the same weight, the newest goes first
+     The newest-first order is kept by treating the group of equal-weight nodes at the end of |joinQueue| as a stack,
+     and reversing it in place once something heavier is added after it */
+  while ((leafCount - leafHead) + (joinEnd - joinHead) > 1) {
+    int pair[2];
+    int joiner;
+    int j;
+
+    for (j = 0; j < 2; j++) {
+      int joinFront = -1;
+      if (joinHead < joinLastGroup)
+        joinFront = joinQueue[joinHead];
+      else if (joinHead < joinEnd)
+        joinFront = joinQueue[joinEnd - 1];
+
+      if (joinFront != -1 && (leafHead == leafCount || nodes[joinFront].weight <= nodes[leafQueue[leafHead]].weight)) {
+        pair[j] = joinFront;
+        if (joinHead < joinLastGroup)
+          joinHead++;
+        else
+          joinEnd--;
+      } else {
+        assert(leafHead < leafCount);
+        pair[j] = leafQueue[leafHead++];
+      }
+    }
 
     /* Weights should always be non-negative */
-    assert(left->weight >= 0);
-    assert(right->weight >= 0);
+    assert(nodes[pair[0]].weight >= 0);
+    assert(nodes[pair[1]].weight >= 0);
     /* We should never overflow, because we keep track of counts in the counter and limit the number of total counts to be <= CTR_MAX */
-    assert(left->weight <= CTR_MAX - right->weight);
-
-    joiner->weight = left->weight + right->weight;
-
-    res = PriorityQueueInsert(pq, joiner, joiner->weight);
-    if (res) {
-      free(joiner);
-      joiner = NULL;
-      goto out2;
+    assert(nodes[pair[0]].weight <= CTR_MAX - nodes[pair[1]].weight);
+
+    joiner = tree->nodeCount++;
+    nodes[joiner].weight = nodes[pair[0]].weight + nodes[pair[1]].weight;
+    nodes[joiner].parent = -1;
+    nodes[joiner].left = pair[0];
+    nodes[joiner].right = pair[1];
+    nodes[joiner].c = -1;
+    nodes[pair[0]].parent = joiner;
+    nodes[pair[1]].parent = joiner;
+
+    if (joinEnd > joinLastGroup && nodes[joinQueue[joinEnd - 1]].weight < nodes[joiner].weight) {
+      int lo = joinLastGroup;
+      int hi = joinEnd - 1;
+      while (lo < hi) {
+        int swap = joinQueue[lo];
+        joinQueue[lo++] = joinQueue[hi];
+        joinQueue[hi--] = swap;
+      }
+      joinLastGroup = joinEnd;
     }
+    assert(joinEnd < 256);
+    joinQueue[joinEnd++] = joiner;
   }
 
   /* The last node will be the root of the tree */
-  lastNode = PriorityQueueRemoveMin(pq);
-  assert(lastNode != NULL);
-
-  tree->root = lastNode;
-  tree->decodeNode = tree->root;
-
-  PriorityQueueDestroy(pq);
+  assert(tree->nodeCount > 0);
+  tree->root = tree->nodeCount - 1;
 
   return tree;
-out2:
-  /* Dequeue and free all nodes */
-  while (PriorityQueueSize(pq) > 0) {
-    struct HuffTreeNode *node = PriorityQueueRemoveMin(pq);
-    assert(node != NULL);
-    HuffTreeNodeFree_(node);
-  }
-  PriorityQueueDestroy(pq);
-out1:
-  free(tree);
-  tree = NULL;
-out:
-  return NULL;
 }
 static void HuffTreeDestroy(HuffTree tree)
 {
+  assert(tree != NULL);
+
+  free(tree);
+}
+static void HuffTreeLeafDepths(HuffTree tree, int *depths)
+{
+  int nodeDepths[2*257 - 1];
   int i;
   assert(tree != NULL);
+  assert(depths != NULL);
 
-  for (i = 0; i < 257; i++) {
-    /* Not used ones are left as NULL, so it's okay to free all of them */
-    free(tree->leafBits[i]);
+  /* Parents come after their children, so going backwards reaches every parent first */
+  for (i = tree->nodeCount - 1; i >= 0; i--) {
+    int parent = tree->nodes[i].parent;
+    nodeDepths[i] = (parent == -1) ? 0 : nodeDepths[parent] + 1;
   }
 
-  /* We must free the nodes this way and not through tree->leafs */
-  HuffTreeNodeFree_(tree->root);
+  for (i = 0; i < 257; i++)
+    depths[i] = (tree->leafs[i] == -1) ? 0 : nodeDepths[tree->leafs[i]];
+}
+static void HuffTreeSortLeafs_(const struct HuffTreeNode *nodes, int leafCount, int *leafQueue)
+{
+  /* A radix sort on the weights, lowest byte first - each pass is stable, so starting from the leafs in reverse
+     (they're in symbol order) keeps higher symbols first within a weight
+     Passes stop after the highest byte any weight has, and skip bytes every weight shares, so typical counts
+     take two or three passes over at most 257 leafs */
+  int scratch[257];
+  int *from = leafQueue;
+  int *to = scratch;
+  ctr allWeights = 0;
+  int shift;
+  int i;
+  assert(nodes != NULL);
+  assert(leafQueue != NULL);
+  assert(leafCount > 0 && leafCount <= 257);
 
-  free(tree);
+  for (i = 0; i < leafCount; i++) {
+    from[i] = leafCount - 1 - i;
+    allWeights |= nodes[i].weight;
+  }
+
+  for (shift = 0; shift < 64 && (allWeights >> shift) != 0; shift += 8) {
+    int starts[256];
+    int *swap;
+    int sum = 0;
+
+    memset(starts, 0, sizeof(starts));
+    for (i = 0; i < leafCount; i++)
+      starts[(nodes[from[i]].weight >> shift) & 0xFF]++;
+    if (starts[(nodes[from[0]].weight >> shift) & 0xFF] == leafCount)
+      continue;
+
+    for (i = 0; i < 256; i++) {
+      int count = starts[i];
+      starts[i] = sum;
+      sum += count;
+    }
+    for (i = 0; i < leafCount; i++)
+      to[starts[(nodes[from[i]].weight >> shift) & 0xFF]++] = from[i];
+
+    swap = from;
+    from = to;
+    to = swap;
+  }
+
+  if (from != leafQueue)
+    memcpy(leafQueue, from, leafCount*sizeof(*leafQueue));
 }
-static int HuffTreeEncode(HuffTree tree, int in, const uint8_t **outBits, int *outBitCount)
+
+/* Code table
+   Holds every symbol's code, worked out once up front, so the encoder never has to touch the tree
+   Codes are stored with their first bit in the lowest position, so they can be ORed straight into a bit buffer */
+struct HuffCode
+{
+  uint64_t bits;
+  int length;
+  /* For codes longer than HUFF_CODE_INLINE_BITS, the index of their first word in |longBits| */
+  int longIdx;
+};
+struct HuffCodeTable_
 {
-  uint8_t *bits;
+  struct HuffCode codes[257];
+
+  /* Words of the codes that don't fit in |bits|, 64 bits per word in the same bit order
+     Only zero-count symbols can end up this deep, so this is usually NULL */
+  uint64_t *longBits;
+};
+typedef struct HuffCodeTable_ *HuffCodeTable;
+
+static HuffCodeTable HuffCodeTableInit(HuffTree tree);
+/* Assigns canonical codes from code |lengths| - shorter codes first, and in symbol order within a length
+   A length of 0 means the symbol has no code */
+static HuffCodeTable HuffCodeTableInitCanonical(const uint8_t *lengths);
+static void HuffCodeTableDestroy(HuffCodeTable table);
+static int HuffCodeTableMaxLength(HuffCodeTable table);
+/* Returns |count| bits of the code for |c|, starting at bit |bitIdx|, first bit in the lowest position */
+static uint32_t HuffCodeTableBits(HuffCodeTable table, int c, int bitIdx, int count);
+/* Allocates a table for codes of the given lengths, with all bits clear */
+static HuffCodeTable HuffCodeTableAlloc_(const int *lengths);
+static void HuffCodeTableSetBit_(HuffCodeTable table, int c, int bitIdx);
+
+static HuffCodeTable HuffCodeTableInit(HuffTree tree)
+{
+  HuffCodeTable table;
+  int lengths[257];
+  int i;
   assert(tree != NULL);
-  assert(in >= 0);
-  assert(in <= 256);
-  assert(outBits != NULL);
-  assert(outBitCount != NULL);
-
-  bits = tree->leafBits[in];
-  if (bits == NULL) {
-    int length = 0;
-    struct HuffTreeNode *curNode = tree->leafs[in];
-    int byteIdx;
-    int bitIdx;
-    uint8_t *bitBase;
-    int i;
-    assert(tree->leafBitLengths[in] == 0);
-
-    /* Calculate length of bit pattern */
-    while (curNode->parent != NULL) {
-      /* The maximum depth is certainly less than 260 < INT_MAX, so the condition should always hold
-         Don't do undefined behavior, kids */
-      assert(length != INT_MAX);
-      length++;
-      curNode = curNode->parent;
-    }
-    assert(length > 0);
-    assert(length <= INT_MAX - 7);
-
-    tree->leafBits[in] = malloc((length + 7)/8);
-    if (tree->leafBits[in] == NULL)
-      return -1;
 
-    for (i = 0; i < (length + 7)/8; i++)
-      tree->leafBits[in][i] = 0;
+  HuffTreeLeafDepths(tree, lengths);
 
-    bitBase = tree->leafBits[in];
-    bitIdx = (length-1) % 8;
-    byteIdx = (length-1) / 8;
+  table = HuffCodeTableAlloc_(lengths);
+  if (table == NULL)
+    return NULL;
 
-    curNode = tree->leafs[in];
-    while (curNode->parent != NULL) {
-      int bit;
-      int isLeft = curNode->parent->left == curNode;
-      int isRight = curNode->parent->right == curNode;
-      assert(isLeft || isRight);
+  /* Walk up from each leaf, filling in the code from its last bit to its first */
+  for (i = 0; i < 257; i++) {
+    int cur = tree->leafs[i];
+    int bitIdx = lengths[i] - 1;
 
-      if (isLeft)
-        bit = 0;
-      else /* if (isRight) */
-        bit = 1;
+    if (cur == -1)
+      continue;
 
-      assert(byteIdx >= 0);
+    while (tree->nodes[cur].parent != -1) {
+      int parent = tree->nodes[cur].parent;
+      int isRight = tree->nodes[parent].right == cur;
+      assert(isRight || tree->nodes[parent].left == cur);
       assert(bitIdx >= 0);
 
-      /* Where we're going, we don't need temporaries */
-      *(bitBase+byteIdx) = (uint8_t)(((*(bitBase+byteIdx)) & (~(1<<bitIdx))) | (bit<<bitIdx));
+      if (isRight)
+        HuffCodeTableSetBit_(table, i, bitIdx);
 
       bitIdx--;
-      if (bitIdx < 0) {
-        bitIdx = 7;
-        byteIdx--;
-      }
-
-      curNode = curNode->parent;
+      cur = parent;
     }
 
     /* Make sure that the length matched up exactly with the number of expected bits */
-    assert(bitIdx == 7);
-    assert(byteIdx == -1);
-
-    /* The bits have been written, now we just need to update the length */
-    tree->leafBitLengths[in] = length;
+    assert(bitIdx == -1);
   }
 
-  *outBits = tree->leafBits[in];
-  *outBitCount = tree->leafBitLengths[in];
-  return 0;
+  return table;
 }
-static int HuffTreeDecode(HuffTree tree, int bit, int *out)
+static HuffCodeTable HuffCodeTableInitCanonical(const uint8_t *lengths)
 {
-  assert(tree != NULL);
-  assert(bit == 0 || bit == 1);
-  assert(out != NULL);
-  assert(tree->decodeNode != NULL);
-  assert(!(tree->decodeNode->isLeaf));
+  HuffCodeTable table;
+  int intLengths[257];
+  int lengthCounts[HUFF_CANONICAL_MAX_LENGTH + 1];
+  uint64_t nextCode[HUFF_CANONICAL_MAX_LENGTH + 1];
+  uint64_t code;
+  int i;
+  assert(lengths != NULL);
+
+  for (i = 0; i <= HUFF_CANONICAL_MAX_LENGTH; i++)
+    lengthCounts[i] = 0;
 
-  if (bit == 0)
-    tree->decodeNode = tree->decodeNode->left;
-  else /* if (bit == 1) */
-    tree->decodeNode = tree->decodeNode->right;
+  for (i = 0; i < 257; i++) {
+    assert(lengths[i] <= HUFF_CANONICAL_MAX_LENGTH);
+    intLengths[i] = lengths[i];
+    lengthCounts[lengths[i]]++;
+  }
+  lengthCounts[0] = 0;
 
-  assert(tree->decodeNode != NULL);
+  table = HuffCodeTableAlloc_(intLengths);
+  if (table == NULL)
+    return NULL;
 
-  if (tree->decodeNode->isLeaf) {
-    *out = tree->decodeNode->c;
-    tree->decodeNode = tree->root;
-    return 1;
+  /* The first code of each length follows on from the last code of the length before */
+  code = 0;
+  nextCode[0] = 0;
+  for (i = 1; i <= HUFF_CANONICAL_MAX_LENGTH; i++) {
+    code = (code + lengthCounts[i-1]) << 1;
+    nextCode[i] = code;
   }
-  else {
-    return 0;
+
+  for (i = 0; i < 257; i++) {
+    int length = lengths[i];
+    int bitIdx;
+    if (length == 0)
+      continue;
+
+    /* Canonical codes are written most significant bit first */
+    code = nextCode[length]++;
+    for (bitIdx = 0; bitIdx < length; bitIdx++) {
+      if ((code >> (length - 1 - bitIdx)) & 1)
+        HuffCodeTableSetBit_(table, i, bitIdx);
+    }
   }
+
+  return table;
 }
-static void HuffTreeNodeFree_(struct HuffTreeNode *node)
+static void HuffCodeTableDestroy(HuffCodeTable table)
 {
-  assert(node != NULL);
+  assert(table != NULL);
 
-  if (!node->isLeaf) {
-    assert(node->left != NULL);
-    assert(node->right != NULL);
+  free(table->longBits);
+  free(table);
+}
+static int HuffCodeTableMaxLength(HuffCodeTable table)
+{
+  int maxLength = 0;
+  int i;
+  assert(table != NULL);
 
-    HuffTreeNodeFree_(node->left);
-    HuffTreeNodeFree_(node->right);
+  for (i = 0; i < 257; i++) {
+    if (table->codes[i].length > maxLength)
+      maxLength = table->codes[i].length;
   }
-  free(node);
-}
 
-/* encoder */
-struct HuffEncoder_
+  return maxLength;
+}
+static uint32_t HuffCodeTableBits(HuffCodeTable table, int c, int bitIdx, int count)
 {
-  HuffCounter counter;
-  int counterBytesToWrite;
+  const struct HuffCode *code;
+  uint64_t bits;
+  assert(table != NULL);
+  assert(count >= 0);
+  assert(count <= 32);
+  assert(bitIdx >= 0);
 
-  HuffTree tree;
+  code = &table->codes[c];
+  assert(bitIdx + count <= code->length);
 
-  uint8_t* buffer;
-  int bufferSize;
-  int byteIdx;
-  int bitIdx;
-};
+  if (count == 0)
+    return 0;
 
-static int HuffEncoderExpandBufferToFit_(HuffEncoder encoder, int byteCount, int bitCount);
-static int HuffEncoderFeedSingle_(HuffEncoder encoder, int data);
-static int HuffEncoderWriteHeaderBytes_(HuffEncoder encoder, uint8_t *buf, int length);
+  if (code->longIdx == -1) {
+    bits = code->bits >> bitIdx;
+  } else {
+    const uint64_t *words = table->longBits + code->longIdx;
+    bits = words[bitIdx/64] >> (bitIdx % 64);
+    /* The piece might straddle two words */
+    if (bitIdx % 64 != 0 && (bitIdx + count - 1)/64 != bitIdx/64)
+      bits |= words[bitIdx/64 + 1] << (64 - bitIdx % 64);
+  }
 
-HuffEncoder HuffEncoderInit(HuffCounter counter, int initialBufferSize)
+  return (uint32_t)(bits & (((uint64_t)1 << count) - 1));
+}
+static HuffCodeTable HuffCodeTableAlloc_(const int *lengths)
 {
-  HuffEncoder enc;
-  assert(initialBufferSize >= 0);
+  HuffCodeTable table;
+  int longWords = 0;
+  int i;
+  assert(lengths != NULL);
 
-  enc = malloc(sizeof(*enc));
-  if (enc == NULL)
+  table = malloc(sizeof(*table));
+  if (table == NULL)
+    return NULL;
+
+  table->longBits = NULL;
+
+  /* Work out where the long codes go first, so they can be given their space in one go */
+  for (i = 0; i < 257; i++) {
+    assert(lengths[i] >= 0);
+
+    table->codes[i].bits = 0;
+    table->codes[i].length = lengths[i];
+    table->codes[i].longIdx = -1;
+
+    if (lengths[i] > HUFF_CODE_INLINE_BITS) {
+      table->codes[i].longIdx = longWords;
+      longWords += (lengths[i] + 63)/64;
+    }
+  }
+
+  if (longWords > 0) {
+    table->longBits = calloc(longWords, sizeof(*(table->longBits)));
+    if (table->longBits == NULL) {
+      free(table);
+      return NULL;
+    }
+  }
+
+  return table;
+}
+static void HuffCodeTableSetBit_(HuffCodeTable table, int c, int bitIdx)
+{
+  struct HuffCode *code;
+  assert(table != NULL);
+
+  code = &table->codes[c];
+  assert(bitIdx >= 0);
+  assert(bitIdx < code->length);
+
+  if (code->longIdx == -1)
+    code->bits |= (uint64_t)1 << bitIdx;
+  else
+    table->longBits[code->longIdx + bitIdx/64] |= (uint64_t)1 << (bitIdx % 64);
+}
+
+/* Decode table
+   Replaces walking the tree one bit at a time with lookups of several bits at once
+   The first level is indexed by the next |rootBits| bits of input (first bit in the lowest position)
+   Codes longer than that go through link entries into subtables, which may link further for very deep trees
+   It is built straight from a code table, so it works the same for tree-shaped and canonical codes */
+struct HuffDecodeEntry
+{
+  /* Start of the subtable for link entries */
+  uint32_t next;
+  /* Decoded symbol for leaf entries */
+  uint16_t symbol;
+  /* Number of input bits this entry consumes, or HUFF_DECODE_INVALID if no code starts with these bits */
+  uint8_t length;
+  /* Index width of the subtable for link entries, 0 for leaf entries */
+  uint8_t subBits;
+};
+#define HUFF_DECODE_INVALID 0xFF
+struct HuffDecodeTable_
+{
+  struct HuffDecodeEntry *entries;
+  int entryCount;
+  int entryCapacity;
+  int rootBits;
+};
+typedef struct HuffDecodeTable_ *HuffDecodeTable;
+
+static HuffDecodeTable HuffDecodeTableInit(HuffCodeTable codes);
+static void HuffDecodeTableDestroy(HuffDecodeTable table);
+/* Returns the offset of a new subtable with |bits| index bits and every entry invalid,
+   or -1 if there isn't enough memory */
+static int HuffDecodeTableAlloc_(HuffDecodeTable table, int bits);
+/* Adds the code for |c|, creating subtables along the way as needed
+   Returns -1 if there isn't enough memory
+   0 otherwise */
+static int HuffDecodeTableInsert_(HuffDecodeTable table, HuffCodeTable codes, int c);
+
+static HuffDecodeTable HuffDecodeTableInit(HuffCodeTable codes)
+{
+  HuffDecodeTable table;
+  int maxLength;
+  int length;
+  int res;
+  int i;
+  assert(codes != NULL);
+
+  table = malloc(sizeof(*table));
+  if (table == NULL)
     goto out;
 
-  enc->counter = HuffCounterCopy(counter);
-  if (enc->counter == NULL)
+  table->entries = NULL;
+  table->entryCount = 0;
+  table->entryCapacity = 0;
+
+  maxLength = HuffCodeTableMaxLength(codes);
+  assert(maxLength > 0);
+  table->rootBits = (maxLength < HUFF_DECODE_ROOT_BITS) ? maxLength : HUFF_DECODE_ROOT_BITS;
+
+  res = HuffDecodeTableAlloc_(table, table->rootBits);
+  if (res == -1)
     goto out1;
+  assert(res == 0);
+
+  /* Longest codes go in first, so a subtable is always sized for the longest code that ends up in it */
+  for (length = maxLength; length > 0; length--) {
+    for (i = 0; i < 257; i++) {
+      if (codes->codes[i].length != length)
+        continue;
+
+      res = HuffDecodeTableInsert_(table, codes, i);
+      if (res)
+        goto out1;
+    }
+  }
+
+  return table;
+out1:
+  HuffDecodeTableDestroy(table);
+  table = NULL;
+out:
+  return NULL;
+}
+static void HuffDecodeTableDestroy(HuffDecodeTable table)
+{
+  assert(table != NULL);
+
+  free(table->entries);
+  free(table);
+}
+static int HuffDecodeTableAlloc_(HuffDecodeTable table, int bits)
+{
+  int size;
+  int base;
+  int i;
+  assert(table != NULL);
+  assert(bits > 0);
+  assert(bits <= HUFF_DECODE_ROOT_BITS);
+
+  size = 1 << bits;
+  base = table->entryCount;
+
+  if (table->entryCapacity - base < size) {
+    struct HuffDecodeEntry *newEntries;
+    int newCapacity = (table->entryCapacity == 0) ? size : table->entryCapacity;
+    while (newCapacity - base < size) {
+      /* Can't get bigger due to overflow */
+      if (newCapacity > INT_MAX / 2 / (int)sizeof(*newEntries))
+        return -1;
+      newCapacity *= 2;
+    }
+
+    newEntries = realloc(table->entries, newCapacity*sizeof(*newEntries));
+    if (newEntries == NULL)
+      return -1;
+
+    table->entries = newEntries;
+    table->entryCapacity = newCapacity;
+  }
+
+  for (i = 0; i < size; i++) {
+    struct HuffDecodeEntry *entry = &table->entries[base + i];
+    entry->next = 0;
+    entry->symbol = 0;
+    entry->length = HUFF_DECODE_INVALID;
+    entry->subBits = 0;
+  }
+
+  table->entryCount += size;
+  return base;
+}
+static int HuffDecodeTableInsert_(HuffDecodeTable table, HuffCodeTable codes, int c)
+{
+  int length;
+  int consumed = 0;
+  int base = 0;
+  int tableBits;
+  int rest;
+  uint32_t i;
+  assert(table != NULL);
+  assert(codes != NULL);
+
+  length = codes->codes[c].length;
+  tableBits = table->rootBits;
+
+  /* Follow (or make) links until the rest of the code fits in one table */
+  while (length - consumed > tableBits) {
+    uint32_t idx = HuffCodeTableBits(codes, c, consumed, tableBits);
+    struct HuffDecodeEntry *entry = &table->entries[base + idx];
+
+    if (entry->subBits == 0) {
+      int subBits;
+      int subBase;
+      /* Nothing shorter has been added yet, so this can't be a leaf */
+      assert(entry->length == HUFF_DECODE_INVALID);
+
+      rest = length - consumed - tableBits;
+      subBits = (rest < HUFF_DECODE_ROOT_BITS) ? rest : HUFF_DECODE_ROOT_BITS;
+      subBase = HuffDecodeTableAlloc_(table, subBits);
+      if (subBase == -1)
+        return -1;
+
+      /* Careful, the allocation may have moved the entries */
+      entry = &table->entries[base + idx];
+      entry->next = (uint32_t)subBase;
+      entry->length = (uint8_t)tableBits;
+      entry->subBits = (uint8_t)subBits;
+    }
+
+    consumed += entry->length;
+    base = entry->next;
+    tableBits = entry->subBits;
+  }
+
+  /* Every index that starts with the rest of this code decodes to it */
+  rest = length - consumed;
+  assert(rest > 0);
+  for (i = HuffCodeTableBits(codes, c, consumed, rest); i < ((uint32_t)1 << tableBits); i += ((uint32_t)1 << rest)) {
+    struct HuffDecodeEntry *entry = &table->entries[base + i];
+    assert(entry->length == HUFF_DECODE_INVALID);
+    entry->symbol = (uint16_t)c;
+    entry->length = (uint8_t)rest;
+    entry->subBits = 0;
+    entry->next = 0;
+  }
+
+  return 0;
+}
+
+/* Decode cache
+   Decode tables that have been built, kept by the header they were built from, so a decoder that comes across the
+   same header again can skip straight to decoding
+   Entries are counted references - the cache holds one, and so does every decoder using the table - so an entry can
+   be dropped from the cache while decoders are still using it, and is freed once the last of them lets go
+   When it's full, the entry that was used longest ago makes way */
+struct HuffDecodeCacheEntry_
+{
+  uint64_t hash;
+  /* Copy of the header, right after the entry */
+  const uint8_t *header;
+  int headerSize;
+  HuffDecodeTable table;
+  int refs;
+  uint64_t lastUse;
+};
+struct HuffDecodeCache_
+{
+  struct HuffMutex_ mutex;
+  struct HuffDecodeCacheEntry_ **entries;
+  int entryCount;
+  int capacity;
+  uint64_t useCount;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+/* Returns the entry for |header| with a reference added for the caller, or NULL if there isn't one */
+static struct HuffDecodeCacheEntry_ *HuffDecodeCacheFind_(HuffDecodeCache cache, const uint8_t *header, int headerSize);
+/* Adds |table| as the table for |header|, and returns its entry with a reference added for the caller
+   The entry owns |table| from then on - if it returns NULL, there wasn't enough memory and the caller still does */
+static struct HuffDecodeCacheEntry_ *HuffDecodeCacheAdd_(HuffDecodeCache cache, const uint8_t *header, int headerSize,
+                                                         HuffDecodeTable table);
+/* Lets go of a reference from HuffDecodeCacheFind_ or HuffDecodeCacheAdd_ */
+static void HuffDecodeCacheRelease_(HuffDecodeCache cache, struct HuffDecodeCacheEntry_ *entry);
+/* The same, with the lock held */
+static void HuffDecodeCacheReleaseLocked_(struct HuffDecodeCacheEntry_ *entry);
+/* FNV-1a */
+static uint64_t HuffDecodeCacheHash_(const uint8_t *data, int length);
+
+HuffDecodeCache HuffDecodeCacheInit(int capacity)
+{
+  HuffDecodeCache cache;
+  assert(capacity > 0);
 
-  /* I know you might want a big data type, but... really? You don't need INT_MAX / 256 bytes */
-  assert(sizeof(ctr) <= INT_MAX / 256);
+  cache = malloc(sizeof(*cache));
+  if (cache == NULL)
+    goto out;
 
-  enc->counterBytesToWrite = 256*sizeof(ctr);
+  cache->entries = malloc(capacity*sizeof(*cache->entries));
+  if (cache->entries == NULL)
+    goto out1;
 
-  enc->tree = HuffTreeInit(enc->counter);
-  if (enc->tree == NULL)
+  if (HuffMutexInit_(&cache->mutex))
     goto out2;
 
-  if (initialBufferSize == 0)
-    initialBufferSize = HUFF_BUFFER_START;
+  cache->entryCount = 0;
+  cache->capacity = capacity;
+  cache->useCount = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+
+  return cache;
+out2:
+  free(cache->entries);
+out1:
+  free(cache);
+out:
+  return NULL;
+}
+void HuffDecodeCacheDestroy(HuffDecodeCache cache)
+{
+  int i;
+  assert(cache != NULL);
+
+  for (i = 0; i < cache->entryCount; i++)
+    HuffDecodeCacheReleaseLocked_(cache->entries[i]);
+
+  HuffMutexDestroy_(&cache->mutex);
+  free(cache->entries);
+  free(cache);
+}
+void HuffDecodeCacheStats(HuffDecodeCache cache, uint64_t *hits, uint64_t *misses)
+{
+  assert(cache != NULL);
+
+  HuffMutexLock_(&cache->mutex);
+  if (hits != NULL)
+    *hits = cache->hits;
+  if (misses != NULL)
+    *misses = cache->misses;
+  HuffMutexUnlock_(&cache->mutex);
+}
+static struct HuffDecodeCacheEntry_ *HuffDecodeCacheFind_(HuffDecodeCache cache, const uint8_t *header, int headerSize)
+{
+  struct HuffDecodeCacheEntry_ *found = NULL;
+  uint64_t hash;
+  int i;
+  assert(cache != NULL);
+  assert(header != NULL);
+
+  /* Hashing doesn't need the lock */
+  hash = HuffDecodeCacheHash_(header, headerSize);
+
+  HuffMutexLock_(&cache->mutex);
+
+  for (i = 0; i < cache->entryCount; i++) {
+    struct HuffDecodeCacheEntry_ *entry = cache->entries[i];
+
+    if (entry->hash == hash && entry->headerSize == headerSize && memcmp(entry->header, header, headerSize) == 0) {
+      found = entry;
+      break;
+    }
+  }
+
+  if (found != NULL) {
+    found->refs++;
+    found->lastUse = ++cache->useCount;
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+
+  HuffMutexUnlock_(&cache->mutex);
+  return found;
+}
+static struct HuffDecodeCacheEntry_ *HuffDecodeCacheAdd_(HuffDecodeCache cache, const uint8_t *header, int headerSize,
+                                                         HuffDecodeTable table)
+{
+  struct HuffDecodeCacheEntry_ *entry;
+  int i;
+  assert(cache != NULL);
+  assert(header != NULL);
+  assert(table != NULL);
+
+  entry = malloc(sizeof(*entry) + headerSize);
+  if (entry == NULL)
+    return NULL;
+
+  entry->hash = HuffDecodeCacheHash_(header, headerSize);
+  memcpy(entry + 1, header, headerSize);
+  entry->header = (const uint8_t *)(entry + 1);
+  entry->headerSize = headerSize;
+  entry->table = table;
+  /* One for the cache, one for the caller */
+  entry->refs = 2;
+
+  HuffMutexLock_(&cache->mutex);
+
+  /* Another decoder may have added the same header in the meantime - both entries work, and the older one
+     will be the first to go */
+  if (cache->entryCount == cache->capacity) {
+    int oldest = 0;
+
+    for (i = 1; i < cache->entryCount; i++) {
+      if (cache->entries[i]->lastUse < cache->entries[oldest]->lastUse)
+        oldest = i;
+    }
+
+    HuffDecodeCacheReleaseLocked_(cache->entries[oldest]);
+    cache->entries[oldest] = cache->entries[--cache->entryCount];
+  }
+
+  entry->lastUse = ++cache->useCount;
+  cache->entries[cache->entryCount++] = entry;
+
+  HuffMutexUnlock_(&cache->mutex);
+  return entry;
+}
+static void HuffDecodeCacheRelease_(HuffDecodeCache cache, struct HuffDecodeCacheEntry_ *entry)
+{
+  assert(cache != NULL);
+  assert(entry != NULL);
+
+  HuffMutexLock_(&cache->mutex);
+  HuffDecodeCacheReleaseLocked_(entry);
+  HuffMutexUnlock_(&cache->mutex);
+}
+static void HuffDecodeCacheReleaseLocked_(struct HuffDecodeCacheEntry_ *entry)
+{
+  assert(entry != NULL);
+  assert(entry->refs > 0);
+
+  if (--entry->refs == 0) {
+    HuffDecodeTableDestroy(entry->table);
+    free(entry);
+  }
+}
+static uint64_t HuffDecodeCacheHash_(const uint8_t *data, int length)
+{
+  uint64_t hash = 0xCBF29CE484222325ull;
+  int i;
+
+  for (i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001B3ull;
+  }
+
+  return hash;
+}
+
+/* Adaptive Huffman tree (FGK)
+   The code starts out empty and follows the data, both sides updating the tree the same way after every symbol, so
+   the data goes through once and there's no table to send
+   A symbol's first appearance is sent as the code of the NYT (not yet transmitted) leaf followed by the symbol in 9
+   bits, after which it gets a leaf of its own - the EOF is always sent that way, since nothing comes after it
+   The nodes are numbered so that weights never go down as the index goes up and siblings are next to each other,
+   with the root last - bumping a weight then only takes swapping a node with the last one of the same weight */
+#define HUFF_ADAPTIVE_NYT -1
+#define HUFF_ADAPTIVE_ESCAPE_BITS 9
+/* The 256 bytes plus the NYT - the EOF never gets a leaf */
+#define HUFF_ADAPTIVE_NODES (2*257 - 1)
+/* Most bytes one symbol can take - a code as deep as the tree, the escape, and the bits left over before it */
+#define HUFF_ADAPTIVE_PENDING_MAX ((7 + (HUFF_ADAPTIVE_NODES - 1)/2 + HUFF_ADAPTIVE_ESCAPE_BITS + 7)/8)
+struct HuffAdaptive_
+{
+  /* Leafs have a |c| of their symbol, or HUFF_ADAPTIVE_NYT */
+  struct HuffTreeNode nodes[HUFF_ADAPTIVE_NODES];
+  int root;
+  int nyt;
+  /* Index of each symbol's leaf, -1 if it hasn't shown up yet */
+  int leafs[257];
+
+  /* For encoding - bytes of the last symbol the output didn't have room for */
+  uint8_t pending[HUFF_ADAPTIVE_PENDING_MAX];
+  int pendingStart;
+  int pendingEnd;
+
+  /* For decoding - how far down the tree the current code has got, and a decoded symbol waiting for room */
+  int walk;
+  int symbol;
+};
+typedef struct HuffAdaptive_ *HuffAdaptive;
+
+static HuffAdaptive HuffAdaptiveInit(void);
+static void HuffAdaptiveDestroy(HuffAdaptive adaptive);
+/* Moves |c| up by one, giving it a leaf if it's new */
+static void HuffAdaptiveUpdate(HuffAdaptive adaptive, int c);
+/* Exchanges the subtrees at |a| and |b|, neither of which is an ancestor of the other */
+static void HuffAdaptiveSwap_(HuffAdaptive adaptive, int a, int b);
+/* Points everything that refers to the node at |idx| back at it */
+static void HuffAdaptiveRelink_(HuffAdaptive adaptive, int idx);
+
+static HuffAdaptive HuffAdaptiveInit(void)
+{
+  HuffAdaptive adaptive;
+  struct HuffTreeNode *root;
+  int i;
+
+  adaptive = malloc(sizeof(*adaptive));
+  if (adaptive == NULL)
+    return NULL;
+
+  /* Nothing but the NYT, which is the root, and whose code is no bits at all */
+  adaptive->root = HUFF_ADAPTIVE_NODES - 1;
+  adaptive->nyt = adaptive->root;
+  root = &adaptive->nodes[adaptive->root];
+  root->weight = 0;
+  root->parent = -1;
+  root->left = -1;
+  root->right = -1;
+  root->c = HUFF_ADAPTIVE_NYT;
+
+  for (i = 0; i < 257; i++)
+    adaptive->leafs[i] = -1;
+
+  adaptive->pendingStart = 0;
+  adaptive->pendingEnd = 0;
+  adaptive->walk = adaptive->root;
+  adaptive->symbol = -1;
+
+  return adaptive;
+}
+static void HuffAdaptiveDestroy(HuffAdaptive adaptive)
+{
+  assert(adaptive != NULL);
+
+  free(adaptive);
+}
+static void HuffAdaptiveUpdate(HuffAdaptive adaptive, int c)
+{
+  struct HuffTreeNode *nodes;
+  int idx;
+  assert(adaptive != NULL);
+  assert(c >= 0 && c < 256);
+
+  nodes = adaptive->nodes;
+
+  if (adaptive->leafs[c] == -1) {
+    /* The NYT turns into a parent, with the new NYT on the left and the new leaf on the right */
+    int parent = adaptive->nyt;
+    assert(parent >= 2);
+
+    nodes[parent].left = parent - 2;
+    nodes[parent].right = parent - 1;
+
+    nodes[parent - 1].weight = 0;
+    nodes[parent - 1].parent = parent;
+    nodes[parent - 1].left = -1;
+    nodes[parent - 1].right = -1;
+    nodes[parent - 1].c = c;
+
+    nodes[parent - 2].weight = 0;
+    nodes[parent - 2].parent = parent;
+    nodes[parent - 2].left = -1;
+    nodes[parent - 2].right = -1;
+    nodes[parent - 2].c = HUFF_ADAPTIVE_NYT;
+
+    adaptive->leafs[c] = parent - 1;
+    adaptive->nyt = parent - 2;
+  }
+
+  for (idx = adaptive->leafs[c]; idx != -1; idx = nodes[idx].parent) {
+    int leader = idx;
+
+    while (leader < adaptive->root && nodes[leader + 1].weight == nodes[idx].weight)
+      leader++;
+    /* The parent can only have the same weight if the other child is empty, and then the nodes in between are
+       the ones to swap with */
+    if (leader == nodes[idx].parent)
+      leader--;
+
+    if (leader != idx) {
+      HuffAdaptiveSwap_(adaptive, idx, leader);
+      idx = leader;
+    }
+
+    nodes[idx].weight++;
+  }
+}
+static void HuffAdaptiveSwap_(HuffAdaptive adaptive, int a, int b)
+{
+  struct HuffTreeNode *nodes;
+  struct HuffTreeNode swap;
+  assert(adaptive != NULL);
+  assert(a != b);
+
+  nodes = adaptive->nodes;
+
+  /* The positions stay where they are in the tree, only what hangs off of them moves */
+  swap = nodes[a];
+  nodes[a] = nodes[b];
+  nodes[b] = swap;
+  nodes[b].parent = nodes[a].parent;
+  nodes[a].parent = swap.parent;
+
+  HuffAdaptiveRelink_(adaptive, a);
+  HuffAdaptiveRelink_(adaptive, b);
+}
+static void HuffAdaptiveRelink_(HuffAdaptive adaptive, int idx)
+{
+  struct HuffTreeNode *node;
+  assert(adaptive != NULL);
+
+  node = &adaptive->nodes[idx];
+  if (node->left != -1) {
+    adaptive->nodes[node->left].parent = idx;
+    adaptive->nodes[node->right].parent = idx;
+  } else if (node->c == HUFF_ADAPTIVE_NYT) {
+    adaptive->nyt = idx;
+  } else {
+    adaptive->leafs[node->c] = idx;
+  }
+}
+
+/* Stream headers */
+
+/* Counts header
+   The count of each byte value as a 4 byte little-endian number, in byte value order */
+static void HuffHeaderWriteCounts(HuffCounter counter, uint8_t *out);
+/* Returns -1 if the counts don't make sense
+   0 otherwise */
+static int HuffHeaderReadCounts(const uint8_t *data, HuffCounter counter);
+
+/* Canonical header
+   "HUF" and the format byte, the length limit, then the code length of every symbol (EOF included)
+   as a run of bit-packed tokens, first bit in the lowest position:
+     0, then |width| bits   the next symbol's code length, |width| being however many bits the limit takes
+     10, then 8 bits n      the next n+1 symbols don't occur
+     11, then 3 bits n      the next n+1 symbols have the same length as the one before them
+   The tokens are padded out to a whole byte
+   No code is longer than the limit, so decoders can size their tables off of it
+   Without a limit set by the encoder, the limit is just the longest code */
+/* Works out code lengths for all the symbols that occur, leaving the rest at 0
+   If |maxLength| isn't 0, no code will be longer than it, and either way none will be longer than
+   HUFF_CANONICAL_MAX_LENGTH - the header only holds lengths, so it works for counts of any size
+   Returns -1 if there isn't enough memory
+   0 otherwise */
+static int HuffCanonicalLengths(HuffCounter counter, int maxLength, uint8_t *lengths);
+/* Works out the best code lengths that are no longer than |maxLength| (package-merge)
+   |weights| have to be sorted, lightest first, and there have to be between 2 and 2^|maxLength| of them
+   Returns -1 if there isn't enough memory
+   0 otherwise */
+static int HuffLimitedLengths_(const ctr *weights, int count, int maxLength, int *lengths);
+/* Writes the header with the given length limit, or with the longest length if |maxLength| is 0
+   Returns the size of the header */
+static int HuffHeaderWriteLengths(const uint8_t *lengths, int maxLength, uint8_t *out);
+/* Returns -1 if the header doesn't make sense,
+   1 if |length| bytes aren't enough to hold all of it,
+   0 otherwise, with the header size in |*headerSize| */
+static int HuffHeaderReadLengths(const uint8_t *data, int length, uint8_t *lengths, int *headerSize);
+/* Writes the tokens for the code lengths of |count| symbols at bit |*bitPos| of |buf|, which has to be cleared
+   beforehand - |maxLength| is the limit in the header */
+static void HuffHeaderPutLengths_(uint8_t *buf, int *bitPos, const uint8_t *lengths, int count, int maxLength);
+/* Reads them back, with the same return values as HuffHeaderReadLengths */
+static int HuffHeaderGetLengths_(const uint8_t *buf, int bitLength, int *bitPos, uint8_t *lengths, int count,
+                                 int maxLength);
+static void HuffHeaderPutBits_(uint8_t *buf, int *bitPos, uint32_t value, int count);
+/* Returns -1 if there aren't |count| bits left before |bitLength|
+   0 otherwise */
+static int HuffHeaderGetBits_(const uint8_t *buf, int bitLength, int *bitPos, int count, uint32_t *value);
+
+static void HuffHeaderWriteCounts(HuffCounter counter, uint8_t *out)
+{
+  int i;
+  int j;
+  assert(counter != NULL);
+  assert(out != NULL);
+
+  for (i = 0; i < 256; i++) {
+    uint32_t count = (uint32_t)HuffCounterCount(counter, (uint8_t)i);
+    for (j = 0; j < HUFF_COUNTS_WIDTH; j++)
+      out[i*HUFF_COUNTS_WIDTH + j] = (uint8_t)(count >> (8*j));
+  }
+}
+static int HuffHeaderReadCounts(const uint8_t *data, HuffCounter counter)
+{
+  ctr total = 1;
+  int i;
+  int j;
+  assert(data != NULL);
+  assert(counter != NULL);
+
+  for (i = 0; i < 256; i++) {
+    uint32_t count = 0;
+    for (j = 0; j < HUFF_COUNTS_WIDTH; j++)
+      count |= (uint32_t)data[i*HUFF_COUNTS_WIDTH + j] << (8*j);
+
+    /* Negative counts, or more data than a counter can hold, can't have come from an encoder */
+    if (count > (uint32_t)(HUFF_COUNTS_MAX - total))
+      return -1;
+
+    HuffCounterSetCount(counter, (uint8_t)i, (ctr)count);
+    total += (ctr)count;
+  }
+
+  counter->totalCount = total;
+  return 0;
+}
+static int HuffCanonicalLengths(HuffCounter counter, int maxLength, uint8_t *lengths)
+{
+  HuffTree tree;
+  ctr weights[257];
+  int symbols[257];
+  int depths[257];
+  int limited[257];
+  int treeMax = 0;
+  int count = 0;
+  int res;
+  int i;
+  assert(counter != NULL);
+  assert(maxLength == 0 || (maxLength >= HUFF_MINCODELENGTH && maxLength <= HUFF_MAXCODELENGTH));
+  assert(lengths != NULL);
+
+  tree = HuffTreeInit(counter, 1);
+  if (tree == NULL)
+    return -1;
+
+  HuffTreeLeafDepths(tree, depths);
+  for (i = 0; i < 257; i++) {
+    /* Counts are bounded, so depths are too (the Fibonacci sequence passes CTR_MAX at around 80)
+       That can still be deeper than a header can describe, which is dealt with below */
+    assert(depths[i] <= UINT8_MAX);
+    lengths[i] = (uint8_t)depths[i];
+    if (depths[i] > treeMax)
+      treeMax = depths[i];
+  }
+
+  /* A lone symbol still needs a code to be written with */
+  if (tree->nodes[tree->root].left == -1)
+    lengths[tree->nodes[tree->root].c] = 1;
+
+  HuffTreeDestroy(tree);
+
+  if (maxLength == 0 && treeMax > HUFF_CANONICAL_MAX_LENGTH)
+    maxLength = HUFF_CANONICAL_MAX_LENGTH;
+  if (maxLength == 0 || treeMax <= maxLength)
+    return 0;
+
+  /* The plain Huffman code is too deep, so start over with the limit in mind
+     Gather up the symbols that occur, lightest first (insertion sort, there are at most 257 of them) */
+  for (i = 0; i < 257; i++) {
+    ctr weight;
+    int j;
+    if (lengths[i] == 0)
+      continue;
+
+    weight = (i == HUFF_EOF_CHAR) ? 1 : HuffCounterCount(counter, (uint8_t)i);
+    for (j = count; j > 0 && weights[j-1] > weight; j--) {
+      weights[j] = weights[j-1];
+      symbols[j] = symbols[j-1];
+    }
+    weights[j] = weight;
+    symbols[j] = i;
+    count++;
+  }
+
+  res = HuffLimitedLengths_(weights, count, maxLength, limited);
+  if (res)
+    return -1;
+
+  for (i = 0; i < count; i++)
+    lengths[symbols[i]] = (uint8_t)limited[i];
+
+  return 0;
+}
+static int HuffLimitedLengths_(const ctr *weights, int count, int maxLength, int *lengths)
+{
+  /* Each level's list is the symbols merged with the pairs ("packages") of the level below it,
+     cut off at the 2*count - 2 lightest - no more than that ever gets used
+     Only whether each list item is a package has to be kept, since the symbols in a list are always
+     the lightest ones, in order */
+  int maxItems = 2*count - 2;
+  uint64_t *prevWeights;
+  uint64_t *curWeights;
+  uint8_t *isPackage;
+  int prevSize;
+  int level;
+  int take;
+  int i;
+  assert(weights != NULL);
+  assert(lengths != NULL);
+  assert(count >= 2);
+  assert(maxLength <= HUFF_CANONICAL_MAX_LENGTH && (uint64_t)count <= ((uint64_t)1 << maxLength));
+
+  prevWeights = malloc(maxItems*sizeof(*prevWeights));
+  curWeights = malloc(maxItems*sizeof(*curWeights));
+  isPackage = calloc(maxLength, maxItems);
+  if (prevWeights == NULL || curWeights == NULL || isPackage == NULL) {
+    free(prevWeights);
+    free(curWeights);
+    free(isPackage);
+    return -1;
+  }
+
+  /* The deepest level only has the symbols themselves */
+  for (i = 0; i < count; i++)
+    prevWeights[i] = (uint64_t)weights[i];
+  prevSize = count;
+
+  for (level = 1; level < maxLength; level++) {
+    uint64_t *swap;
+    int packages = prevSize/2;
+    int leafIdx = 0;
+    int packageIdx = 0;
+    int curSize = 0;
+
+    while (curSize < maxItems && (leafIdx < count || packageIdx < packages)) {
+      uint64_t packageWeight = 0;
+      if (packageIdx < packages)
+        packageWeight = prevWeights[2*packageIdx] + prevWeights[2*packageIdx + 1];
+
+      if (packageIdx == packages || (leafIdx < count && (uint64_t)weights[leafIdx] <= packageWeight)) {
+        curWeights[curSize] = (uint64_t)weights[leafIdx++];
+      } else {
+        curWeights[curSize] = packageWeight;
+        isPackage[level*maxItems + curSize] = 1;
+        packageIdx++;
+      }
+      curSize++;
+    }
+
+    swap = prevWeights;
+    prevWeights = curWeights;
+    curWeights = swap;
+    prevSize = curSize;
+  }
+
+  /* Take the lightest 2*count - 2 items from the top level, then follow the packages they use downwards
+     Each symbol's length is the number of levels it gets taken at */
+  for (i = 0; i < count; i++)
+    lengths[i] = 0;
+
+  take = maxItems;
+  for (level = maxLength - 1; level >= 0; level--) {
+    int packages = 0;
+    assert(take <= maxItems);
+
+    for (i = 0; i < take; i++) {
+      if (isPackage[level*maxItems + i])
+        packages++;
+    }
+
+    for (i = 0; i < take - packages; i++)
+      lengths[i]++;
+
+    take = 2*packages;
+  }
+  assert(take == 0);
+
+  free(prevWeights);
+  free(curWeights);
+  free(isPackage);
+  return 0;
+}
+static int HuffHeaderWriteLengths(const uint8_t *lengths, int maxLength, uint8_t *out)
+{
+  int bitPos;
+  int i;
+  assert(lengths != NULL);
+  assert(out != NULL);
+
+  for (i = 0; i < 257; i++) {
+    if (lengths[i] > maxLength) {
+      /* Only possible if there's no limit */
+      assert(lengths[i] <= HUFF_CANONICAL_MAX_LENGTH);
+      maxLength = lengths[i];
+    }
+  }
+  assert(maxLength > 0);
+  assert(maxLength <= HUFF_CANONICAL_MAX_LENGTH);
+
+  memset(out, 0, HUFF_CANONICAL_HEADER_MAX);
+  out[0] = 'H';
+  out[1] = 'U';
+  out[2] = 'F';
+  out[3] = HUFF_FORMAT_FLAG | HUFF_FORMAT_CANONICAL;
+  out[4] = (uint8_t)maxLength;
+  bitPos = (HUFF_MAGIC_SIZE + 1)*8;
+  HuffHeaderPutLengths_(out, &bitPos, lengths, 257, maxLength);
+
+  assert((bitPos + 7)/8 <= HUFF_CANONICAL_HEADER_MAX);
+  return (bitPos + 7)/8;
+}
+static int HuffHeaderReadLengths(const uint8_t *data, int length, uint8_t *lengths, int *headerSize)
+{
+  uint64_t kraftSum = 0;
+  int maxLength;
+  int bitPos;
+  int res;
+  int i;
+  assert(length == 0 || data != NULL);
+  assert(lengths != NULL);
+  assert(headerSize != NULL);
+
+  if (length < HUFF_MAGIC_SIZE + 1)
+    return 1;
+
+  if (data[0] != 'H' || data[1] != 'U' || data[2] != 'F' || data[3] != (HUFF_FORMAT_FLAG | HUFF_FORMAT_CANONICAL))
+    return -1;
+
+  maxLength = data[4];
+  if (maxLength == 0 || maxLength > HUFF_CANONICAL_MAX_LENGTH)
+    return -1;
+
+  bitPos = (HUFF_MAGIC_SIZE + 1)*8;
+  res = HuffHeaderGetLengths_(data, length*8, &bitPos, lengths, 257, maxLength);
+  if (res)
+    return res;
+
+  /* The codes have to fit in the code space, and the end of the stream has to be markable */
+  for (i = 0; i < 257; i++) {
+    if (lengths[i] != 0)
+      kraftSum += (uint64_t)1 << (maxLength - lengths[i]);
+  }
+  if (kraftSum > ((uint64_t)1 << maxLength) || lengths[HUFF_EOF_CHAR] == 0)
+    return -1;
+
+  *headerSize = (bitPos + 7)/8;
+  return 0;
+}
+static void HuffHeaderPutLengths_(uint8_t *buf, int *bitPos, const uint8_t *lengths, int count, int maxLength)
+{
+  int width = 0;
+  int prev = 0;
+  int i;
+  assert(buf != NULL);
+  assert(bitPos != NULL);
+  assert(lengths != NULL);
+
+  while ((1 << width) <= maxLength)
+    width++;
+
+  i = 0;
+  while (i < count) {
+    int run = 1;
+
+    if (lengths[i] == 0) {
+      while (i + run < count && run < 256 && lengths[i + run] == 0)
+        run++;
+      HuffHeaderPutBits_(buf, bitPos, 1, 1);
+      HuffHeaderPutBits_(buf, bitPos, 0, 1);
+      HuffHeaderPutBits_(buf, bitPos, run - 1, 8);
+    } else if (lengths[i] == prev) {
+      while (i + run < count && run < 8 && lengths[i + run] == prev)
+        run++;
+      HuffHeaderPutBits_(buf, bitPos, 1, 1);
+      HuffHeaderPutBits_(buf, bitPos, 1, 1);
+      HuffHeaderPutBits_(buf, bitPos, run - 1, 3);
+    } else {
+      assert(lengths[i] <= maxLength);
+      HuffHeaderPutBits_(buf, bitPos, 0, 1);
+      HuffHeaderPutBits_(buf, bitPos, lengths[i], width);
+    }
+
+    prev = lengths[i];
+    i += run;
+  }
+}
+static int HuffHeaderGetLengths_(const uint8_t *buf, int bitLength, int *bitPos, uint8_t *lengths, int count,
+                                 int maxLength)
+{
+  int width = 0;
+  int prev = 0;
+  int i;
+  assert(buf != NULL);
+  assert(bitPos != NULL);
+  assert(lengths != NULL);
+
+  while ((1 << width) <= maxLength)
+    width++;
+
+  i = 0;
+  while (i < count) {
+    uint32_t bit;
+    uint32_t value;
+    int run = 1;
+    int j;
+
+    if (HuffHeaderGetBits_(buf, bitLength, bitPos, 1, &bit))
+      return 1;
+
+    if (bit == 0) {
+      if (HuffHeaderGetBits_(buf, bitLength, bitPos, width, &value))
+        return 1;
+      if (value > (uint32_t)maxLength)
+        return -1;
+    } else {
+      if (HuffHeaderGetBits_(buf, bitLength, bitPos, 1, &bit))
+        return 1;
+
+      if (bit == 0) {
+        if (HuffHeaderGetBits_(buf, bitLength, bitPos, 8, &value))
+          return 1;
+        run = (int)value + 1;
+        value = 0;
+      } else {
+        if (HuffHeaderGetBits_(buf, bitLength, bitPos, 3, &value))
+          return 1;
+        run = (int)value + 1;
+        value = (uint32_t)prev;
+        if (value == 0)
+          return -1;
+      }
+    }
+
+    if (run > count - i)
+      return -1;
+
+    for (j = 0; j < run; j++)
+      lengths[i + j] = (uint8_t)value;
+
+    prev = (int)value;
+    i += run;
+  }
+
+  return 0;
+}
+static void HuffHeaderPutBits_(uint8_t *buf, int *bitPos, uint32_t value, int count)
+{
+  int i;
+  assert(buf != NULL);
+  assert(bitPos != NULL);
+
+  for (i = 0; i < count; i++) {
+    if ((value >> i) & 1)
+      buf[*bitPos / 8] |= (uint8_t)(1 << (*bitPos % 8));
+    (*bitPos)++;
+  }
+}
+static int HuffHeaderGetBits_(const uint8_t *buf, int bitLength, int *bitPos, int count, uint32_t *value)
+{
+  int i;
+  assert(buf != NULL);
+  assert(bitPos != NULL);
+  assert(value != NULL);
+
+  if (bitLength - *bitPos < count)
+    return -1;
+
+  *value = 0;
+  for (i = 0; i < count; i++) {
+    *value |= (uint32_t)((buf[*bitPos / 8] >> (*bitPos % 8)) & 1) << i;
+    (*bitPos)++;
+  }
+
+  return 0;
+}
+
+/* encoder */
+struct HuffEncoder_
+{
+  /* The whole header is worked out up front */
+  uint8_t header[HUFF_HEADER_MAX];
+  int headerSize;
+  int headerBytesToWrite;
+
+  /* Adaptive streams have the tree instead of a code table
+     With a shared table, the codes are the table's, and there's no header */
+  HuffCodeTable codes;
+  HuffAdaptive adaptive;
+  HuffTable shared;
+
+  /* Bytes that are ready to be written are the ones from readIdx up to byteIdx
+     Written bytes are only reclaimed when there's no room left at the end, so writing never has to move anything */
+  uint8_t* buffer;
+  size_t bufferSize;
+  size_t readIdx;
+  size_t byteIdx;
+
+  /* Bits that haven't made up a whole byte yet, first bit in the lowest position
+     Always fewer than 8 between symbols, except in a stream whose output filled up */
+  uint64_t bitBuf;
+  int bitCount;
+  /* Set once the EOF symbol has been added */
+  int ended;
+};
+
+static HuffEncoder HuffEncoderInitFormat_(HuffCounter counter, int initialBufferSize, int format, int maxCodeLength);
+/* Works out the header and codes, and sets up everything but the output buffer
+   Returns HUFF_SUCCESS, or an error code */
+static int HuffEncoderInitState_(HuffEncoder encoder, HuffCounter counter, int format, int maxCodeLength);
+/* Makes sure there are at least |byteCount| bytes free past byteIdx
+   Returns -1 if the buffer couldn't be made big enough
+   0 otherwise */
+static int HuffEncoderExpandBufferToFit_(HuffEncoder encoder, int byteCount);
+/* Returns HUFF_BADDATA if |data| has no code, HUFF_TOOMUCHDATA if the buffer can't grow enough */
+static int HuffEncoderFeedSingle_(HuffEncoder encoder, int data);
+/* Adds up to HUFF_CODE_INLINE_BITS bits and moves every finished byte into the buffer
+   The caller must make sure there are 8 bytes free past byteIdx */
+static void HuffEncoderPutBits_(HuffEncoder encoder, uint64_t bits, int count);
+static size_t HuffEncoderWriteHeaderBytes_(HuffEncoder encoder, uint8_t *buf, size_t length);
+/* Encodes as much of |data| into |out| as fits, writing out every finished byte
+   Only takes codes that are at most HUFF_CODE_INLINE_BITS long
+   |*bytesRead| is set to the number of bytes of |data| used up, |*bytesWritten| to the number of bytes put in |out|
+   Returns -1 if |data| holds a symbol that has no code,
+   1 if |out| filled up with finished bytes still waiting
+   0 otherwise */
+static int HuffEncoderEncode_(HuffEncoder encoder, const uint8_t *data, int length, int *bytesRead,
+                              uint8_t *out, int outLength, int *bytesWritten);
+/* HuffEncoderEncode_ for adaptive streams, which go through the pending bytes one symbol at a time
+   With |end| set, the EOF and the padding go in after the last of |data| */
+static int HuffEncoderEncodeAdaptive_(HuffEncoder encoder, const uint8_t *data, int length, int *bytesRead,
+                                      uint8_t *out, int outLength, int *bytesWritten, int end);
+/* Adds the adaptive code for |c| to the pending bytes and updates the tree */
+static void HuffEncoderPutAdaptive_(HuffEncoder encoder, int c);
+/* Returns how big the buffer has to be to hold all the code for |counter| at once, so it never has to grow */
+static size_t HuffEncoderExactBufferSize_(HuffEncoder encoder, HuffCounter counter);
+/* Works out the code lengths of the canonical code for |counter|, and returns the size of its stream, header included
+   Returns 0 if there isn't enough memory */
+static size_t HuffCanonicalStreamSize_(HuffCounter counter, int maxLength, uint8_t *lengths);
+/* Returns the number of bits |counts| (and the EOF) take with |lengths|, or UINT64_MAX if some of them have no code */
+static uint64_t HuffCodeBits_(const ctr *counts, const uint8_t *lengths);
+/* Returns log2(|x|) in fixed point with HUFF_LOG2_FRACTION_BITS fraction bits, |x| being more than 0
+   Every step rounds down, so it's never more than the real log, and less by under 2 in the last place */
+static uint64_t HuffLog2_(uint64_t x);
+
+HuffEncoder HuffEncoderInit(HuffCounter counter, int initialBufferSize)
+{
+  return HuffEncoderInitFormat_(counter, initialBufferSize, HUFF_FORMAT_COUNTS, 0);
+}
+HuffEncoder HuffEncoderInitCanonical(HuffCounter counter, int initialBufferSize, int maxCodeLength)
+{
+  assert(maxCodeLength == 0 || (maxCodeLength >= HUFF_MINCODELENGTH && maxCodeLength <= HUFF_MAXCODELENGTH));
+  return HuffEncoderInitFormat_(counter, initialBufferSize, HUFF_FORMAT_CANONICAL, maxCodeLength);
+}
+static HuffEncoder HuffEncoderInitFormat_(HuffCounter counter, int initialBufferSize, int format, int maxCodeLength)
+{
+  HuffEncoder enc;
+  size_t bufferSize;
+  assert(counter != NULL);
+  assert(initialBufferSize >= 0 || initialBufferSize == HUFF_BUFFER_EXACT);
+
+  enc = malloc(sizeof(*enc));
+  if (enc == NULL)
+    goto out;
+
+  if (HuffEncoderInitState_(enc, counter, format, maxCodeLength) != HUFF_SUCCESS)
+    goto out1;
+
+  if (initialBufferSize == HUFF_BUFFER_EXACT)
+    bufferSize = HuffEncoderExactBufferSize_(enc, counter);
+  else if (initialBufferSize == 0)
+    bufferSize = HUFF_BUFFER_START;
+  else
+    bufferSize = (size_t)initialBufferSize;
+
+  enc->buffer = malloc(bufferSize);
+  if (enc->buffer == NULL)
+    goto out2;
+
+  enc->bufferSize = bufferSize;
+  enc->readIdx = 0;
+  enc->byteIdx = 0;
+
+  return enc;
+out2:
+  HuffCodeTableDestroy(enc->codes);
+out1:
+  free(enc);
+  enc = NULL;
+out:
+  return NULL;
+}
+static int HuffEncoderInitState_(HuffEncoder encoder, HuffCounter counter, int format, int maxCodeLength)
+{
+  assert(encoder != NULL);
+  assert(counter != NULL || format == HUFF_FORMAT_ADAPTIVE);
+
+  encoder->codes = NULL;
+  encoder->adaptive = NULL;
+  encoder->shared = NULL;
+
+  if (format == HUFF_FORMAT_ADAPTIVE) {
+    encoder->header[0] = 'H';
+    encoder->header[1] = 'U';
+    encoder->header[2] = 'F';
+    encoder->header[3] = HUFF_FORMAT_FLAG | HUFF_FORMAT_ADAPTIVE;
+    encoder->headerSize = HUFF_MAGIC_SIZE;
+
+    encoder->adaptive = HuffAdaptiveInit();
+    if (encoder->adaptive == NULL)
+      return HUFF_NOMEM;
+  } else if (format == HUFF_FORMAT_COUNTS) {
+    HuffTree tree;
+
+    /* The counts have to fit in the header */
+    if (counter->totalCount > HUFF_COUNTS_MAX)
+      return HUFF_TOOMUCHDATA;
+
+    HuffHeaderWriteCounts(counter, encoder->header);
+    encoder->headerSize = HUFF_COUNTS_HEADER_SIZE;
+
+    /* The tree is only needed long enough to read the codes off of it */
+    tree = HuffTreeInit(counter, 0);
+    if (tree == NULL)
+      return HUFF_NOMEM;
+
+    encoder->codes = HuffCodeTableInit(tree);
+    HuffTreeDestroy(tree);
+  } else {
+    uint8_t lengths[257];
+    int res;
+    assert(format == HUFF_FORMAT_CANONICAL);
+
+    res = HuffCanonicalLengths(counter, maxCodeLength, lengths);
+    if (res)
+      return HUFF_NOMEM;
+
+    encoder->headerSize = HuffHeaderWriteLengths(lengths, maxCodeLength, encoder->header);
+    encoder->codes = HuffCodeTableInitCanonical(lengths);
+  }
+
+  if (encoder->codes == NULL && encoder->adaptive == NULL)
+    return HUFF_NOMEM;
+
+  encoder->headerBytesToWrite = encoder->headerSize;
+  encoder->bitBuf = 0;
+  encoder->bitCount = 0;
+  encoder->ended = 0;
+
+  return HUFF_SUCCESS;
+}
+void HuffEncoderDestroy(HuffEncoder encoder)
+{
+  assert(encoder != NULL);
+
+  if (encoder->codes != NULL && encoder->shared == NULL)
+    HuffCodeTableDestroy(encoder->codes);
+  if (encoder->adaptive != NULL)
+    HuffAdaptiveDestroy(encoder->adaptive);
+  free(encoder->buffer);
+  free(encoder);
+}
+int HuffEncoderFeedData(HuffEncoder encoder, const uint8_t *data, int length, int *processed)
+{
+  size_t processed64 = 0;
+  int ret;
+  assert(length >= 0);
+  assert(length == 0 || processed != NULL);
+
+  ret = HuffEncoderFeedData64(encoder, data, (size_t)length, &processed64);
+  if (length > 0)
+    *processed = (int)processed64;
+  return ret;
+}
+int HuffEncoderFeedData64(HuffEncoder encoder, const uint8_t *data, size_t length, size_t *processed)
+{
+  const struct HuffCode *codes;
+  uint8_t *buffer;
+  size_t bufferSize;
+  size_t byteIdx;
+  uint64_t bitBuf;
+  int bitCount;
+  size_t i;
+  int ret = HUFF_SUCCESS;
+  assert(encoder != NULL);
+  assert(length == 0 || data != NULL);
+  assert(length == 0 || processed != NULL);
+
+  /* Work on locals so the compiler can keep them in registers */
+  codes = encoder->codes->codes;
+  buffer = encoder->buffer;
+  bufferSize = encoder->bufferSize;
+  byteIdx = encoder->byteIdx;
+  bitBuf = encoder->bitBuf;
+  bitCount = encoder->bitCount;
+
+  for (i = 0; i < length; i++) {
+    const struct HuffCode *code = &codes[data[i]];
+
+    if (code->length > HUFF_CODE_INLINE_BITS || code->length == 0 || bufferSize - byteIdx < 8) {
+      /* Long code, uncounted byte or nearly full buffer, let the general version deal with it */
+      int res;
+      encoder->byteIdx = byteIdx;
+      encoder->bitBuf = bitBuf;
+      encoder->bitCount = bitCount;
+
+      res = HuffEncoderFeedSingle_(encoder, data[i]);
+
+      buffer = encoder->buffer;
+      bufferSize = encoder->bufferSize;
+      byteIdx = encoder->byteIdx;
+      bitBuf = encoder->bitBuf;
+      bitCount = encoder->bitCount;
+
+      if (res != HUFF_SUCCESS) {
+        ret = res;
+        break;
+      }
+      continue;
+    }
+
+    /* Add the code, then store the whole word and keep only the bits past the last finished byte */
+    bitBuf |= code->bits << bitCount;
+    bitCount += code->length;
+    HuffStoreLE64_(buffer + byteIdx, bitBuf);
+    byteIdx += bitCount >> 3;
+    bitBuf >>= bitCount & ~7;
+    bitCount &= 7;
+  }
+
+  encoder->byteIdx = byteIdx;
+  encoder->bitBuf = bitBuf;
+  encoder->bitCount = bitCount;
+
+  *processed = i;
+  return ret;
+}
+int HuffEncoderEndData(HuffEncoder encoder)
+{
+  int res;
+  assert(encoder != NULL);
+
+  res = HuffEncoderFeedSingle_(encoder, HUFF_EOF_CHAR);
+  if (res != HUFF_SUCCESS)
+    return res;
+  encoder->ended = 1;
+
+  /* Pad out the last partial byte so it gets written too */
+  if (encoder->bitCount > 0) {
+    res = HuffEncoderExpandBufferToFit_(encoder, 1);
+    if (res)
+      return HUFF_TOOMUCHDATA;
+
+    encoder->buffer[encoder->byteIdx++] = (uint8_t)encoder->bitBuf;
+    encoder->bitBuf = 0;
+    encoder->bitCount = 0;
+  }
+
+  return HUFF_SUCCESS;
+}
+int HuffEncoderByteCount(HuffEncoder encoder)
+{
+  return HuffClamp_(HuffEncoderByteCount64(encoder));
+}
+size_t HuffEncoderByteCount64(HuffEncoder encoder)
+{
+  assert(encoder != NULL);
+  return (encoder->byteIdx - encoder->readIdx) + encoder->headerBytesToWrite;
+}
+int HuffEncoderWriteBytes(HuffEncoder encoder, uint8_t *buf, int length)
+{
+  assert(length >= 0);
+
+  return (int)HuffEncoderWriteBytes64(encoder, buf, (size_t)length);
+}
+size_t HuffEncoderWriteBytes64(HuffEncoder encoder, uint8_t *buf, size_t length)
+{
+  size_t headerWriteCount;
+  size_t toWrite;
+  size_t byteCount;
+  assert(encoder != NULL);
+  assert(length == 0 || buf != NULL);
+
+  headerWriteCount = HuffEncoderWriteHeaderBytes_(encoder, buf, length);
+
+  length -= headerWriteCount;
+
+  byteCount = encoder->byteIdx - encoder->readIdx;
+  toWrite = (length < byteCount) ? length : byteCount;
+
+  if (toWrite > 0) {
+    memcpy(buf + headerWriteCount, encoder->buffer + encoder->readIdx, toWrite);
+    encoder->readIdx += toWrite;
+
+    /* Once everything has been written, start over at the front for free */
+    if (encoder->readIdx == encoder->byteIdx) {
+      encoder->readIdx = 0;
+      encoder->byteIdx = 0;
+    }
+  }
+
+  return headerWriteCount + toWrite;
+}
+size_t HuffCounterEncodedSize(HuffCounter counter, int maxCodeLength)
+{
+  uint8_t lengths[257];
+  assert(counter != NULL);
+  assert(maxCodeLength == 0 || (maxCodeLength >= HUFF_MINCODELENGTH && maxCodeLength <= HUFF_MAXCODELENGTH));
+
+  return HuffCanonicalStreamSize_(counter, maxCodeLength, lengths);
+}
+size_t HuffCounterEntropyBound(HuffCounter counter)
+{
+  uint64_t logTotal;
+  uint64_t bits = 0;
+  uint64_t mask = ((uint64_t)1 << HUFF_LOG2_FRACTION_BITS) - 1;
+  int i;
+  assert(counter != NULL);
+
+  /* The EOF isn't data, and a code for it only makes the others longer, so it's left out */
+  if (counter->totalCount <= 1)
+    return 0;
+  logTotal = HuffLog2_((uint64_t)counter->totalCount - 1);
+
+  for (i = 0; i < 256; i++) {
+    uint64_t count = (uint64_t)counter->counts[i];
+    uint64_t logCount;
+    uint64_t diff;
+    if (count == 0)
+      continue;
+
+    /* Rounding the count's log up and the total's down keeps this a bound */
+    logCount = HuffLog2_(count) + 2;
+    if (logCount >= logTotal)
+      continue;
+    diff = logTotal - logCount;
+
+    /* count*diff, split up so it can't overflow */
+    bits += (count >> HUFF_LOG2_FRACTION_BITS)*diff + (((count & mask)*diff) >> HUFF_LOG2_FRACTION_BITS);
+  }
+
+  return (size_t)(bits / 8);
+}
+static int HuffEncoderFeedSingle_(HuffEncoder encoder, int data)
+{
+  const struct HuffCode *code;
+  int res;
+  assert(encoder != NULL);
+  assert(data >= 0);
+  assert(data <= 256);
+
+  code = &encoder->codes->codes[data];
+  if (code->length == 0)
+    return HUFF_BADDATA;
+
+  /* Room for every byte the code can finish, plus the 8 bytes the last flush stores */
+  res = HuffEncoderExpandBufferToFit_(encoder, code->length/8 + 9);
+  if (res)
+    return HUFF_TOOMUCHDATA;
+
+  if (code->longIdx == -1) {
+    HuffEncoderPutBits_(encoder, code->bits, code->length);
+  } else {
+    /* Feed long codes through in 32 bit pieces, which never straddle a word */
+    const uint64_t *words = encoder->codes->longBits + code->longIdx;
+    int bitIdx = 0;
+
+    while (bitIdx < code->length) {
+      int count = code->length - bitIdx;
+      uint64_t piece;
+      if (count > 32)
+        count = 32;
+
+      piece = (words[bitIdx/64] >> (bitIdx % 64)) & (((uint64_t)1 << count) - 1);
+      HuffEncoderPutBits_(encoder, piece, count);
+
+      bitIdx += count;
+    }
+  }
+
+  return HUFF_SUCCESS;
+}
+static void HuffEncoderPutBits_(HuffEncoder encoder, uint64_t bits, int count)
+{
+  assert(encoder != NULL);
+  assert(count > 0);
+  assert(count <= HUFF_CODE_INLINE_BITS);
+  assert(encoder->bitCount < 8);
+  assert(encoder->bufferSize - encoder->byteIdx >= 8);
+
+  encoder->bitBuf |= bits << encoder->bitCount;
+  encoder->bitCount += count;
+
+  HuffStoreLE64_(encoder->buffer + encoder->byteIdx, encoder->bitBuf);
+  encoder->byteIdx += encoder->bitCount >> 3;
+  encoder->bitBuf >>= encoder->bitCount & ~7;
+  encoder->bitCount &= 7;
+}
+static int HuffEncoderExpandBufferToFit_(HuffEncoder encoder, int byteCount)
+{
+  assert(encoder != NULL);
+  assert(encoder->byteIdx >= encoder->readIdx);
+  assert(byteCount >= 0);
+
+  /* Reclaim the written bytes at the front first, as long as there are at least as many of them as there are bytes
+     to move - that way moving a byte is always paid for by writing one */
+  if (encoder->bufferSize - encoder->byteIdx < (size_t)byteCount
+      && encoder->readIdx >= encoder->byteIdx - encoder->readIdx) {
+    size_t pending = encoder->byteIdx - encoder->readIdx;
+    memmove(encoder->buffer, encoder->buffer + encoder->readIdx, pending);
+    encoder->readIdx = 0;
+    encoder->byteIdx = pending;
+  }
+
+  while (encoder->bufferSize - encoder->byteIdx < (size_t)byteCount) {
+    uint8_t *newBuffer;
+    /* There isn't enough space - attempt to get bigger */
+    if (encoder->bufferSize > SIZE_MAX / 2)
+      /* Can't get bigger due to overflow */
+      return -1;
+
+    newBuffer = realloc(encoder->buffer, encoder->bufferSize*2);
+    if (newBuffer == NULL)
+      /* Couldn't get bigger due to lack of memory */
+      return -1;
+
+    encoder->buffer = newBuffer;
+    encoder->bufferSize *= 2;
+  }
+
+  return 0;
+}
+static size_t HuffEncoderWriteHeaderBytes_(HuffEncoder encoder, uint8_t *buf, size_t length)
+{
+  size_t toWrite;
+  assert(encoder != NULL);
+  assert(length == 0 || buf != NULL);
+
+  toWrite = (length < (size_t)encoder->headerBytesToWrite) ? length : (size_t)encoder->headerBytesToWrite;
+
+  if (toWrite > 0) {
+    memcpy(buf, encoder->header + (encoder->headerSize - encoder->headerBytesToWrite), toWrite);
+    encoder->headerBytesToWrite -= (int)toWrite;
+  }
+
+  return toWrite;
+}
+static int HuffEncoderEncode_(HuffEncoder encoder, const uint8_t *data, int length, int *bytesRead,
+                              uint8_t *out, int outLength, int *bytesWritten)
+{
+  const struct HuffCode *codes;
+  const uint8_t *cur;
+  const uint8_t *end;
+  uint8_t *outCur;
+  uint8_t *outEnd;
+  uint64_t bitBuf;
+  int bitCount;
+  int ret = 0;
+  assert(encoder != NULL);
+  assert(length == 0 || data != NULL);
+  assert(outLength == 0 || out != NULL);
+  assert(bytesRead != NULL);
+  assert(bytesWritten != NULL);
+
+  if (encoder->adaptive != NULL)
+    return HuffEncoderEncodeAdaptive_(encoder, data, length, bytesRead, out, outLength, bytesWritten, 0);
+
+  /* Work on locals so the compiler can keep them in registers */
+  codes = encoder->codes->codes;
+  bitBuf = encoder->bitBuf;
+  bitCount = encoder->bitCount;
+  cur = data;
+  end = data + length;
+  outCur = out;
+  outEnd = out + outLength;
+
+  for (;;) {
+    const struct HuffCode *code;
+
+    /* Every finished byte has to go out before the next code can be added */
+    while (bitCount >= 8 && outCur < outEnd) {
+      *outCur++ = (uint8_t)bitBuf;
+      bitBuf >>= 8;
+      bitCount -= 8;
+    }
+    if (bitCount >= 8) {
+      ret = 1;
+      break;
+    }
+    if (cur == end)
+      break;
+
+    code = &codes[*cur];
+    if (code->length == 0) {
+      ret = -1;
+      break;
+    }
+    assert(code->length <= HUFF_CODE_INLINE_BITS);
+    cur++;
+
+    bitBuf |= code->bits << bitCount;
+    bitCount += code->length;
+
+    /* With 8 bytes of room, store the whole word and keep only the bits past the last finished byte */
+    if (outEnd - outCur >= 8) {
+      HuffStoreLE64_(outCur, bitBuf);
+      outCur += bitCount >> 3;
+      bitBuf >>= bitCount & ~7;
+      bitCount &= 7;
+    }
+  }
+
+  encoder->bitBuf = bitBuf;
+  encoder->bitCount = bitCount;
+
+  *bytesRead = (int)(cur - data);
+  *bytesWritten = (int)(outCur - out);
+  return ret;
+}
+
+static int HuffEncoderEncodeAdaptive_(HuffEncoder encoder, const uint8_t *data, int length, int *bytesRead,
+                                      uint8_t *out, int outLength, int *bytesWritten, int end)
+{
+  HuffAdaptive adaptive;
+  const uint8_t *cur;
+  int written = 0;
+  int ret = 0;
+  assert(encoder != NULL);
+  assert(encoder->adaptive != NULL);
+  assert(length == 0 || data != NULL);
+  assert(outLength == 0 || out != NULL);
+  assert(bytesRead != NULL);
+  assert(bytesWritten != NULL);
+
+  adaptive = encoder->adaptive;
+  cur = data;
+
+  for (;;) {
+    /* Whatever's left of the last symbol goes first, so bytes go out as soon as they're finished */
+    int toWrite = adaptive->pendingEnd - adaptive->pendingStart;
+    if (toWrite > outLength - written)
+      toWrite = outLength - written;
+    if (toWrite > 0) {
+      memcpy(out + written, adaptive->pending + adaptive->pendingStart, toWrite);
+      adaptive->pendingStart += toWrite;
+      written += toWrite;
+    }
+    if (adaptive->pendingStart < adaptive->pendingEnd) {
+      ret = 1;
+      break;
+    }
+    adaptive->pendingStart = 0;
+    adaptive->pendingEnd = 0;
+
+    if (cur < data + length) {
+      HuffEncoderPutAdaptive_(encoder, *cur++);
+    } else if (end && !encoder->ended) {
+      HuffEncoderPutAdaptive_(encoder, HUFF_EOF_CHAR);
+      encoder->ended = 1;
+
+      /* Pad out the last partial byte */
+      if (encoder->bitCount > 0) {
+        adaptive->pending[adaptive->pendingEnd++] = (uint8_t)encoder->bitBuf;
+        encoder->bitBuf = 0;
+        encoder->bitCount = 0;
+      }
+    } else {
+      break;
+    }
+  }
+
+  *bytesRead = (int)(cur - data);
+  *bytesWritten = written;
+  return ret;
+}
+static void HuffEncoderPutAdaptive_(HuffEncoder encoder, int c)
+{
+  HuffAdaptive adaptive;
+  const struct HuffTreeNode *nodes;
+  /* The code comes out leaf first walking up the tree, so it's collected and then put out the other way round */
+  uint8_t path[(HUFF_ADAPTIVE_NODES - 1)/2];
+  int depth = 0;
+  int idx;
+  int count;
+  assert(encoder != NULL);
+  assert(encoder->adaptive != NULL);
+  assert(c >= 0 && c <= HUFF_EOF_CHAR);
+
+  adaptive = encoder->adaptive;
+  nodes = adaptive->nodes;
+  assert(adaptive->pendingEnd == 0);
+
+  idx = adaptive->leafs[c];
+  if (idx == -1)
+    idx = adaptive->nyt;
+
+  while (idx != adaptive->root) {
+    int parent = nodes[idx].parent;
+    assert(depth < (int)sizeof(path));
+
+    path[depth++] = (uint8_t)(nodes[parent].right == idx);
+    idx = parent;
+  }
+
+  while (depth > 0) {
+    encoder->bitBuf |= (uint64_t)path[--depth] << encoder->bitCount;
+    encoder->bitCount++;
+    if (encoder->bitCount == 8) {
+      adaptive->pending[adaptive->pendingEnd++] = (uint8_t)encoder->bitBuf;
+      encoder->bitBuf = 0;
+      encoder->bitCount = 0;
+    }
+  }
+
+  if (adaptive->leafs[c] == -1) {
+    /* Escaped - the symbol itself follows */
+    encoder->bitBuf |= (uint64_t)c << encoder->bitCount;
+    encoder->bitCount += HUFF_ADAPTIVE_ESCAPE_BITS;
+    for (count = encoder->bitCount / 8; count > 0; count--) {
+      adaptive->pending[adaptive->pendingEnd++] = (uint8_t)encoder->bitBuf;
+      encoder->bitBuf >>= 8;
+      encoder->bitCount -= 8;
+    }
+  }
+  assert(adaptive->pendingEnd <= HUFF_ADAPTIVE_PENDING_MAX);
+
+  if (c != HUFF_EOF_CHAR)
+    HuffAdaptiveUpdate(adaptive, c);
+}
+static size_t HuffEncoderExactBufferSize_(HuffEncoder encoder, HuffCounter counter)
+{
+  const struct HuffCode *codes;
+  uint64_t bits;
+  uint64_t bytes;
+  int i;
+  assert(encoder != NULL);
+  assert(encoder->codes != NULL);
+  assert(counter != NULL);
+
+  codes = encoder->codes->codes;
+  bits = (uint64_t)codes[HUFF_EOF_CHAR].length;
+  for (i = 0; i < 256; i++)
+    bits += (uint64_t)counter->counts[i]*codes[i].length;
+
+  /* Plus the room HuffEncoderFeedSingle_ wants past the end for the longest code */
+  bytes = (bits + 7) / 8 + HuffCodeTableMaxLength(encoder->codes) / 8 + 9;
+  return (bytes > SIZE_MAX) ? SIZE_MAX : (size_t)bytes;
+}
+static size_t HuffCanonicalStreamSize_(HuffCounter counter, int maxLength, uint8_t *lengths)
+{
+  uint8_t header[HUFF_CANONICAL_HEADER_MAX];
+  uint64_t size;
+  int headerSize;
+  assert(counter != NULL);
+  assert(lengths != NULL);
+
+  if (HuffCanonicalLengths(counter, maxLength, lengths))
+    return 0;
+  headerSize = HuffHeaderWriteLengths(lengths, maxLength, header);
+
+  /* The counts are held to 2^56 all told and no code is longer than 56 bits, so the bits fit */
+  size = headerSize + (HuffCodeBits_(counter->counts, lengths) + 7) / 8;
+  return (size > SIZE_MAX) ? SIZE_MAX : (size_t)size;
+}
+static uint64_t HuffCodeBits_(const ctr *counts, const uint8_t *lengths)
+{
+  uint64_t bits = lengths[HUFF_EOF_CHAR];
+  int i;
+  assert(counts != NULL);
+  assert(lengths != NULL);
+
+  if (lengths[HUFF_EOF_CHAR] == 0)
+    return UINT64_MAX;
+  for (i = 0; i < 256; i++) {
+    if (counts[i] == 0)
+      continue;
+    if (lengths[i] == 0)
+      return UINT64_MAX;
+    bits += (uint64_t)counts[i]*lengths[i];
+  }
+
+  return bits;
+}
+static uint64_t HuffLog2_(uint64_t x)
+{
+  uint64_t result;
+  uint64_t m;
+  int top = 63;
+  int i;
+  assert(x > 0);
+
+  while (!(x >> top))
+    top--;
+  result = (uint64_t)top << HUFF_LOG2_FRACTION_BITS;
+
+  /* The rest is the log of x/2^top, which is in [1, 2) - held with 31 fraction bits, squaring it doubles its log,
+     so each time it goes past 2 there's another 1 bit */
+  m = (top >= 31) ? x >> (top - 31) : x << (31 - top);
+  for (i = HUFF_LOG2_FRACTION_BITS - 1; i >= 0; i--) {
+    m = (m*m) >> 31;
+    if (m >> 32) {
+      m >>= 1;
+      result |= (uint64_t)1 << i;
+    }
+  }
+
+  return result;
+}
+
+/* decoder */
+struct HuffDecoder_
+{
+  /* Header bytes are collected here until there's enough to make sense of them */
+  uint8_t header[HUFF_HEADER_MAX];
+  int headerBytesRead;
+
+  /* NULL until the header has been read - adaptive streams get the tree instead
+     With a shared table it's the table's from the start, and there's no header */
+  HuffDecodeTable table;
+  HuffAdaptive adaptive;
+  HuffTable shared;
+  /* With a cache, tables are looked for there first, and |table| is |cached|'s once there's a header */
+  HuffDecodeCache cache;
+  struct HuffDecodeCacheEntry_ *cached;
+
+  /* Decoded bytes waiting to be written are the ones from readIdx up to byteIdx, like the encoder's */
+  uint8_t* buffer;
+  size_t bufferSize;
+  size_t readIdx;
+  size_t byteIdx;
+
+  /* Input bits that have been read but not decoded yet, first bit in the lowest position */
+  uint64_t bitBuf;
+  int bitCount;
+  /* Table lookup position, so codes can span FeedData calls */
+  int tableOffset;
+  int tableBits;
+  /* Set once the EOF symbol has been decoded */
+  int finished;
+};
+
+/* Reads header bytes from |data| until the header is done, then sets up the decode table
+   |*bytesRead| is set to the number of bytes of |data| that were part of the header
+   Returns HUFF_SUCCESS, or an error code */
+static int HuffDecoderFeedHeaderData_(HuffDecoder decoder, const uint8_t *data, int length, int *bytesRead);
+/* Builds the code table described by the collected header bytes, or the decoder's adaptive tree, or takes the decode
+   table from the cache
+   Returns HUFF_SUCCESS, or an error code
+   |*codes| is left NULL if the header isn't all there yet, the stream is adaptive or the cache had the table, and
+   |*headerSize| is set in all but the first case */
+static int HuffDecoderParseHeader_(HuffDecoder decoder, HuffCodeTable *codes, int *headerSize);
+/* Takes the table for the collected header from the cache, if it's there
+   Returns 1 if it was, 0 otherwise */
+static int HuffDecoderUseCache_(HuffDecoder decoder, int headerSize);
+/* Sets up everything but the output buffer */
+static void HuffDecoderInitState_(HuffDecoder decoder);
+/* Frees, or lets go of, whatever the decoder decodes with */
+static void HuffDecoderReleaseTables_(HuffDecoder decoder);
+/* Decodes as many symbols as the buffered bits plus |data| allow into |out|
+   A symbol is only taken out of the input once there's room for it, so nothing is ever held back
+   |*bytesRead| is set to the number of bytes of |data| used up, |*bytesWritten| to the number of bytes put in |out|
+   Returns -1 if the input holds something that isn't a code,
+   1 if |out| filled up before the input ran out
+   0 otherwise */
+static int HuffDecoderDecode_(HuffDecoder decoder, const uint8_t *data, int length, int *bytesRead,
+                              uint8_t *out, int outLength, int *bytesWritten);
+/* HuffDecoderDecode_ for adaptive streams, which walk the tree a bit at a time
+   Input is only taken a byte at a time as the bits are needed, so nothing past the EOF's byte is ever read */
+static int HuffDecoderDecodeAdaptive_(HuffDecoder decoder, const uint8_t *data, int length, int *bytesRead,
+                                      uint8_t *out, int outLength, int *bytesWritten);
+/* Makes room for at least one more byte past byteIdx
+   Returns -1 if the buffer couldn't be made big enough
+   0 otherwise */
+static int HuffDecoderExpandBuffer_(HuffDecoder decoder);
+
+HuffDecoder HuffDecoderInit(int initialBufferSize)
+{
+  HuffDecoder dec = malloc(sizeof(*dec));
+  if (dec == NULL)
+    goto out;
+
+  HuffDecoderInitState_(dec);
+
+  if (initialBufferSize == 0)
+    initialBufferSize = HUFF_BUFFER_START;
+
+  dec->buffer = malloc(initialBufferSize);
+  if (dec->buffer == NULL)
+    goto out1;
+
+  dec->bufferSize = initialBufferSize;
+  dec->readIdx = 0;
+  dec->byteIdx = 0;
+
+  return dec;
+
+out1:
+  free(dec);
+  dec = NULL;
+out:
+  return NULL;
+}
+
+void HuffDecoderDestroy(HuffDecoder decoder)
+{
+  assert(decoder != NULL);
+
+  HuffDecoderReleaseTables_(decoder);
+  free(decoder->buffer);
+  free(decoder);
+}
+
+void HuffDecoderSetCache(HuffDecoder decoder, HuffDecodeCache cache)
+{
+  assert(decoder != NULL);
+  assert(decoder->headerBytesRead == 0 && decoder->table == NULL);
+
+  decoder->cache = cache;
+}
+
+int HuffDecoderFeedData(HuffDecoder decoder, const uint8_t *data, int length, int *processed)
+{
+  size_t processed64 = 0;
+  int ret;
+  assert(length >= 0);
+  assert(length == 0 || processed != NULL);
+
+  ret = HuffDecoderFeedData64(decoder, data, (size_t)length, &processed64);
+  if (length > 0)
+    *processed = (int)processed64;
+  return ret;
+}
+int HuffDecoderFeedData64(HuffDecoder decoder, const uint8_t *data, size_t length, size_t *processed)
+{
+  int ret = HUFF_NOMEM;
+  int headerBytesRead = 0;
+  size_t charBytesRead = 0;
+  assert(decoder != NULL);
+  assert(length == 0 || data != NULL);
+  assert(length == 0 || processed != NULL);
+
+  ret = HuffDecoderFeedHeaderData_(decoder, data, HuffClamp_(length), &headerBytesRead);
+  if (ret != HUFF_SUCCESS)
+    goto out;
+
+  length -= headerBytesRead;
+  data += headerBytesRead;
+
+  if ((decoder->table != NULL || decoder->adaptive != NULL) && !decoder->finished) {
+    for (;;) {
+      int bytesRead;
+      int bytesWritten;
+      int res;
+
+      res = HuffDecoderDecode_(decoder, data, HuffClamp_(length), &bytesRead,
+                               decoder->buffer + decoder->byteIdx, HuffClamp_(decoder->bufferSize - decoder->byteIdx),
+                               &bytesWritten);
+      data += bytesRead;
+      length -= bytesRead;
+      charBytesRead += bytesRead;
+      decoder->byteIdx += bytesWritten;
+
+      if (res == -1) {
+        ret = HUFF_BADDATA;
+        goto out;
+      } else if (res == 0) {
+        /* Either the input ran out or the stream is done, unless the input had to be clamped */
+        if (length == 0 || decoder->finished)
+          break;
+        continue;
+      }
+
+      if (HuffDecoderExpandBuffer_(decoder)) {
+        ret = HUFF_TOOMUCHDATA;
+        goto out;
+      }
+    }
+  }
+
+  ret = HUFF_SUCCESS;
+out:
+  *processed = headerBytesRead + charBytesRead;
+  return ret;
+}
+
+int HuffDecoderByteCount(HuffDecoder decoder)
+{
+  return HuffClamp_(HuffDecoderByteCount64(decoder));
+}
+size_t HuffDecoderByteCount64(HuffDecoder decoder)
+{
+  assert(decoder != NULL);
+
+  return decoder->byteIdx - decoder->readIdx;
+}
+
+int HuffDecoderWriteBytes(HuffDecoder decoder, uint8_t *buf, int length)
+{
+  assert(length >= 0);
+
+  return (int)HuffDecoderWriteBytes64(decoder, buf, (size_t)length);
+}
+size_t HuffDecoderWriteBytes64(HuffDecoder decoder, uint8_t *buf, size_t length)
+{
+  size_t toWrite;
+  assert(decoder != NULL);
+  assert(length == 0 || buf != NULL);
+
+  toWrite = decoder->byteIdx - decoder->readIdx;
+  if (length < toWrite)
+    toWrite = length;
+
+  if (toWrite > 0) {
+    memcpy(buf, decoder->buffer + decoder->readIdx, toWrite);
+    decoder->readIdx += toWrite;
+
+    /* Once everything has been written, start over at the front for free */
+    if (decoder->readIdx == decoder->byteIdx) {
+      decoder->readIdx = 0;
+      decoder->byteIdx = 0;
+    }
+  }
+
+  return toWrite;
+}
+
+static int HuffDecoderFeedHeaderData_(HuffDecoder decoder, const uint8_t *data, int length, int *bytesRead)
+{
+  HuffCodeTable codes = NULL;
+  int prevRead;
+  int toRead;
+  int headerSize = 0;
+  int res;
+  assert(decoder != NULL);
+  assert(length == 0 || data != NULL);
+  assert(bytesRead != NULL);
+
+  *bytesRead = 0;
+  if (decoder->table != NULL || decoder->adaptive != NULL)
+    return HUFF_SUCCESS;
+
+  /* Grab as much as could possibly be header, and give back whatever turns out not to be */
+  prevRead = decoder->headerBytesRead;
+  toRead = HUFF_HEADER_MAX - prevRead;
+  if (length < toRead)
+    toRead = length;
+
+  if (toRead > 0)
+    memcpy(decoder->header + prevRead, data, toRead);
+  decoder->headerBytesRead += toRead;
+
+  res = HuffDecoderParseHeader_(decoder, &codes, &headerSize);
+  if (res != HUFF_SUCCESS) {
+    decoder->headerBytesRead = prevRead;
+    return res;
+  }
+
+  if (codes == NULL && decoder->table == NULL && decoder->adaptive == NULL) {
+    /* Not all there yet */
+    *bytesRead = toRead;
+    return HUFF_SUCCESS;
+  }
+
+  if (codes != NULL) {
+    decoder->table = HuffDecodeTableInit(codes);
+    HuffCodeTableDestroy(codes);
+    if (decoder->table == NULL) {
+      decoder->headerBytesRead = prevRead;
+      return HUFF_NOMEM;
+    }
+
+    /* If the cache can't take it, the table is just the decoder's own */
+    if (decoder->cache != NULL)
+      decoder->cached = HuffDecodeCacheAdd_(decoder->cache, decoder->header, headerSize, decoder->table);
+  }
+  if (decoder->table != NULL) {
+    decoder->tableOffset = 0;
+    decoder->tableBits = decoder->table->rootBits;
+  }
+
+  assert(headerSize > prevRead);
+  assert(headerSize <= decoder->headerBytesRead);
+  decoder->headerBytesRead = headerSize;
+  *bytesRead = headerSize - prevRead;
+  return HUFF_SUCCESS;
+}
+
+static int HuffDecoderParseHeader_(HuffDecoder decoder, HuffCodeTable *codes, int *headerSize)
+{
+  const uint8_t *header;
+  int length;
+  int res;
+  assert(decoder != NULL);
+  assert(codes != NULL);
+  assert(headerSize != NULL);
+
+  header = decoder->header;
+  length = decoder->headerBytesRead;
+  *codes = NULL;
+
+  if (length < HUFF_MAGIC_SIZE)
+    return HUFF_SUCCESS;
+
+  if (header[3] == (HUFF_FORMAT_FLAG | HUFF_FORMAT_ADAPTIVE)) {
+    if (header[0] != 'H' || header[1] != 'U' || header[2] != 'F')
+      return HUFF_BADDATA;
+
+    decoder->adaptive = HuffAdaptiveInit();
+    if (decoder->adaptive == NULL)
+      return HUFF_NOMEM;
+
+    *headerSize = HUFF_MAGIC_SIZE;
+    return HUFF_SUCCESS;
+  }
+
+  if (!(header[3] & HUFF_FORMAT_FLAG)) {
+    struct HuffCounter_ counter;
+    HuffTree tree;
+
+    if (length < HUFF_COUNTS_HEADER_SIZE)
+      return HUFF_SUCCESS;
+
+    *headerSize = HUFF_COUNTS_HEADER_SIZE;
+    if (HuffDecoderUseCache_(decoder, *headerSize))
+      return HUFF_SUCCESS;
+
+    res = HuffHeaderReadCounts(header, &counter);
+    if (res)
+      return HUFF_BADDATA;
+
+    /* The tree is only needed long enough to read the codes off of it */
+    tree = HuffTreeInit(&counter, 0);
+    if (tree == NULL)
+      return HUFF_NOMEM;
+
+    *codes = HuffCodeTableInit(tree);
+    HuffTreeDestroy(tree);
+  } else {
+    uint8_t lengths[257];
+
+    res = HuffHeaderReadLengths(header, length, lengths, headerSize);
+    if (res == 1)
+      return HUFF_SUCCESS;
+    else if (res)
+      return HUFF_BADDATA;
+
+    if (HuffDecoderUseCache_(decoder, *headerSize))
+      return HUFF_SUCCESS;
+
+    *codes = HuffCodeTableInitCanonical(lengths);
+  }
+
+  if (*codes == NULL)
+    return HUFF_NOMEM;
+
+  return HUFF_SUCCESS;
+}
+
+static int HuffDecoderUseCache_(HuffDecoder decoder, int headerSize)
+{
+  assert(decoder != NULL);
+  assert(headerSize <= decoder->headerBytesRead);
+
+  if (decoder->cache == NULL)
+    return 0;
+
+  decoder->cached = HuffDecodeCacheFind_(decoder->cache, decoder->header, headerSize);
+  if (decoder->cached == NULL)
+    return 0;
+
+  decoder->table = decoder->cached->table;
+  return 1;
+}
+static void HuffDecoderInitState_(HuffDecoder decoder)
+{
+  assert(decoder != NULL);
+
+  decoder->headerBytesRead = 0;
+  decoder->table = NULL;
+  decoder->adaptive = NULL;
+  decoder->shared = NULL;
+  decoder->cache = NULL;
+  decoder->cached = NULL;
+
+  decoder->bitBuf = 0;
+  decoder->bitCount = 0;
+  decoder->tableOffset = 0;
+  decoder->tableBits = 0;
+  decoder->finished = 0;
+}
+
+static void HuffDecoderReleaseTables_(HuffDecoder decoder)
+{
+  assert(decoder != NULL);
+
+  if (decoder->cached != NULL)
+    HuffDecodeCacheRelease_(decoder->cache, decoder->cached);
+  else if (decoder->table != NULL && decoder->shared == NULL)
+    HuffDecodeTableDestroy(decoder->table);
+  if (decoder->adaptive != NULL)
+    HuffAdaptiveDestroy(decoder->adaptive);
+
+  decoder->table = NULL;
+  decoder->adaptive = NULL;
+  decoder->cached = NULL;
+}
+static int HuffDecoderDecode_(HuffDecoder decoder, const uint8_t *data, int length, int *bytesRead,
+                              uint8_t *out, int outLength, int *bytesWritten)
+{
+  const struct HuffDecodeEntry *entries;
+  const uint8_t *cur;
+  const uint8_t *end;
+  uint64_t bitBuf;
+  int bitCount;
+  int tableOffset;
+  int tableBits;
+  int rootBits;
+  uint8_t *outCur;
+  uint8_t *outEnd;
+  int ret = 0;
+  assert(decoder != NULL);
+  assert(length == 0 || data != NULL);
+  assert(outLength == 0 || out != NULL);
+  assert(bytesRead != NULL);
+  assert(bytesWritten != NULL);
+
+  if (decoder->adaptive != NULL)
+    return HuffDecoderDecodeAdaptive_(decoder, data, length, bytesRead, out, outLength, bytesWritten);
+  assert(decoder->table != NULL);
+
+  /* Work on locals so the compiler can keep them in registers */
+  entries = decoder->table->entries;
+  rootBits = decoder->table->rootBits;
+  bitBuf = decoder->bitBuf;
+  bitCount = decoder->bitCount;
+  tableOffset = decoder->tableOffset;
+  tableBits = decoder->tableBits;
+  cur = data;
+  end = data + length;
+  outCur = out;
+  outEnd = out + outLength;
+
+  for (;;) {
+    const struct HuffDecodeEntry *entry;
+
+    /* At the first level with a whole word of input and room for a batch of symbols, refill once and decode the
+       batch straight from the first level - anything else (a link, the EOF, a bad code) stops the batch and goes
+       through the general step below, which still has at least 56 - (HUFF_DECODE_BATCH - 1)*rootBits bits to go on */
+    if (tableOffset == 0 && end - cur >= 8 && outEnd - outCur >= HUFF_DECODE_BATCH) {
+      uint64_t rootMask = ((uint64_t)1 << rootBits) - 1;
+      int k;
+
+      bitBuf |= HuffLoadLE64_(cur) << bitCount;
+      cur += (63 - bitCount) >> 3;
+      bitCount |= 56;
+
+      for (k = 0; k < HUFF_DECODE_BATCH; k++) {
+        entry = &entries[bitBuf & rootMask];
+        if (entry->subBits != 0 || entry->symbol == HUFF_EOF_CHAR || entry->length == HUFF_DECODE_INVALID)
+          break;
+        bitBuf >>= entry->length;
+        bitCount -= entry->length;
+        *outCur++ = (uint8_t)entry->symbol;
+      }
+      if (k == HUFF_DECODE_BATCH)
+        continue;
+    }
+
+    /* Top up the bit buffer once it can't be trusted to hold a whole table index
+       With 8 bytes of input left, a single load will do - any bits above bitCount are just the upcoming input,
+       so loading them again later is harmless */
+    if (bitCount < HUFF_DECODE_ROOT_BITS) {
+      if (end - cur >= 8) {
+        bitBuf |= HuffLoadLE64_(cur) << bitCount;
+        cur += (63 - bitCount) >> 3;
+        bitCount |= 56;
+      } else {
+        while (bitCount <= 56 && cur < end) {
+          bitBuf |= (uint64_t)(*cur++) << bitCount;
+          bitCount += 8;
+        }
+      }
+    }
+
+    entry = &entries[tableOffset + (int)(bitBuf & (((uint64_t)1 << tableBits) - 1))];
+    if (entry->length > bitCount) {
+      /* Either the rest of this code hasn't arrived yet, or there's no code that starts this way */
+      if (entry->length == HUFF_DECODE_INVALID && bitCount >= tableBits)
+        ret = -1;
+      break;
+    }
+
+    if (outCur == outEnd && entry->subBits == 0 && entry->symbol != HUFF_EOF_CHAR) {
+      /* Leave the symbol in the input until there's somewhere to put it */
+      ret = 1;
+      break;
+    }
+
+    bitBuf >>= entry->length;
+    bitCount -= entry->length;
+
+    if (entry->subBits != 0) {
+      tableOffset = entry->next;
+      tableBits = entry->subBits;
+      continue;
+    }
+
+    tableOffset = 0;
+    tableBits = rootBits;
+
+    if (entry->symbol == HUFF_EOF_CHAR) {
+      decoder->finished = 1;
+      break;
+    }
+
+    *outCur++ = (uint8_t)entry->symbol;
+  }
+
+  /* Unless every buffered bit is needed for the next code, give back the whole bytes that came from this call's |data|
+     That way the only bits held between calls belong to the code being decoded, so after the EOF the whole bytes
+     still buffered are all from |data|, and are the bytes following the stream */
+  if (ret != 0 || decoder->finished) {
+    int giveBack = bitCount / 8;
+    if (giveBack > cur - data) {
+      assert(!decoder->finished);
+      giveBack = (int)(cur - data);
+    }
+    cur -= giveBack;
+    bitCount -= giveBack * 8;
+  }
+
+  /* Don't keep lookahead bits around - they'll be loaded again along with the rest of their bytes */
+  if (bitCount < 64)
+    bitBuf &= ((uint64_t)1 << bitCount) - 1;
+
+  /* After the EOF, the partial byte is padding and counts as processed */
+  if (decoder->finished) {
+    bitBuf = 0;
+    bitCount = 0;
+  }
+
+  decoder->bitBuf = bitBuf;
+  decoder->bitCount = bitCount;
+  decoder->tableOffset = tableOffset;
+  decoder->tableBits = tableBits;
+
+  *bytesRead = (int)(cur - data);
+  *bytesWritten = (int)(outCur - out);
+  return ret;
+}
+
+static int HuffDecoderDecodeAdaptive_(HuffDecoder decoder, const uint8_t *data, int length, int *bytesRead,
+                                      uint8_t *out, int outLength, int *bytesWritten)
+{
+  HuffAdaptive adaptive;
+  const struct HuffTreeNode *nodes;
+  const uint8_t *cur;
+  const uint8_t *end;
+  uint64_t bitBuf;
+  int bitCount;
+  int walk;
+  int written = 0;
+  int ret = 0;
+  assert(decoder != NULL);
+  assert(decoder->adaptive != NULL);
+  assert(length == 0 || data != NULL);
+  assert(outLength == 0 || out != NULL);
+  assert(bytesRead != NULL);
+  assert(bytesWritten != NULL);
+
+  adaptive = decoder->adaptive;
+  nodes = adaptive->nodes;
+  bitBuf = decoder->bitBuf;
+  bitCount = decoder->bitCount;
+  walk = adaptive->walk;
+  cur = data;
+  end = data + length;
+
+  while (!decoder->finished) {
+    if (adaptive->symbol == -1) {
+      /* Down the tree to a leaf */
+      while (nodes[walk].left != -1) {
+        if (bitCount == 0) {
+          if (cur == end)
+            break;
+          bitBuf = *cur++;
+          bitCount = 8;
+        }
+
+        walk = (bitBuf & 1) ? nodes[walk].right : nodes[walk].left;
+        bitBuf >>= 1;
+        bitCount--;
+      }
+      if (nodes[walk].left != -1)
+        break;
+
+      if (walk == adaptive->nyt) {
+        int c;
+
+        while (bitCount < HUFF_ADAPTIVE_ESCAPE_BITS && cur < end) {
+          bitBuf |= (uint64_t)(*cur++) << bitCount;
+          bitCount += 8;
+        }
+        if (bitCount < HUFF_ADAPTIVE_ESCAPE_BITS)
+          break;
+
+        c = (int)(bitBuf & ((1 << HUFF_ADAPTIVE_ESCAPE_BITS) - 1));
+        bitBuf >>= HUFF_ADAPTIVE_ESCAPE_BITS;
+        bitCount -= HUFF_ADAPTIVE_ESCAPE_BITS;
+
+        /* Only symbols that haven't been seen yet get escaped */
+        if (c > HUFF_EOF_CHAR || adaptive->leafs[c] != -1) {
+          ret = -1;
+          break;
+        }
+        adaptive->symbol = c;
+      } else {
+        adaptive->symbol = nodes[walk].c;
+      }
+      walk = adaptive->root;
+    }
+
+    if (adaptive->symbol == HUFF_EOF_CHAR) {
+      decoder->finished = 1;
+      break;
+    }
+
+    if (written == outLength) {
+      /* Hold on to the symbol until there's somewhere to put it */
+      ret = 1;
+      break;
+    }
+
+    out[written++] = (uint8_t)adaptive->symbol;
+    HuffAdaptiveUpdate(adaptive, adaptive->symbol);
+    adaptive->symbol = -1;
+  }
+
+  /* After the EOF, the partial byte is padding */
+  if (decoder->finished) {
+    bitBuf = 0;
+    bitCount = 0;
+  }
+
+  decoder->bitBuf = bitBuf;
+  decoder->bitCount = bitCount;
+  adaptive->walk = walk;
+
+  *bytesRead = (int)(cur - data);
+  *bytesWritten = written;
+  return ret;
+}
+
+static int HuffDecoderExpandBuffer_(HuffDecoder decoder)
+{
+  uint8_t *newBuf;
+  assert(decoder != NULL);
+  assert(decoder->byteIdx >= decoder->readIdx);
+  assert(decoder->byteIdx <= decoder->bufferSize);
+
+  if (decoder->byteIdx < decoder->bufferSize)
+    return 0;
+
+  /* Reclaim the written bytes at the front if that pays for itself - see HuffEncoderExpandBufferToFit_ */
+  if (decoder->readIdx > 0 && decoder->readIdx >= decoder->byteIdx - decoder->readIdx) {
+    size_t pending = decoder->byteIdx - decoder->readIdx;
+
+    memmove(decoder->buffer, decoder->buffer + decoder->readIdx, pending);
+    decoder->readIdx = 0;
+    decoder->byteIdx = pending;
+    return 0;
+  }
+
+  /* Prevent overflow conditions */
+  if (decoder->bufferSize > SIZE_MAX / 2)
+    return -1;
+
+  newBuf = realloc(decoder->buffer, decoder->bufferSize*2);
+  if (newBuf == NULL)
+    return -1;
+
+  decoder->bufferSize *= 2;
+  decoder->buffer = newBuf;
+  return 0;
+}
+
+/* streams
+   The stream state is an encoder or decoder that never uses its output buffer */
+/* Moves the stream's cursors along */
+static void HuffStreamAdvance_(HuffStream *stream, int bytesRead, int bytesWritten);
+static int HuffEncodeStreamInitFormat_(HuffStream *stream, HuffCounter counter, int format, int maxCodeLength);
+
+int HuffEncodeStreamInit(HuffStream *stream, HuffCounter counter, int maxCodeLength)
+{
+  assert(counter != NULL);
+  assert(maxCodeLength == 0 || (maxCodeLength >= HUFF_MINCODELENGTH && maxCodeLength <= HUFF_MAXCODELENGTH));
+
+  return HuffEncodeStreamInitFormat_(stream, counter, HUFF_FORMAT_CANONICAL, maxCodeLength);
+}
+int HuffEncodeStreamInitAdaptive(HuffStream *stream)
+{
+  return HuffEncodeStreamInitFormat_(stream, NULL, HUFF_FORMAT_ADAPTIVE, 0);
+}
+static int HuffEncodeStreamInitFormat_(HuffStream *stream, HuffCounter counter, int format, int maxCodeLength)
+{
+  HuffEncoder enc;
+  int res;
+  assert(stream != NULL);
+
+  stream->state = NULL;
+  stream->totalIn = 0;
+  stream->totalOut = 0;
+
+  enc = malloc(sizeof(*enc));
+  if (enc == NULL)
+    return HUFF_NOMEM;
+
+  res = HuffEncoderInitState_(enc, counter, format, maxCodeLength);
+  if (res != HUFF_SUCCESS) {
+    free(enc);
+    return res;
+  }
+
+  enc->buffer = NULL;
+  enc->bufferSize = 0;
+  enc->readIdx = 0;
+  enc->byteIdx = 0;
+
+  stream->state = enc;
+  return HUFF_SUCCESS;
+}
+int HuffEncodeStream(HuffStream *stream, int flush)
+{
+  HuffEncoder encoder;
+  assert(stream != NULL);
+  assert(stream->state != NULL);
+  assert(flush == HUFF_NOFLUSH || flush == HUFF_FINISH);
+  assert(stream->availIn == 0 || stream->nextIn != NULL);
+  assert(stream->availOut == 0 || stream->nextOut != NULL);
+
+  encoder = stream->state;
+
+  if (encoder->headerBytesToWrite > 0) {
+    int written = (int)HuffEncoderWriteHeaderBytes_(encoder, stream->nextOut, stream->availOut);
+    HuffStreamAdvance_(stream, 0, written);
+    if (encoder->headerBytesToWrite > 0)
+      return HUFF_SUCCESS;
+  }
+
+  for (;;) {
+    int bytesRead;
+    int bytesWritten;
+    int res;
+
+    res = HuffEncoderEncode_(encoder, stream->nextIn, HuffClamp_(stream->availIn), &bytesRead,
+                             stream->nextOut, HuffClamp_(stream->availOut), &bytesWritten);
+    HuffStreamAdvance_(stream, bytesRead, bytesWritten);
+    if (res == -1)
+      return HUFF_BADDATA;
+
+    if (res == 1 && stream->availOut == 0)
+      return HUFF_SUCCESS;
+    if (stream->availIn == 0)
+      break;
+  }
+
+  if (flush != HUFF_FINISH)
+    return HUFF_SUCCESS;
+
+  if (encoder->adaptive != NULL) {
+    int bytesRead;
+    int bytesWritten;
+    int res;
+
+    /* The EOF's code can be longer than the bit buffer, so it goes through the pending bytes like any other */
+    res = HuffEncoderEncodeAdaptive_(encoder, NULL, 0, &bytesRead, stream->nextOut, HuffClamp_(stream->availOut),
+                                     &bytesWritten, 1);
+    HuffStreamAdvance_(stream, 0, bytesWritten);
+    return (res == 0) ? HUFF_STREAMEND : HUFF_SUCCESS;
+  }
+
+  if (!encoder->ended) {
+    const struct HuffCode *code = &encoder->codes->codes[HUFF_EOF_CHAR];
+    assert(encoder->bitCount < 8);
+
+    encoder->bitBuf |= code->bits << encoder->bitCount;
+    encoder->bitCount += code->length;
+    encoder->ended = 1;
+  }
+
+  /* Write out everything, padding out the last partial byte */
+  while (encoder->bitCount > 0 && stream->availOut > 0) {
+    *stream->nextOut = (uint8_t)encoder->bitBuf;
+    HuffStreamAdvance_(stream, 0, 1);
+    encoder->bitBuf >>= 8;
+    encoder->bitCount = (encoder->bitCount > 8) ? encoder->bitCount - 8 : 0;
+  }
+
+  return (encoder->bitCount == 0) ? HUFF_STREAMEND : HUFF_SUCCESS;
+}
+void HuffEncodeStreamEnd(HuffStream *stream)
+{
+  HuffEncoder encoder;
+  assert(stream != NULL);
+
+  encoder = stream->state;
+  if (encoder != NULL) {
+    if (encoder->codes != NULL && encoder->shared == NULL)
+      HuffCodeTableDestroy(encoder->codes);
+    if (encoder->adaptive != NULL)
+      HuffAdaptiveDestroy(encoder->adaptive);
+    free(encoder);
+  }
+  stream->state = NULL;
+}
+
+int HuffDecodeStreamInit(HuffStream *stream)
+{
+  HuffDecoder dec;
+  assert(stream != NULL);
+
+  stream->state = NULL;
+  stream->totalIn = 0;
+  stream->totalOut = 0;
+
+  dec = malloc(sizeof(*dec));
+  if (dec == NULL)
+    return HUFF_NOMEM;
+
+  HuffDecoderInitState_(dec);
+  dec->buffer = NULL;
+  dec->bufferSize = 0;
+  dec->readIdx = 0;
+  dec->byteIdx = 0;
+
+  stream->state = dec;
+  return HUFF_SUCCESS;
+}
+int HuffDecodeStream(HuffStream *stream)
+{
+  HuffDecoder decoder;
+  assert(stream != NULL);
+  assert(stream->state != NULL);
+  assert(stream->availIn == 0 || stream->nextIn != NULL);
+  assert(stream->availOut == 0 || stream->nextOut != NULL);
+
+  decoder = stream->state;
+
+  while (decoder->table == NULL && decoder->adaptive == NULL) {
+    int bytesRead;
+    int res;
+
+    res = HuffDecoderFeedHeaderData_(decoder, stream->nextIn, HuffClamp_(stream->availIn), &bytesRead);
+    HuffStreamAdvance_(stream, bytesRead, 0);
+    if (res != HUFF_SUCCESS)
+      return res;
+
+    if (decoder->table == NULL && decoder->adaptive == NULL && stream->availIn == 0)
+      return HUFF_SUCCESS;
+  }
+
+  while (!decoder->finished) {
+    int bytesRead;
+    int bytesWritten;
+    int res;
+
+    res = HuffDecoderDecode_(decoder, stream->nextIn, HuffClamp_(stream->availIn), &bytesRead,
+                             stream->nextOut, HuffClamp_(stream->availOut), &bytesWritten);
+    HuffStreamAdvance_(stream, bytesRead, bytesWritten);
+    if (res == -1)
+      return HUFF_BADDATA;
+
+    /* Only go around again if the lengths had to be clamped */
+    if (!decoder->finished && ((res == 0 && stream->availIn == 0) || (res == 1 && stream->availOut == 0)))
+      return HUFF_SUCCESS;
+  }
+
+  return HUFF_STREAMEND;
+}
+void HuffDecodeStreamSetCache(HuffStream *stream, HuffDecodeCache cache)
+{
+  assert(stream != NULL);
+  assert(stream->state != NULL);
+
+  HuffDecoderSetCache(stream->state, cache);
+}
+void HuffDecodeStreamEnd(HuffStream *stream)
+{
+  HuffDecoder decoder;
+  assert(stream != NULL);
+
+  decoder = stream->state;
+  if (decoder != NULL) {
+    HuffDecoderReleaseTables_(decoder);
+    free(decoder);
+  }
+  stream->state = NULL;
+}
+
+static void HuffStreamAdvance_(HuffStream *stream, int bytesRead, int bytesWritten)
+{
+  assert(stream != NULL);
+  assert(bytesRead >= 0 && (size_t)bytesRead <= stream->availIn);
+  assert(bytesWritten >= 0 && (size_t)bytesWritten <= stream->availOut);
+
+  stream->nextIn += bytesRead;
+  stream->availIn -= bytesRead;
+  stream->totalIn += bytesRead;
+  stream->nextOut += bytesWritten;
+  stream->availOut -= bytesWritten;
+  stream->totalOut += bytesWritten;
+}
+
+/* one-shot
+   These run a stream over the whole buffer, with the state on the stack, so the data is only ever copied once */
+/* Returns 1 if |src| starts with a frame header, 0 otherwise */
+static int HuffFrameIsFramed_(const uint8_t *src, size_t srcLength);
+/* The same for an order-1 stream header */
+static int HuffContextIsContext_(const uint8_t *src, size_t srcLength);
+/* Reads an order-1 stream, as HuffDecompress */
+static int HuffDecompressContext_(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity,
+                                  size_t *dstLength);
+/* Run |encoder| or |decoder|, set up all but the buffer, as a stream over the whole of |src| */
+static int HuffCompressWith_(HuffEncoder encoder, const uint8_t *src, size_t srcLength, uint8_t *dst,
+                             size_t dstCapacity, size_t *dstLength);
+static int HuffDecompressWith_(HuffDecoder decoder, const uint8_t *src, size_t srcLength, uint8_t *dst,
+                               size_t dstCapacity, size_t *dstLength);
+
+size_t HuffCompressBound(size_t length)
+{
+  /* Giving the EOF and the rarest byte 9 bit codes and everything else 8 bit codes is a complete code, and a Huffman
+     code can't do worse - so that's at most 8 bits a byte, plus 1 bit for every 256 bytes, plus the 9 bit EOF */
+  return HUFF_CANONICAL_HEADER_MAX + length + length / 2048 + 2;
+}
+int HuffCompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength)
+{
+  struct HuffCounter_ counter;
+  struct HuffEncoder_ encoder;
+  int res;
+  assert(srcLength == 0 || src != NULL);
+  assert(dstCapacity == 0 || dst != NULL);
+  assert(dstLength != NULL);
+
+  *dstLength = 0;
+
+  HuffCounterInitState_(&counter);
+  res = HuffCounterFeedData64(&counter, src, srcLength);
+  if (res != HUFF_SUCCESS)
+    return res;
+
+  res = HuffEncoderInitState_(&encoder, &counter, HUFF_FORMAT_CANONICAL, 0);
+  if (res != HUFF_SUCCESS)
+    return res;
+
+  res = HuffCompressWith_(&encoder, src, srcLength, dst, dstCapacity, dstLength);
+  HuffCodeTableDestroy(encoder.codes);
+  return res;
+}
+int HuffDecompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength)
+{
+  struct HuffDecoder_ decoder;
+  int res;
+  assert(srcLength == 0 || src != NULL);
+  assert(dstCapacity == 0 || dst != NULL);
+  assert(dstLength != NULL);
+
+  *dstLength = 0;
+
+  if (HuffFrameIsFramed_(src, srcLength))
+    return HuffFrameDecompress(src, srcLength, dst, dstCapacity, dstLength, 1);
+  if (HuffContextIsContext_(src, srcLength))
+    return HuffDecompressContext_(src, srcLength, dst, dstCapacity, dstLength);
+
+  HuffDecoderInitState_(&decoder);
+
+  res = HuffDecompressWith_(&decoder, src, srcLength, dst, dstCapacity, dstLength);
+  HuffDecoderReleaseTables_(&decoder);
+  return res;
+}
+static int HuffCompressWith_(HuffEncoder encoder, const uint8_t *src, size_t srcLength, uint8_t *dst,
+                             size_t dstCapacity, size_t *dstLength)
+{
+  HuffStream stream;
+  int res;
+
+  encoder->buffer = NULL;
+  encoder->bufferSize = 0;
+  encoder->readIdx = 0;
+  encoder->byteIdx = 0;
+
+  stream.nextIn = src;
+  stream.availIn = srcLength;
+  stream.nextOut = dst;
+  stream.availOut = dstCapacity;
+  stream.totalIn = 0;
+  stream.totalOut = 0;
+  stream.state = encoder;
+
+  res = HuffEncodeStream(&stream, HUFF_FINISH);
+  if (res == HUFF_SUCCESS)
+    /* Ran out of room */
+    return HUFF_TOOMUCHDATA;
+  else if (res != HUFF_STREAMEND)
+    return res;
+
+  *dstLength = (size_t)stream.totalOut;
+  return HUFF_SUCCESS;
+}
+static int HuffDecompressWith_(HuffDecoder decoder, const uint8_t *src, size_t srcLength, uint8_t *dst,
+                               size_t dstCapacity, size_t *dstLength)
+{
+  HuffStream stream;
+  int res;
+
+  decoder->buffer = NULL;
+  decoder->bufferSize = 0;
+  decoder->readIdx = 0;
+  decoder->byteIdx = 0;
+
+  stream.nextIn = src;
+  stream.availIn = srcLength;
+  stream.nextOut = dst;
+  stream.availOut = dstCapacity;
+  stream.totalIn = 0;
+  stream.totalOut = 0;
+  stream.state = decoder;
+
+  res = HuffDecodeStream(&stream);
+  if (res == HUFF_SUCCESS && stream.availOut == 0) {
+    /* Either there was more to decode, or the stream stopped short right at the end of |dst| - see which */
+    uint8_t scratch;
+
+    stream.nextOut = &scratch;
+    stream.availOut = 1;
+    res = HuffDecodeStream(&stream);
+    if (res >= 0 && stream.availOut == 0)
+      res = HUFF_TOOMUCHDATA;
+  }
+
+  if (res == HUFF_SUCCESS)
+    /* The stream stopped short */
+    return HUFF_BADDATA;
+  else if (res != HUFF_STREAMEND)
+    return res;
+
+  *dstLength = (size_t)stream.totalOut;
+  return HUFF_SUCCESS;
+}
+
+/* shared tables
+   A table is a canonical code worked out ahead of time, for streams that leave out the header
+   Every symbol gets a code, since the data it's used on won't be exactly like the data it was worked out from
+   A saved table is its ID (4 bytes) followed by a canonical header */
+struct HuffTable_
+{
+  uint32_t id;
+  uint8_t header[HUFF_CANONICAL_HEADER_MAX];
+  int headerSize;
+  /* Both only ever read once the table is made, so any number of encoders and decoders can share them */
+  HuffCodeTable codes;
+  HuffDecodeTable decode;
+};
+
+/* Sets up the codes and the decode table from the code lengths
+   Returns HUFF_SUCCESS, or an error code */
+static int HuffTableInitState_(HuffTable table, const uint8_t *lengths);
+
+HuffTable HuffTableInit(HuffCounter counter, int maxCodeLength, uint32_t id)
+{
+  struct HuffCounter_ smoothed;
+  HuffTable table;
+  uint8_t lengths[257];
+  int i;
+  assert(counter != NULL);
+  assert(maxCodeLength == 0 || (maxCodeLength >= HUFF_MINCODELENGTH && maxCodeLength <= HUFF_MAXCODELENGTH));
+
+  /* One more of every byte, so the ones the samples didn't have still get codes */
+  if (counter->totalCount > CTR_MAX - 256)
+    return NULL;
+  for (i = 0; i < 256; i++)
+    smoothed.counts[i] = counter->counts[i] + 1;
+  smoothed.totalCount = counter->totalCount + 256;
+
+  table = malloc(sizeof(*table));
+  if (table == NULL)
+    goto out;
+
+  if (HuffCanonicalLengths(&smoothed, maxCodeLength, lengths))
+    goto out1;
+
+  table->id = id;
+  table->headerSize = HuffHeaderWriteLengths(lengths, maxCodeLength, table->header);
+  if (HuffTableInitState_(table, lengths) != HUFF_SUCCESS)
+    goto out1;
+
+  return table;
+out1:
+  free(table);
+out:
+  return NULL;
+}
+void HuffTableDestroy(HuffTable table)
+{
+  assert(table != NULL);
+
+  HuffDecodeTableDestroy(table->decode);
+  HuffCodeTableDestroy(table->codes);
+  free(table);
+}
+uint32_t HuffTableId(HuffTable table)
+{
+  assert(table != NULL);
+
+  return table->id;
+}
+size_t HuffTableSaveSize(HuffTable table)
+{
+  assert(table != NULL);
+
+  return 4 + (size_t)table->headerSize;
+}
+void HuffTableSave(HuffTable table, uint8_t *dst)
+{
+  assert(table != NULL);
+  assert(dst != NULL);
+
+  HuffStoreLE32_(dst, table->id);
+  memcpy(dst + 4, table->header, table->headerSize);
+}
+int HuffTableLoad(const uint8_t *src, size_t srcLength, HuffTable *table)
+{
+  HuffTable loaded;
+  uint8_t lengths[257];
+  int headerSize;
+  int res;
+  int i;
+  assert(srcLength == 0 || src != NULL);
+  assert(table != NULL);
+
+  *table = NULL;
+
+  if (srcLength < 4 || srcLength - 4 > HUFF_CANONICAL_HEADER_MAX)
+    return HUFF_BADDATA;
+  if (HuffHeaderReadLengths(src + 4, (int)(srcLength - 4), lengths, &headerSize) != 0
+      || (size_t)headerSize != srcLength - 4)
+    return HUFF_BADDATA;
+
+  /* Tables are only any good if they can code everything */
+  for (i = 0; i < 257; i++) {
+    if (lengths[i] == 0)
+      return HUFF_BADDATA;
+  }
+
+  loaded = malloc(sizeof(*loaded));
+  if (loaded == NULL)
+    return HUFF_NOMEM;
+
+  loaded->id = HuffLoadLE32_(src);
+  loaded->headerSize = headerSize;
+  memcpy(loaded->header, src + 4, headerSize);
+
+  res = HuffTableInitState_(loaded, lengths);
+  if (res != HUFF_SUCCESS) {
+    free(loaded);
+    return res;
+  }
+
+  *table = loaded;
+  return HUFF_SUCCESS;
+}
+HuffEncoder HuffEncoderInitWithTable(HuffTable table, int initialBufferSize)
+{
+  HuffEncoder enc;
+  assert(table != NULL);
+  assert(initialBufferSize >= 0);
+
+  enc = malloc(sizeof(*enc));
+  if (enc == NULL)
+    return NULL;
+
+  /* Nothing to work out - just the table's codes, and no header */
+  enc->codes = table->codes;
+  enc->adaptive = NULL;
+  enc->shared = table;
+  enc->headerSize = 0;
+  enc->headerBytesToWrite = 0;
+  enc->bitBuf = 0;
+  enc->bitCount = 0;
+  enc->ended = 0;
+
+  if (initialBufferSize == 0)
+    initialBufferSize = HUFF_BUFFER_START;
+
+  enc->buffer = malloc(initialBufferSize);
+  if (enc->buffer == NULL) {
+    free(enc);
+    return NULL;
+  }
+
+  enc->bufferSize = initialBufferSize;
+  enc->readIdx = 0;
+  enc->byteIdx = 0;
+
+  return enc;
+}
+HuffDecoder HuffDecoderInitWithTable(HuffTable table, int initialBufferSize)
+{
+  HuffDecoder dec;
+  assert(table != NULL);
+
+  dec = HuffDecoderInit(initialBufferSize);
+  if (dec == NULL)
+    return NULL;
+
+  /* With the table already there, the header is never looked for */
+  dec->table = table->decode;
+  dec->shared = table;
+  dec->tableOffset = 0;
+  dec->tableBits = table->decode->rootBits;
+
+  return dec;
+}
+size_t HuffTableCompressBound(HuffTable table, size_t length)
+{
+  size_t maxLength;
+  assert(table != NULL);
+
+  /* Every byte could have the longest code, and then there's the EOF */
+  maxLength = (size_t)HuffCodeTableMaxLength(table->codes);
+  if (length > (SIZE_MAX - 7) / maxLength - 1)
+    return SIZE_MAX;
+  return ((length + 1)*maxLength + 7) / 8;
+}
+int HuffCompressWithTable(HuffTable table, const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity,
+                          size_t *dstLength)
+{
+  struct HuffEncoder_ encoder;
+  assert(table != NULL);
+  assert(srcLength == 0 || src != NULL);
+  assert(dstCapacity == 0 || dst != NULL);
+  assert(dstLength != NULL);
+
+  *dstLength = 0;
+
+  encoder.codes = table->codes;
+  encoder.adaptive = NULL;
+  encoder.shared = table;
+  encoder.headerSize = 0;
+  encoder.headerBytesToWrite = 0;
+  encoder.bitBuf = 0;
+  encoder.bitCount = 0;
+  encoder.ended = 0;
+
+  return HuffCompressWith_(&encoder, src, srcLength, dst, dstCapacity, dstLength);
+}
+int HuffDecompressWithTable(HuffTable table, const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity,
+                            size_t *dstLength)
+{
+  struct HuffDecoder_ decoder;
+  assert(table != NULL);
+  assert(srcLength == 0 || src != NULL);
+  assert(dstCapacity == 0 || dst != NULL);
+  assert(dstLength != NULL);
+
+  *dstLength = 0;
+
+  HuffDecoderInitState_(&decoder);
+  decoder.table = table->decode;
+  decoder.shared = table;
+  decoder.tableOffset = 0;
+  decoder.tableBits = table->decode->rootBits;
+
+  return HuffDecompressWith_(&decoder, src, srcLength, dst, dstCapacity, dstLength);
+}
+static int HuffTableInitState_(HuffTable table, const uint8_t *lengths)
+{
+  assert(table != NULL);
+  assert(lengths != NULL);
+
+  table->codes = HuffCodeTableInitCanonical(lengths);
+  if (table->codes == NULL)
+    return HUFF_NOMEM;
+
+  table->decode = HuffDecodeTableInit(table->codes);
+  if (table->decode == NULL) {
+    HuffCodeTableDestroy(table->codes);
+    return HUFF_NOMEM;
+  }
+
+  return HUFF_SUCCESS;
+}
+
+/* order-1 streams
+   Every byte is coded with the table of its context, the byte before it (0 for the first byte), so data where what
+   comes next depends on what just came codes well below its order-0 entropy
+   The busiest contexts get tables of their own where that pays for their headers, and the rest share one
+   The header is the magic, the number of bytes (8 bytes), the number of tables, the table each context uses as a
+   bit-packed number just wide enough for the number of tables (left out if there's only one), padded out to a byte,
+   then every table as a canonical header without its magic
+   Every table is a complete code no longer than HUFF_CONTEXT_MAX_LENGTH, so decoding a byte is one lookup in a small
+   table - the code follows the header, padded out to a byte, with no EOF since the length is known */
+struct HuffContextModel_
+{
+  int tableCount;
+  uint8_t map[256];
+  uint8_t lengths[HUFF_CONTEXT_MAX_TABLES][257];
+  /* Of the whole stream, header and all */
+  size_t size;
+};
+
+/* Works out the tables and which contexts use them from the |counts| of each context (256 each, one after another)
+   Returns HUFF_SUCCESS, or HUFF_NOMEM */
+static int HuffContextBuild_(const ctr *counts, struct HuffContextModel_ *model);
+/* Sets |counter| up with |counts|, as if they had been fed to it */
+static void HuffContextCounter_(HuffCounter counter, const ctr *counts);
+/* Returns the number of bits |counts| take with |lengths|, without the EOF */
+static uint64_t HuffContextBits_(const ctr *counts, const uint8_t *lengths);
+/* Returns the number of bits |counts| take with a table of their own with |lengths|, header included
+   |header| is room for the header */
+static uint64_t HuffContextTableBits_(const ctr *counts, const uint8_t *lengths, uint8_t *header);
+/* Writes the header for |length| bytes coded with |model|, returning its size */
+static size_t HuffContextWriteHeader_(const struct HuffContextModel_ *model, uint64_t length, uint8_t *out);
+
+int HuffCompressContext(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength)
+{
+  struct HuffContextModel_ *model;
+  struct HuffCounter_ counter;
+  struct HuffEncoder_ encoder;
+  const struct HuffCode *contextCodes[256];
+  HuffCodeTable codes[HUFF_CONTEXT_MAX_TABLES];
+  uint8_t lengths[257];
+  ctr *counts;
+  uint8_t *out;
+  uint8_t *end;
+  uint64_t bitBuf;
+  size_t orderZeroSize;
+  size_t i;
+  int bitCount;
+  int prev;
+  int ret = HUFF_NOMEM;
+  int t;
+  assert(srcLength == 0 || src != NULL);
+  assert(dstCapacity == 0 || dst != NULL);
+  assert(dstLength != NULL);
+
+  *dstLength = 0;
+
+  /* Nothing to model, or more than a counter can take (which HuffCompress reports) */
+  if (srcLength == 0 || srcLength >= CTR_MAX)
+    return HuffCompress(src, srcLength, dst, dstCapacity, dstLength);
+
+  counts = calloc(256*256, sizeof(*counts));
+  if (counts == NULL)
+    return HUFF_NOMEM;
+  model = malloc(sizeof(*model));
+  if (model == NULL)
+    goto out;
+
+  prev = 0;
+  for (i = 0; i < srcLength; i++) {
+    counts[prev*256 + src[i]]++;
+    prev = src[i];
+  }
+
+  ret = HuffContextBuild_(counts, model);
+  if (ret != HUFF_SUCCESS)
+    goto out1;
+
+  /* A plain canonical stream wins when the contexts don't tell the bytes apart enough to pay for their tables,
+     which also keeps this within HuffCompressBound */
+  HuffCounterInitState_(&counter);
+  for (i = 0; i < 256*256; i++)
+    counter.counts[i % 256] += counts[i];
+  counter.totalCount += srcLength;
+  orderZeroSize = HuffCanonicalStreamSize_(&counter, 0, lengths);
+  if (orderZeroSize == 0) {
+    ret = HUFF_NOMEM;
+    goto out1;
+  }
+  if (orderZeroSize <= model->size) {
+    ret = HuffEncoderInitState_(&encoder, &counter, HUFF_FORMAT_CANONICAL, 0);
+    if (ret != HUFF_SUCCESS)
+      goto out1;
+    ret = HuffCompressWith_(&encoder, src, srcLength, dst, dstCapacity, dstLength);
+    HuffCodeTableDestroy(encoder.codes);
+    goto out1;
+  }
+
+  if (model->size > dstCapacity) {
+    ret = HUFF_TOOMUCHDATA;
+    goto out1;
+  }
+
+  for (t = 0; t < model->tableCount; t++) {
+    codes[t] = HuffCodeTableInitCanonical(model->lengths[t]);
+    if (codes[t] == NULL) {
+      ret = HUFF_NOMEM;
+      goto out2;
+    }
+  }
+  for (i = 0; i < 256; i++)
+    contextCodes[i] = codes[model->map[i]]->codes;
+
+  out = dst + HuffContextWriteHeader_(model, srcLength, dst);
+  end = dst + model->size;
+  bitBuf = 0;
+  bitCount = 0;
+  prev = 0;
+  for (i = 0; i < srcLength; i++) {
+    const struct HuffCode *code = &contextCodes[prev][src[i]];
+    bitBuf |= code->bits << bitCount;
+    bitCount += code->length;
+    prev = src[i];
+
+    /* At most 7 bits are left over and no code is longer than 11 bits, so the buffer never fills */
+    if (end - out >= 8) {
+      HuffStoreLE64_(out, bitBuf);
+      out += bitCount >> 3;
+      bitBuf >>= bitCount & ~7;
+      bitCount &= 7;
+    } else {
+      while (bitCount >= 8) {
+        *out++ = (uint8_t)bitBuf;
+        bitBuf >>= 8;
+        bitCount -= 8;
+      }
+    }
+  }
+  if (bitCount > 0)
+    *out++ = (uint8_t)bitBuf;
+  assert(out == end);
+
+  *dstLength = model->size;
+  ret = HUFF_SUCCESS;
+out2:
+  while (t-- > 0)
+    HuffCodeTableDestroy(codes[t]);
+out1:
+  free(model);
+out:
+  free(counts);
+  return ret;
+}
+static int HuffContextBuild_(const ctr *counts, struct HuffContextModel_ *model)
+{
+  struct HuffCounter_ counter;
+  uint8_t header[HUFF_CONTEXT_HEADER_MAX];
+  uint8_t candidateLengths[HUFF_CONTEXT_CANDIDATES][257];
+  uint8_t sharedLengths[257];
+  ctr shared[256];
+  ctr totals[256];
+  int64_t gains[HUFF_CONTEXT_CANDIDATES];
+  /* Indexes into |candidateLengths|, in the order of |gains| */
+  int candidates[HUFF_CONTEXT_CANDIDATES];
+  int order[256];
+  uint64_t bits;
+  int candidateCount = 0;
+  int sharedUsed = 0;
+  int own;
+  int i;
+  int j;
+  int c;
+  assert(counts != NULL);
+  assert(model != NULL);
+
+  for (i = 0; i < 256; i++)
+    shared[i] = 0;
+  for (c = 0; c < 256; c++) {
+    totals[c] = 0;
+    for (i = 0; i < 256; i++) {
+      totals[c] += counts[c*256 + i];
+      shared[i] += counts[c*256 + i];
+    }
+  }
+
+  /* One table for all of the data, which is what a context without a table of its own would code with */
+  HuffContextCounter_(&counter, shared);
+  if (HuffCanonicalLengths(&counter, HUFF_CONTEXT_MAX_LENGTH, sharedLengths))
+    return HUFF_NOMEM;
+
+  /* Busiest contexts first (insertion sort, ties in context order) */
+  for (c = 0; c < 256; c++) {
+    for (j = c; j > 0 && totals[order[j-1]] < totals[c]; j--)
+      order[j] = order[j-1];
+    order[j] = c;
+  }
+
+  /* What each of the busiest contexts saves with a table of its own, header included */
+  for (i = 0; i < HUFF_CONTEXT_CANDIDATES && totals[order[i]] > 0; i++) {
+    uint8_t *lengths = candidateLengths[i];
+    uint64_t ownBits;
+    c = order[i];
+    bits = HuffContextBits_(counts + c*256, sharedLengths);
+
+    /* The plain Huffman code is no longer than the limited one, so a context that doesn't pay for a table with it
+       won't with the limit either (near enough, the header being a little different) - and it's much quicker to work
+       out when the limit would have to be applied */
+    HuffContextCounter_(&counter, counts + c*256);
+    if (HuffCanonicalLengths(&counter, 0, lengths))
+      return HUFF_NOMEM;
+    if (bits <= HuffContextTableBits_(counts + c*256, lengths, header))
+      continue;
+
+    if (HuffCanonicalLengths(&counter, HUFF_CONTEXT_MAX_LENGTH, lengths))
+      return HUFF_NOMEM;
+    ownBits = HuffContextTableBits_(counts + c*256, lengths, header);
+    if (bits <= ownBits)
+      continue;
+
+    /* Biggest savings first */
+    for (j = candidateCount; j > 0 && gains[j-1] < (int64_t)(bits - ownBits); j--) {
+      gains[j] = gains[j-1];
+      candidates[j] = candidates[j-1];
+    }
+    gains[j] = (int64_t)(bits - ownBits);
+    candidates[j] = i;
+    candidateCount++;
+  }
+
+  /* The best of them get tables, leaving one for the rest */
+  own = candidateCount;
+  if (own > HUFF_CONTEXT_MAX_TABLES - 1)
+    own = HUFF_CONTEXT_MAX_TABLES - 1;
+  for (c = 0; c < 256; c++)
+    model->map[c] = (uint8_t)own;
+  for (i = 0; i < own; i++) {
+    c = order[candidates[i]];
+    model->map[c] = (uint8_t)i;
+    memcpy(model->lengths[i], candidateLengths[candidates[i]], 257);
+    for (j = 0; j < 256; j++)
+      shared[j] -= counts[c*256 + j];
+  }
+  for (j = 0; j < 256; j++) {
+    if (shared[j] != 0)
+      sharedUsed = 1;
+  }
+
+  /* The shared table is worked out again without the contexts that left it
+     If they took all the data with them, the contexts left over never come up, so they can point anywhere */
+  model->tableCount = own;
+  if (sharedUsed) {
+    HuffContextCounter_(&counter, shared);
+    if (HuffCanonicalLengths(&counter, HUFF_CONTEXT_MAX_LENGTH, model->lengths[own]))
+      return HUFF_NOMEM;
+    model->tableCount++;
+  } else {
+    for (c = 0; c < 256; c++) {
+      if (model->map[c] == own)
+        model->map[c] = 0;
+    }
+  }
+  assert(model->tableCount > 0);
+
+  bits = 0;
+  for (c = 0; c < 256; c++) {
+    if (totals[c] > 0)
+      bits += HuffContextBits_(counts + c*256, model->lengths[model->map[c]]);
+  }
+  model->size = HuffContextWriteHeader_(model, 0, header) + (size_t)((bits + 7) / 8);
+
+  return HUFF_SUCCESS;
+}
+static void HuffContextCounter_(HuffCounter counter, const ctr *counts)
+{
+  int i;
+  assert(counter != NULL);
+  assert(counts != NULL);
+
+  HuffCounterInitState_(counter);
+  for (i = 0; i < 256; i++) {
+    counter->counts[i] = counts[i];
+    counter->totalCount += counts[i];
+  }
+}
+static uint64_t HuffContextBits_(const ctr *counts, const uint8_t *lengths)
+{
+  uint64_t bits = HuffCodeBits_(counts, lengths);
+  assert(bits != UINT64_MAX);
+
+  return bits - lengths[HUFF_EOF_CHAR];
+}
+static uint64_t HuffContextTableBits_(const ctr *counts, const uint8_t *lengths, uint8_t *header)
+{
+  int headerSize = HuffHeaderWriteLengths(lengths, 0, header);
+
+  return HuffContextBits_(counts, lengths) + 8*(uint64_t)(headerSize - HUFF_MAGIC_SIZE);
+}
+static size_t HuffContextWriteHeader_(const struct HuffContextModel_ *model, uint64_t length, uint8_t *out)
+{
+  uint8_t header[HUFF_CANONICAL_HEADER_MAX];
+  size_t size;
+  int width = 0;
+  int bitPos;
+  int headerSize;
+  int c;
+  int t;
+  assert(model != NULL);
+  assert(model->tableCount > 0 && model->tableCount <= HUFF_CONTEXT_MAX_TABLES);
+  assert(out != NULL);
+
+  out[0] = 'H';
+  out[1] = 'U';
+  out[2] = 'F';
+  out[3] = HUFF_FORMAT_FLAG | HUFF_FORMAT_CONTEXT;
+  HuffStoreLE64_(out + HUFF_MAGIC_SIZE, length);
+  out[HUFF_MAGIC_SIZE + 8] = (uint8_t)model->tableCount;
+  size = HUFF_CONTEXT_HEADER_SIZE;
+
+  while ((1 << width) < model->tableCount)
+    width++;
+  memset(out + size, 0, (256*width + 7)/8);
+  bitPos = 0;
+  for (c = 0; c < 256; c++)
+    HuffHeaderPutBits_(out + size, &bitPos, model->map[c], width);
+  size += (bitPos + 7)/8;
+
+  for (t = 0; t < model->tableCount; t++) {
+    headerSize = HuffHeaderWriteLengths(model->lengths[t], 0, header);
+    memcpy(out + size, header + HUFF_MAGIC_SIZE, headerSize - HUFF_MAGIC_SIZE);
+    size += headerSize - HUFF_MAGIC_SIZE;
+  }
+
+  assert(size <= HUFF_CONTEXT_HEADER_MAX);
+  return size;
+}
+static int HuffContextIsContext_(const uint8_t *src, size_t srcLength)
+{
+  return srcLength >= HUFF_MAGIC_SIZE && src[0] == 'H' && src[1] == 'U' && src[2] == 'F' &&
+         src[3] == (HUFF_FORMAT_FLAG | HUFF_FORMAT_CONTEXT);
+}
+static int HuffDecompressContext_(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity,
+                                  size_t *dstLength)
+{
+  uint8_t lengths[HUFF_CONTEXT_MAX_TABLES][257];
+  int maxLengths[HUFF_CONTEXT_MAX_TABLES];
+  size_t tableStarts[HUFF_CONTEXT_MAX_TABLES];
+  uint8_t header[HUFF_CANONICAL_HEADER_MAX];
+  uint8_t map[256];
+  const uint16_t *contextEntries[256];
+  uint32_t contextMasks[256];
+  uint16_t *entries;
+  const uint8_t *cur;
+  const uint8_t *end;
+  uint64_t rawLength;
+  uint64_t bitBuf;
+  size_t entryCount = 0;
+  size_t pos;
+  unsigned symbols = 0;
+  int tableCount;
+  int width = 0;
+  int bitCount;
+  int bitPos;
+  int prev;
+  int i;
+  int c;
+  int t;
+  assert(src != NULL);
+
+  cur = src + HUFF_CONTEXT_HEADER_SIZE;
+  end = src + srcLength;
+  if (srcLength < HUFF_CONTEXT_HEADER_SIZE)
+    return HUFF_BADDATA;
+  rawLength = HuffLoadLE64_(src + HUFF_MAGIC_SIZE);
+  tableCount = src[HUFF_MAGIC_SIZE + 8];
+  if (tableCount == 0 || tableCount > HUFF_CONTEXT_MAX_TABLES)
+    return HUFF_BADDATA;
+
+  while ((1 << width) < tableCount)
+    width++;
+  if ((size_t)(end - cur) < (size_t)(256*width + 7)/8)
+    return HUFF_BADDATA;
+  bitPos = 0;
+  for (c = 0; c < 256; c++) {
+    uint32_t value = 0;
+    HuffHeaderGetBits_(cur, 256*width, &bitPos, width, &value);
+    if (value >= (uint32_t)tableCount)
+      return HUFF_BADDATA;
+    map[c] = (uint8_t)value;
+  }
+  cur += (256*width + 7)/8;
+
+  /* The tables' headers are canonical headers without the magic, so they're read as one with it put back */
+  header[0] = 'H';
+  header[1] = 'U';
+  header[2] = 'F';
+  header[3] = HUFF_FORMAT_FLAG | HUFF_FORMAT_CANONICAL;
+  for (t = 0; t < tableCount; t++) {
+    uint64_t kraftSum = 0;
+    size_t left = (size_t)(end - cur);
+    int headerSize;
+    if (left > HUFF_CANONICAL_HEADER_MAX - HUFF_MAGIC_SIZE)
+      left = HUFF_CANONICAL_HEADER_MAX - HUFF_MAGIC_SIZE;
+    memcpy(header + HUFF_MAGIC_SIZE, cur, left);
+    if (HuffHeaderReadLengths(header, HUFF_MAGIC_SIZE + (int)left, lengths[t], &headerSize))
+      return HUFF_BADDATA;
+
+    /* Complete and short enough that every lookup lands on a symbol, as with interleaved stream blocks */
+    maxLengths[t] = header[HUFF_MAGIC_SIZE];
+    if (maxLengths[t] > HUFF_CONTEXT_MAX_LENGTH)
+      return HUFF_BADDATA;
+    for (i = 0; i < 257; i++) {
+      if (lengths[t][i] != 0)
+        kraftSum += (uint64_t)1 << (maxLengths[t] - lengths[t][i]);
+    }
+    if (kraftSum != ((uint64_t)1 << maxLengths[t]))
+      return HUFF_BADDATA;
+
+    tableStarts[t] = entryCount;
+    entryCount += (size_t)1 << maxLengths[t];
+    cur += headerSize - HUFF_MAGIC_SIZE;
+  }
+
+  if (rawLength > dstCapacity)
+    return HUFF_TOOMUCHDATA;
+
+  /* Each entry is the symbol in the low 9 bits and its length above them - a couple of bytes, so that all of the
+     tables together are small enough to stay in cache */
+  entries = malloc(entryCount*sizeof(*entries));
+  if (entries == NULL)
+    return HUFF_NOMEM;
+  for (t = 0; t < tableCount; t++) {
+    HuffCodeTable codes = HuffCodeTableInitCanonical(lengths[t]);
+    if (codes == NULL) {
+      free(entries);
+      return HUFF_NOMEM;
+    }
+    for (i = 0; i < 257; i++) {
+      int length = codes->codes[i].length;
+      size_t idx;
+      if (length == 0)
+        continue;
+      for (idx = (size_t)codes->codes[i].bits; idx < ((size_t)1 << maxLengths[t]); idx += (size_t)1 << length)
+        entries[tableStarts[t] + idx] = (uint16_t)(i | length << 9);
+    }
+    HuffCodeTableDestroy(codes);
+  }
+  for (c = 0; c < 256; c++) {
+    contextEntries[c] = entries + tableStarts[map[c]];
+    contextMasks[c] = ((uint32_t)1 << maxLengths[map[c]]) - 1;
+  }
+
+  /* A refill leaves at least 56 bits, which is 5 codes before the next one */
+  bitBuf = 0;
+  bitCount = 0;
+  prev = 0;
+  pos = 0;
+  while (end - cur >= 8 && rawLength - pos >= 5) {
+    bitBuf |= HuffLoadLE64_(cur) << bitCount;
+    cur += (63 - bitCount) >> 3;
+    bitCount |= 56;
+    for (i = 0; i < 5; i++) {
+      unsigned entry = contextEntries[prev][bitBuf & contextMasks[prev]];
+      symbols |= entry;
+      prev = (uint8_t)entry;
+      dst[pos++] = (uint8_t)entry;
+      bitBuf >>= entry >> 9;
+      bitCount -= entry >> 9;
+    }
+  }
+
+  /* The rest a byte and a symbol at a time, as with interleaved stream blocks */
+  for (; pos < rawLength; pos++) {
+    unsigned entry;
+    while (bitCount <= 56 && cur < end) {
+      bitBuf |= (uint64_t)*cur++ << bitCount;
+      bitCount += 8;
+    }
+
+    entry = contextEntries[prev][bitBuf & contextMasks[prev]];
+    if ((int)(entry >> 9) > bitCount)
+      break;
+    symbols |= entry;
+    prev = (uint8_t)entry;
+    dst[pos] = (uint8_t)entry;
+    bitBuf >>= entry >> 9;
+    bitCount -= entry >> 9;
+  }
+  free(entries);
+
+  /* Every table has an EOF code, but it can't be in the data, and the code has to end where its padding does */
+  if (pos < rawLength || (symbols & 0x100) || (end - cur)*8 + bitCount >= 8)
+    return HUFF_BADDATA;
+
+  *dstLength = (size_t)rawLength;
+  return HUFF_SUCCESS;
+}
+
+/* frames
+   A frame cuts the data into blocks that are coded separately, each with its own table, so blocks can be coded on
+   separate threads and the table can follow the data as it changes
+   The payload of a Huffman block is a whole canonical stream, as written by HuffCompress
+   The payload of a repeat block is the distance back from its block header to the header of an earlier Huffman block
+   in the same frame (4 bytes), then the data coded with that block's table and no header, as written by
+   HuffCompressWithTable - so blocks whose data hasn't changed much don't pay for a header again
+   Blocks that Huffman coding doesn't suit are written as they are (stored), as the one byte they're made of (single),
+   or as runs - a byte, then the number of times it repeats after the first as a varint (7 bits a byte, lowest first,
+   top bit set on all but the last) - whichever is smallest, so no block takes more than its header over its data
+   The payload of an interleaved stream block is the number of bitstreams, a canonical header with a limit of
+   HUFF_STREAM_MAX_LENGTH, the byte length of every bitstream but the last (4 bytes each), then the bitstreams
+   Symbol i of the block goes in bitstream i % count, and each bitstream is padded out to a whole byte with no EOF,
+   the block header having the number of symbols - so a decoder can work on all of them at once
+   An index block can go last, right before the end block - its payload has the uncompressed offset and the frame
+   offset of every block, 8 bytes each, then the total uncompressed length, the frame offset of the index block itself,
+   the number of blocks, and "HIDX", so it can be found from the end of the frame */
+struct HuffFrameJob_
+{
+  const uint8_t *src;
+  size_t srcLength;
+  /* Room for the block, HuffBlockBound_(srcLength) bytes */
+  uint8_t *dst;
+  size_t dstLength;
+  int flags;
+  /* Code lengths of the table a repeat block codes with, or NULL for a block with a table of its own */
+  const uint8_t *lengths;
+  int res;
+};
+/* A block as planned by HuffFrameSplit_ */
+struct HuffFrameSegment_
+{
+  size_t length;
+  /* Of the whole block, headers included */
+  size_t size;
+  /* Set if the block repeats the last table, in which case |lengths| are that table's */
+  int repeat;
+  uint8_t lengths[257];
+};
+/* Where HuffFrameSplit_ is up to */
+struct HuffFrameSplitter_
+{
+  const uint8_t *src;
+  struct HuffFrameSegment_ *segments;
+  size_t segmentCount;
+  /* Of all the blocks so far */
+  size_t totalSize;
+  /* The block being built up, which starts |start| bytes in, and its size as a Huffman block */
+  ctr counts[256];
+  uint8_t lengths[257];
+  size_t length;
+  size_t size;
+  uint64_t start;
+  /* The last table that went out, and where its block starts */
+  uint8_t tableLengths[257];
+  uint64_t tableStart;
+  int haveTable;
+};
+/* Where a block is, and what it holds */
+struct HuffBlockRef_
+{
+  int type;
+  /* Of the payload */
+  size_t srcPos;
+  size_t payloadLength;
+  size_t rawLength;
+  uint64_t rawPos;
+  /* Of the payload that starts with the block's table - the block's own, or the one a repeat block points at */
+  size_t tablePos;
+  size_t tableLength;
+};
+/* Walks the blocks of one or more frames written one after another */
+struct HuffFrameCursor_
+{
+  const uint8_t *src;
+  size_t srcLength;
+  size_t pos;
+  uint64_t rawPos;
+  uint32_t blockSize;
+  /* Of the frame |pos| is in, which is as far back as a repeat block can look */
+  size_t frameStart;
+  /* 0 when |pos| is at the start of a frame */
+  int inFrame;
+};
+/* A run of blocks for one thread of HuffFrameDecompress */
+struct HuffFrameDecodeJob_
+{
+  const uint8_t *src;
+  uint8_t *dst;
+  const struct HuffBlockRef_ *blocks;
+  size_t blockCount;
+  int res;
+};
+#define HUFF_INDEX_ENTRY_SIZE 16
+#define HUFF_INDEX_FOOTER_SIZE (8 + 8 + 4 + 4)
+
+/* Most bytes a block holding |length| bytes can take, headers included */
+static size_t HuffBlockBound_(size_t length);
+/* Codes one block into |dst|, which has to have HuffBlockBound_(srcLength) bytes of room
+   With |lengths|, it's a repeat block coded with them, and the distance back to their block is left as 0
+   Returns HUFF_SUCCESS, or an error code */
+static int HuffBlockCompress_(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t *dstLength, int flags,
+                              const uint8_t *lengths);
+/* Codes the payload of an interleaved stream block, the same way
+   |srcLength| can't be 0 */
+static int HuffBlockCompressStreams_(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t *dstLength);
+static int HuffBlockCompressRepeat_(const uint8_t *src, size_t srcLength, const uint8_t *lengths, uint8_t *dst,
+                                    size_t *dstLength);
+/* Writes the payload of a run block, which has to have room for HuffBlockRunsSize_ bytes */
+static void HuffBlockCompressRuns_(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t *dstLength);
+/* Picks the kind of block that holds |srcLength| bytes with |counts| in the fewest bytes, given the size they'd take
+   as a Huffman block - ties go to whichever decodes the fastest
+   Returns the block type, with the size of the block in |*size| */
+static int HuffBlockChooseType_(const uint8_t *src, size_t srcLength, const ctr *counts, size_t huffmanSize,
+                                size_t *size);
+/* The same, going by the counts alone, so without the run-length coding - returns just the size */
+static size_t HuffBlockCountsSize_(const ctr *counts, size_t length, size_t huffmanSize);
+/* Returns the size of the payload of a run block for |src|, or SIZE_MAX if it's |limit| bytes or more */
+static size_t HuffBlockRunsSize_(const uint8_t *src, size_t srcLength, size_t limit);
+/* Decodes a block into |dst|, which has to have exactly the block's uncompressed length of room
+   Returns HUFF_SUCCESS, or an error code */
+static int HuffBlockDecompress_(const uint8_t *src, const struct HuffBlockRef_ *block, uint8_t *dst);
+static int HuffBlockDecompressStreams_(const uint8_t *payload, size_t payloadLength, uint8_t *dst, size_t rawLength);
+static int HuffBlockDecompressRepeat_(const uint8_t *src, const struct HuffBlockRef_ *block, uint8_t *dst);
+static int HuffBlockDecompressRuns_(const uint8_t *payload, size_t payloadLength, uint8_t *dst, size_t rawLength);
+/* Plans the blocks for HUFF_FRAME_SPLIT - a window at a time, the data goes in a new block if two blocks with a table
+   each come out smaller than one, and a block repeats the table before it if that comes out no bigger than its own
+   None are longer than |blockSize|, and the sizes are exactly what HuffBlockCompress_ writes
+   Sets |*segments| to the blocks (to be freed), |*segmentCount| to how many there are, and |*size| to their total size
+   Returns HUFF_SUCCESS, or an error code */
+static int HuffFrameSplit_(const uint8_t *src, size_t srcLength, int blockSize, struct HuffFrameSegment_ **segments,
+                           size_t *segmentCount, size_t *size);
+/* Adds the block being built up to the plan */
+static void HuffFrameSplitEnd_(struct HuffFrameSplitter_ *splitter);
+/* Works out the code lengths for a block with |counts| (and the EOF), and returns the size of the block
+   Returns 0 if there isn't enough memory */
+static size_t HuffFrameBlockSize_(const ctr *counts, uint8_t *lengths);
+static void HuffFrameRunJob_(void *job);
+static void HuffFrameRunDecodeJob_(void *job);
+static void HuffFrameCursorInit_(struct HuffFrameCursor_ *cursor, const uint8_t *src, size_t srcLength);
+/* Moves to the next block that holds data, skipping index blocks
+   Returns 1 with the block in |*block|, 0 at the end of the data, or -1 if the frame doesn't make sense */
+static int HuffFrameCursorNext_(struct HuffFrameCursor_ *cursor, struct HuffBlockRef_ *block);
+/* Looks for an index at the end of |src| that covers all of it
+   Returns the number of blocks in it with its entries in |*entries|, or -1 if there isn't one */
+static int64_t HuffFrameFindIndex_(const uint8_t *src, size_t srcLength, const uint8_t **entries);
+
+size_t HuffFrameCompressBound(size_t length, int blockSize)
+{
+  size_t blockCount;
+  if (blockSize == 0)
+    blockSize = HUFF_DEFAULTBLOCKSIZE;
+  assert(blockSize >= HUFF_MINBLOCKSIZE && blockSize <= HUFF_MAXBLOCKSIZE);
+
+  /* A block that would come out bigger than its data is stored instead */
+  blockCount = (length + blockSize - 1) / blockSize;
+  return HUFF_FRAME_HEADER_SIZE + 1 + blockCount*HUFF_BLOCK_HEADER_SIZE + length
+         + HUFF_BLOCK_HEADER_SIZE + blockCount*HUFF_INDEX_ENTRY_SIZE + HUFF_INDEX_FOOTER_SIZE;
+}
+int HuffFrameCompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength,
+                      int blockSize, int threadCount, int flags)
+{
+  struct HuffFrameJob_ *jobs;
+  struct HuffFrameSegment_ *segments = NULL;
+  size_t segmentCount;
+  size_t segmentIdx = 0;
+  uint8_t *scratch = NULL;
+  size_t scratchSize;
+  /* Uncompressed and frame offsets of every block, for the index */
+  uint64_t *blockPos = NULL;
+  size_t blockCount = 0;
+  size_t srcPos = 0;
+  size_t dstPos = 0;
+  /* Of the last block with a table of its own */
+  size_t tablePos = 0;
+  int ret = HUFF_SUCCESS;
+  int i;
+  assert(srcLength == 0 || src != NULL);
+  assert(dstCapacity == 0 || dst != NULL);
+  assert(dstLength != NULL);
+  assert(threadCount > 0);
+  assert((flags & ~(HUFF_FRAME_INDEX | HUFF_FRAME_STREAMS | HUFF_FRAME_SPLIT)) == 0);
+  assert(!((flags & HUFF_FRAME_STREAMS) && (flags & HUFF_FRAME_SPLIT)));
+
+  if (blockSize == 0)
+    blockSize = HUFF_DEFAULTBLOCKSIZE;
+  assert(blockSize >= HUFF_MINBLOCKSIZE && blockSize <= HUFF_MAXBLOCKSIZE);
+
+  *dstLength = 0;
+
+  segmentCount = (srcLength + blockSize - 1) / blockSize;
+  if (flags & HUFF_FRAME_SPLIT) {
+    size_t size;
+    size_t frameSize;
+
+    ret = HuffFrameSplit_(src, srcLength, blockSize, &segments, &segmentCount, &size);
+    if (ret != HUFF_SUCCESS)
+      return ret;
+
+    /* More blocks means more block headers and index entries, which could in theory take the frame over its bound
+       even though every cut made it smaller - if so, fall back on blocks of the same size */
+    frameSize = HUFF_FRAME_HEADER_SIZE + size + 1;
+    if (flags & HUFF_FRAME_INDEX)
+      frameSize += HUFF_BLOCK_HEADER_SIZE + segmentCount*HUFF_INDEX_ENTRY_SIZE + HUFF_INDEX_FOOTER_SIZE;
+    if (frameSize > HuffFrameCompressBound(srcLength, blockSize)) {
+      free(segments);
+      segments = NULL;
+      segmentCount = (srcLength + blockSize - 1) / blockSize;
+    }
+  }
+
+  /* No point in more threads than blocks */
+  if ((size_t)threadCount > segmentCount)
+    threadCount = (int)segmentCount;
+  if (threadCount == 0)
+    threadCount = 1;
+
+  if (dstCapacity < HUFF_FRAME_HEADER_SIZE) {
+    free(segments);
+    return HUFF_TOOMUCHDATA;
+  }
+
+  dst[0] = 'H';
+  dst[1] = 'U';
+  dst[2] = 'F';
+  dst[3] = HUFF_FORMAT_FLAG | HUFF_FORMAT_FRAMED;
+  HuffStoreLE32_(dst + HUFF_MAGIC_SIZE, (uint32_t)blockSize);
+  dstPos = HUFF_FRAME_HEADER_SIZE;
+
+  /* Blocks are coded a batch at a time, one per thread, into scratch space, then copied out in order
+     That keeps the memory use to a block or so per thread, and the output the same for any number of threads */
+  scratchSize = HuffBlockBound_(blockSize);
+  jobs = malloc(threadCount*sizeof(*jobs));
+  if (jobs == NULL) {
+    ret = HUFF_NOMEM;
+    goto out;
+  }
+  scratch = malloc(threadCount*scratchSize);
+  if (scratch == NULL) {
+    ret = HUFF_NOMEM;
+    goto out;
+  }
+  if (flags & HUFF_FRAME_INDEX) {
+    blockPos = malloc((segmentCount + 1)*2*sizeof(*blockPos));
+    if (blockPos == NULL) {
+      ret = HUFF_NOMEM;
+      goto out;
+    }
+  }
+
+  while (srcPos < srcLength && ret == HUFF_SUCCESS) {
+    int jobCount = 0;
+
+    while (jobCount < threadCount && srcPos < srcLength) {
+      struct HuffFrameJob_ *job = &jobs[jobCount];
+      job->src = src + srcPos;
+      job->dst = scratch + jobCount*scratchSize;
+      job->flags = flags & ~HUFF_FRAME_SPLIT;
+      if (segments != NULL) {
+        job->srcLength = segments[segmentIdx].length;
+        job->lengths = segments[segmentIdx].repeat ? segments[segmentIdx].lengths : NULL;
+        segmentIdx++;
+      } else {
+        job->srcLength = (srcLength - srcPos < (size_t)blockSize) ? srcLength - srcPos : (size_t)blockSize;
+        job->lengths = NULL;
+      }
+      srcPos += job->srcLength;
+      jobCount++;
+    }
+
+    HuffRunJobs_(HuffFrameRunJob_, jobs, sizeof(*jobs), jobCount);
+
+    for (i = 0; i < jobCount; i++) {
+      if (jobs[i].res != HUFF_SUCCESS) {
+        ret = jobs[i].res;
+        break;
+      }
+      assert(segments == NULL || jobs[i].dstLength == segments[segmentIdx - jobCount + i].size);
+      if (dstCapacity - dstPos < jobs[i].dstLength) {
+        ret = HUFF_TOOMUCHDATA;
+        break;
+      }
+      if (blockPos != NULL) {
+        blockPos[2*blockCount] = (uint64_t)(jobs[i].src - src);
+        blockPos[2*blockCount + 1] = dstPos;
+      }
+      blockCount++;
+      memcpy(dst + dstPos, jobs[i].dst, jobs[i].dstLength);
+      /* Only now is it known how far back the table is */
+      if (jobs[i].lengths != NULL)
+        HuffStoreLE32_(dst + dstPos + HUFF_BLOCK_HEADER_SIZE, (uint32_t)(dstPos - tablePos));
+      else if (jobs[i].dst[0] == HUFF_BLOCK_HUFFMAN)
+        tablePos = dstPos;
+      dstPos += jobs[i].dstLength;
+    }
+  }
+
+  if (ret == HUFF_SUCCESS && blockPos != NULL) {
+    size_t indexLength = blockCount*HUFF_INDEX_ENTRY_SIZE + HUFF_INDEX_FOOTER_SIZE;
+    uint8_t *out;
+
+    if (dstCapacity - dstPos < HUFF_BLOCK_HEADER_SIZE + indexLength) {
+      ret = HUFF_TOOMUCHDATA;
+      goto out;
+    }
+
+    out = dst + dstPos;
+    out[0] = HUFF_BLOCK_INDEX;
+    HuffStoreLE32_(out + 1, 0);
+    HuffStoreLE32_(out + 5, (uint32_t)indexLength);
+    out += HUFF_BLOCK_HEADER_SIZE;
+
+    for (i = 0; (size_t)i < blockCount; i++) {
+      HuffStoreLE64_(out, blockPos[2*i]);
+      HuffStoreLE64_(out + 8, blockPos[2*i + 1]);
+      out += HUFF_INDEX_ENTRY_SIZE;
+    }
+    HuffStoreLE64_(out, srcLength);
+    HuffStoreLE64_(out + 8, dstPos);
+    HuffStoreLE32_(out + 16, (uint32_t)blockCount);
+    memcpy(out + 20, "HIDX", 4);
+
+    dstPos += HUFF_BLOCK_HEADER_SIZE + indexLength;
+  }
+
+out:
+  free(blockPos);
+  free(scratch);
+  free(jobs);
+  free(segments);
+
+  if (ret != HUFF_SUCCESS)
+    return ret;
+
+  if (dstCapacity - dstPos < 1)
+    return HUFF_TOOMUCHDATA;
+  dst[dstPos++] = HUFF_BLOCK_END;
+
+  *dstLength = dstPos;
+  return HUFF_SUCCESS;
+}
+int HuffFrameDecompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength,
+                        int threadCount)
+{
+  struct HuffFrameCursor_ cursor;
+  struct HuffBlockRef_ *blocks = NULL;
+  size_t blockCount = 0;
+  size_t blockCapacity = 0;
+  struct HuffFrameDecodeJob_ *jobs = NULL;
+  size_t blockIdx;
+  int ret = HUFF_SUCCESS;
+  int i;
+  assert(srcLength == 0 || src != NULL);
+  assert(dstCapacity == 0 || dst != NULL);
+  assert(dstLength != NULL);
+  assert(threadCount > 0);
+
+  *dstLength = 0;
+
+  /* Find all the blocks first, so they can be shared out between the threads
+     Going by the block headers is only a hop per block, so there's no need for the index here */
+  HuffFrameCursorInit_(&cursor, src, srcLength);
+  for (;;) {
+    struct HuffBlockRef_ block;
+    int res;
+
+    res = HuffFrameCursorNext_(&cursor, &block);
+    if (res == 0) {
+      break;
+    } else if (res < 0) {
+      ret = HUFF_BADDATA;
+      goto out;
+    }
+
+    if (block.rawPos > dstCapacity || block.rawLength > dstCapacity - (size_t)block.rawPos) {
+      ret = HUFF_TOOMUCHDATA;
+      goto out;
+    }
+
+    if (blockCount == blockCapacity) {
+      size_t newCapacity = (blockCapacity == 0) ? 16 : blockCapacity*2;
+      struct HuffBlockRef_ *newBlocks = realloc(blocks, newCapacity*sizeof(*blocks));
+      if (newBlocks == NULL) {
+        ret = HUFF_NOMEM;
+        goto out;
+      }
+      blocks = newBlocks;
+      blockCapacity = newCapacity;
+    }
+    blocks[blockCount++] = block;
+  }
+
+  if (blockCount > 0) {
+    /* Each thread takes a run of blocks, so it writes one stretch of |dst| */
+    if ((size_t)threadCount > blockCount)
+      threadCount = (int)blockCount;
+
+    jobs = malloc(threadCount*sizeof(*jobs));
+    if (jobs == NULL) {
+      ret = HUFF_NOMEM;
+      goto out;
+    }
+
+    blockIdx = 0;
+    for (i = 0; i < threadCount; i++) {
+      size_t runLength = blockCount / threadCount + ((size_t)i < blockCount % threadCount);
+      jobs[i].src = src;
+      jobs[i].dst = dst;
+      jobs[i].blocks = blocks + blockIdx;
+      jobs[i].blockCount = runLength;
+      blockIdx += runLength;
+    }
+
+    HuffRunJobs_(HuffFrameRunDecodeJob_, jobs, sizeof(*jobs), threadCount);
+
+    for (i = 0; i < threadCount; i++) {
+      if (jobs[i].res != HUFF_SUCCESS) {
+        ret = jobs[i].res;
+        goto out;
+      }
+    }
+  }
+
+  *dstLength = (size_t)cursor.rawPos;
+out:
+  free(jobs);
+  free(blocks);
+  return ret;
+}
+int HuffDecodeRange(const uint8_t *src, size_t srcLength, uint64_t offset, uint8_t *dst, size_t length,
+                    size_t *dstLength)
+{
+  struct HuffFrameCursor_ cursor;
+  const uint8_t *entries;
+  int64_t entryCount;
+  uint8_t *scratch = NULL;
+  size_t scratchSize = 0;
+  size_t done = 0;
+  int ret = HUFF_SUCCESS;
+  assert(srcLength == 0 || src != NULL);
+  assert(length == 0 || dst != NULL);
+  assert(dstLength != NULL);
+
+  *dstLength = 0;
+
+  HuffFrameCursorInit_(&cursor, src, srcLength);
+
+  /* With an index, jump straight to the last block that starts at or before |offset|
+     Without one, the block headers still let everything before it be skipped without decoding it */
+  entryCount = HuffFrameFindIndex_(src, srcLength, &entries);
+  if (entryCount > 0 && offset >= HuffLoadLE64_(entries)) {
+    int64_t lo = 0;
+    int64_t hi = entryCount - 1;
+    uint64_t blockPos;
+
+    while (lo < hi) {
+      int64_t mid = lo + (hi - lo + 1) / 2;
+      if (HuffLoadLE64_(entries + mid*HUFF_INDEX_ENTRY_SIZE) <= offset)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+
+    blockPos = HuffLoadLE64_(entries + lo*HUFF_INDEX_ENTRY_SIZE + 8);
+    if (blockPos < HUFF_FRAME_HEADER_SIZE || blockPos >= srcLength)
+      return HUFF_BADDATA;
+
+    cursor.pos = (size_t)blockPos;
+    cursor.rawPos = HuffLoadLE64_(entries + lo*HUFF_INDEX_ENTRY_SIZE);
+    cursor.blockSize = HuffLoadLE32_(src + HUFF_MAGIC_SIZE);
+    cursor.inFrame = 1;
+    if (cursor.blockSize < HUFF_MINBLOCKSIZE || cursor.blockSize > HUFF_MAXBLOCKSIZE)
+      return HUFF_BADDATA;
+  }
+
+  while (done < length) {
+    struct HuffBlockRef_ block;
+    uint64_t want = offset + done;
+    size_t start;
+    size_t count;
+    int res;
+
+    res = HuffFrameCursorNext_(&cursor, &block);
+    if (res == 0) {
+      break;
+    } else if (res < 0 || block.rawPos > want) {
+      ret = HUFF_BADDATA;
+      goto out;
+    }
+
+    if (want - block.rawPos >= block.rawLength)
+      continue;
+
+    start = (size_t)(want - block.rawPos);
+    count = block.rawLength - start;
+    if (count > length - done)
+      count = length - done;
+
+    if (start == 0 && count == block.rawLength) {
+      res = HuffBlockDecompress_(src, &block, dst + done);
+    } else {
+      /* Only part of this block is wanted, so decode all of it to the side */
+      if (scratchSize < block.rawLength) {
+        free(scratch);
+        scratch = malloc(cursor.blockSize);
+        if (scratch == NULL) {
+          ret = HUFF_NOMEM;
+          goto out;
+        }
+        scratchSize = cursor.blockSize;
+      }
+      res = HuffBlockDecompress_(src, &block, scratch);
+      if (res == HUFF_SUCCESS)
+        memcpy(dst + done, scratch + start, count);
+    }
+    if (res != HUFF_SUCCESS) {
+      ret = res;
+      goto out;
+    }
+
+    done += count;
+  }
+
+  *dstLength = done;
+out:
+  free(scratch);
+  return ret;
+}
+
+static int HuffFrameIsFramed_(const uint8_t *src, size_t srcLength)
+{
+  assert(srcLength == 0 || src != NULL);
+
+  return srcLength >= HUFF_MAGIC_SIZE && src[0] == 'H' && src[1] == 'U' && src[2] == 'F'
+         && src[3] == (HUFF_FORMAT_FLAG | HUFF_FORMAT_FRAMED);
+}
+static size_t HuffBlockBound_(size_t length)
+{
+  /* Interleaved streams cost the count and the jump table, a byte of padding per stream rather than an EOF,
+     and 8 bytes of room to write the last bits with */
+  return HUFF_BLOCK_HEADER_SIZE + HuffCompressBound(length) + 1 + 4*(HUFF_STREAM_COUNT - 1) + HUFF_STREAM_COUNT + 8;
+}
+static int HuffBlockCompress_(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t *dstLength, int flags,
+                              const uint8_t *lengths)
+{
+  struct HuffCounter_ counter;
+  struct HuffEncoder_ encoder;
+  uint8_t *payload = dst + HUFF_BLOCK_HEADER_SIZE;
+  uint8_t codeLengths[257];
+  size_t huffmanSize;
+  size_t size;
+  size_t payloadLength;
+  int type;
+  int res = HUFF_SUCCESS;
+  assert(srcLength == 0 || src != NULL);
+  assert(srcLength <= HUFF_MAXBLOCKSIZE);
+  assert(dst != NULL);
+  assert(dstLength != NULL);
+
+  if (lengths != NULL) {
+    type = HUFF_BLOCK_REPEAT;
+    res = HuffBlockCompressRepeat_(src, srcLength, lengths, payload, &payloadLength);
+    goto out;
+  }
+
+  HuffCounterInitState_(&counter);
+  res = HuffCounterFeedData64(&counter, src, srcLength);
+  if (res != HUFF_SUCCESS)
+    return res;
+
+  huffmanSize = HuffFrameBlockSize_(counter.counts, codeLengths);
+  if (huffmanSize == 0)
+    return HUFF_NOMEM;
+  type = HuffBlockChooseType_(src, srcLength, counter.counts, huffmanSize, &size);
+
+  if (type == HUFF_BLOCK_STORED) {
+    memcpy(payload, src, srcLength);
+    payloadLength = srcLength;
+  } else if (type == HUFF_BLOCK_SINGLE) {
+    payload[0] = src[0];
+    payloadLength = 1;
+  } else if (type == HUFF_BLOCK_RUNS) {
+    HuffBlockCompressRuns_(src, srcLength, payload, &payloadLength);
+  } else if ((flags & HUFF_FRAME_STREAMS) && srcLength > 0) {
+    type = HUFF_BLOCK_STREAMS;
+    res = HuffBlockCompressStreams_(src, srcLength, payload, &payloadLength);
+
+    /* The choice went by the size as a plain Huffman block, which the extra streams can tip over the data's size */
+    if (res == HUFF_SUCCESS && payloadLength > srcLength) {
+      type = HUFF_BLOCK_STORED;
+      memcpy(payload, src, srcLength);
+      payloadLength = srcLength;
+    }
+  } else {
+    /* Just what HuffCompress does, but with the counts already there */
+    res = HuffEncoderInitState_(&encoder, &counter, HUFF_FORMAT_CANONICAL, 0);
+    if (res != HUFF_SUCCESS)
+      return res;
+    res = HuffCompressWith_(&encoder, src, srcLength, payload, HuffCompressBound(srcLength), &payloadLength);
+    HuffCodeTableDestroy(encoder.codes);
+  }
+  assert(res != HUFF_SUCCESS || (flags & HUFF_FRAME_STREAMS) || HUFF_BLOCK_HEADER_SIZE + payloadLength == size);
+
+out:
+  if (res != HUFF_SUCCESS)
+    return res;
+
+  dst[0] = (uint8_t)type;
+  HuffStoreLE32_(dst + 1, (uint32_t)srcLength);
+  HuffStoreLE32_(dst + 5, (uint32_t)payloadLength);
+
+  *dstLength = HUFF_BLOCK_HEADER_SIZE + payloadLength;
+  return HUFF_SUCCESS;
+}
+static int HuffBlockCompressStreams_(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t *dstLength)
+{
+  struct HuffCounter_ counter;
+  HuffCodeTable codes;
+  uint8_t lengths[257];
+  uint8_t *jumps;
+  uint8_t *out;
+  int headerSize;
+  int res;
+  int s;
+  assert(src != NULL);
+  assert(srcLength > 0);
+  assert(srcLength <= HUFF_MAXBLOCKSIZE);
+  assert(dst != NULL);
+  assert(dstLength != NULL);
+
+  HuffCounterInitState_(&counter);
+  res = HuffCounterFeedData64(&counter, src, srcLength);
+  if (res != HUFF_SUCCESS)
+    return res;
+
+  if (HuffCanonicalLengths(&counter, HUFF_STREAM_MAX_LENGTH, lengths))
+    return HUFF_NOMEM;
+  codes = HuffCodeTableInitCanonical(lengths);
+  if (codes == NULL)
+    return HUFF_NOMEM;
+
+  dst[0] = HUFF_STREAM_COUNT;
+  headerSize = HuffHeaderWriteLengths(lengths, HUFF_STREAM_MAX_LENGTH, dst + 1);
+  jumps = dst + 1 + headerSize;
+  out = jumps + 4*(HUFF_STREAM_COUNT - 1);
+
+  /* A pass over the block for each stream, writing the whole bytes out after every code
+     The last write of a stream can run up to 8 bytes past it, which the next stream (or the slack) covers */
+  for (s = 0; s < HUFF_STREAM_COUNT; s++) {
+    uint8_t *start = out;
+    uint64_t bitBuf = 0;
+    int bitCount = 0;
+    size_t i;
+
+    for (i = s; i < srcLength; i += HUFF_STREAM_COUNT) {
+      const struct HuffCode *code = &codes->codes[src[i]];
+      assert(code->length > 0 && code->length <= HUFF_STREAM_MAX_LENGTH);
+
+      bitBuf |= code->bits << bitCount;
+      bitCount += code->length;
+      HuffStoreLE64_(out, bitBuf);
+      out += bitCount >> 3;
+      bitBuf >>= bitCount & ~7;
+      bitCount &= 7;
+    }
+    if (bitCount > 0)
+      *out++ = (uint8_t)bitBuf;
+
+    if (s < HUFF_STREAM_COUNT - 1)
+      HuffStoreLE32_(jumps + 4*s, (uint32_t)(out - start));
+  }
+
+  HuffCodeTableDestroy(codes);
+
+  *dstLength = (size_t)(out - dst);
+  return HUFF_SUCCESS;
+}
+static void HuffBlockCompressRuns_(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t *dstLength)
+{
+  uint8_t *out = dst;
+  size_t i = 0;
+  assert(src != NULL);
+  assert(dst != NULL);
+  assert(dstLength != NULL);
+
+  while (i < srcLength) {
+    size_t run = 1;
+    while (i + run < srcLength && src[i + run] == src[i])
+      run++;
+
+    *out++ = src[i];
+    i += run;
+    for (run--; run >= 0x80; run >>= 7)
+      *out++ = (uint8_t)(run | 0x80);
+    *out++ = (uint8_t)run;
+  }
+
+  *dstLength = (size_t)(out - dst);
+}
+static int HuffBlockChooseType_(const uint8_t *src, size_t srcLength, const ctr *counts, size_t huffmanSize,
+                                size_t *size)
+{
+  size_t runsSize;
+  int type = HUFF_BLOCK_HUFFMAN;
+  int symbols = 0;
+  int i;
+  assert(srcLength == 0 || src != NULL);
+  assert(counts != NULL);
+  assert(size != NULL);
+
+  for (i = 0; i < 256; i++)
+    symbols += (counts[i] != 0);
+  if (symbols == 1) {
+    *size = HUFF_BLOCK_HEADER_SIZE + 1;
+    return HUFF_BLOCK_SINGLE;
+  }
+
+  *size = huffmanSize;
+  if (HUFF_BLOCK_HEADER_SIZE + srcLength <= *size) {
+    type = HUFF_BLOCK_STORED;
+    *size = HUFF_BLOCK_HEADER_SIZE + srcLength;
+  }
+
+  /* Runs only win when the average one is long, so the look at the data stops as soon as they can't */
+  runsSize = HuffBlockRunsSize_(src, srcLength, *size - HUFF_BLOCK_HEADER_SIZE);
+  if (runsSize != SIZE_MAX) {
+    type = HUFF_BLOCK_RUNS;
+    *size = HUFF_BLOCK_HEADER_SIZE + runsSize;
+  }
+
+  return type;
+}
+static size_t HuffBlockCountsSize_(const ctr *counts, size_t length, size_t huffmanSize)
+{
+  int symbols = 0;
+  int i;
+  assert(counts != NULL);
+
+  for (i = 0; i < 256; i++)
+    symbols += (counts[i] != 0);
+  if (symbols == 1)
+    return HUFF_BLOCK_HEADER_SIZE + 1;
+
+  return (HUFF_BLOCK_HEADER_SIZE + length < huffmanSize) ? HUFF_BLOCK_HEADER_SIZE + length : huffmanSize;
+}
+static size_t HuffBlockRunsSize_(const uint8_t *src, size_t srcLength, size_t limit)
+{
+  size_t size = 0;
+  size_t i = 0;
+  assert(srcLength == 0 || src != NULL);
+
+  while (i < srcLength) {
+    size_t run = 1;
+    while (i + run < srcLength && src[i + run] == src[i])
+      run++;
+
+    /* The byte, then the varint */
+    i += run;
+    size += 2;
+    for (run--; run >= 0x80; run >>= 7)
+      size++;
+    if (size >= limit)
+      return SIZE_MAX;
+  }
+
+  return (size < limit) ? size : SIZE_MAX;
+}
+static int HuffBlockCompressRepeat_(const uint8_t *src, size_t srcLength, const uint8_t *lengths, uint8_t *dst,
+                                    size_t *dstLength)
+{
+  struct HuffTable_ table;
+  int res;
+  assert(srcLength == 0 || src != NULL);
+  assert(lengths != NULL);
+  assert(dst != NULL);
+  assert(dstLength != NULL);
+
+  /* Only the codes are needed to write with */
+  table.codes = HuffCodeTableInitCanonical(lengths);
+  if (table.codes == NULL)
+    return HUFF_NOMEM;
+  table.decode = NULL;
+
+  HuffStoreLE32_(dst, 0);
+  res = HuffCompressWithTable(&table, src, srcLength, dst + 4, HuffCompressBound(srcLength), dstLength);
+  HuffCodeTableDestroy(table.codes);
+
+  *dstLength += 4;
+  return res;
+}
+static int HuffBlockDecompress_(const uint8_t *src, const struct HuffBlockRef_ *block, uint8_t *dst)
+{
+  const uint8_t *payload;
+  size_t written;
+  int res;
+  assert(src != NULL);
+  assert(block != NULL);
+  assert(block->type != HUFF_BLOCK_END && block->type != HUFF_BLOCK_INDEX);
+
+  payload = src + block->srcPos;
+
+  if (block->type == HUFF_BLOCK_STORED) {
+    memcpy(dst, payload, block->rawLength);
+    return HUFF_SUCCESS;
+  }
+  if (block->type == HUFF_BLOCK_SINGLE) {
+    memset(dst, payload[0], block->rawLength);
+    return HUFF_SUCCESS;
+  }
+  if (block->type == HUFF_BLOCK_RUNS)
+    return HuffBlockDecompressRuns_(payload, block->payloadLength, dst, block->rawLength);
+
+  if (block->type == HUFF_BLOCK_STREAMS)
+    return HuffBlockDecompressStreams_(payload, block->payloadLength, dst, block->rawLength);
+  if (block->type == HUFF_BLOCK_REPEAT)
+    return HuffBlockDecompressRepeat_(src, block, dst);
+
+  /* A payload can't hold another frame, or the recursion could go on for as long as the input does */
+  if (HuffFrameIsFramed_(payload, block->payloadLength))
+    return HUFF_BADDATA;
+
+  res = HuffDecompress(payload, block->payloadLength, dst, block->rawLength, &written);
+  if (res == HUFF_TOOMUCHDATA || (res == HUFF_SUCCESS && written != block->rawLength))
+    /* The block holds something other than it says */
+    return HUFF_BADDATA;
+
+  return res;
+}
+static int HuffBlockDecompressStreams_(const uint8_t *payload, size_t payloadLength, uint8_t *dst, size_t rawLength)
+{
+  const uint8_t *cur[HUFF_STREAM_COUNT];
+  const uint8_t *end[HUFF_STREAM_COUNT];
+  uint64_t bitBuf[HUFF_STREAM_COUNT];
+  int bitCount[HUFF_STREAM_COUNT];
+  const struct HuffDecodeEntry *entries;
+  HuffCodeTable codes;
+  HuffDecodeTable table;
+  uint8_t lengths[257];
+  uint64_t kraftSum = 0;
+  uint64_t mask;
+  const uint8_t *p;
+  size_t left;
+  size_t pos;
+  unsigned symbols = 0;
+  int maxLength;
+  int headerSize;
+  int ret = HUFF_BADDATA;
+  int s;
+  int i;
+  assert(payload != NULL);
+  assert(rawLength == 0 || dst != NULL);
+
+  if (payloadLength < 1 || payload[0] != HUFF_STREAM_COUNT)
+    return HUFF_BADDATA;
+  payload++;
+  payloadLength--;
+
+  if (HuffHeaderReadLengths(payload, HuffClamp_(payloadLength), lengths, &headerSize))
+    return HUFF_BADDATA;
+
+  /* With a complete code no longer than the root of the table, every lookup lands on a symbol,
+     so the loop below never has to check for links or holes */
+  maxLength = payload[HUFF_MAGIC_SIZE];
+  if (maxLength > HUFF_STREAM_MAX_LENGTH)
+    return HUFF_BADDATA;
+  for (i = 0; i < 257; i++) {
+    if (lengths[i] != 0)
+      kraftSum += (uint64_t)1 << (maxLength - lengths[i]);
+  }
+  if (kraftSum != ((uint64_t)1 << maxLength))
+    return HUFF_BADDATA;
+
+  payload += headerSize;
+  payloadLength -= headerSize;
+  if (payloadLength < 4*(HUFF_STREAM_COUNT - 1))
+    return HUFF_BADDATA;
+
+  p = payload + 4*(HUFF_STREAM_COUNT - 1);
+  left = payloadLength - 4*(HUFF_STREAM_COUNT - 1);
+  for (s = 0; s < HUFF_STREAM_COUNT; s++) {
+    size_t size = (s < HUFF_STREAM_COUNT - 1) ? HuffLoadLE32_(payload + 4*s) : left;
+    if (size > left)
+      return HUFF_BADDATA;
+
+    cur[s] = p;
+    end[s] = p + size;
+    bitBuf[s] = 0;
+    bitCount[s] = 0;
+    p += size;
+    left -= size;
+  }
+
+  codes = HuffCodeTableInitCanonical(lengths);
+  if (codes == NULL)
+    return HUFF_NOMEM;
+  table = HuffDecodeTableInit(codes);
+  if (table == NULL) {
+    ret = HUFF_NOMEM;
+    goto out;
+  }
+  entries = table->entries;
+  mask = ((uint64_t)1 << table->rootBits) - 1;
+
+  pos = 0;
+  for (;;) {
+    int room = 1;
+
+    /* A refill leaves at least 56 bits, which is 5 codes for every stream before the next one
+       The streams don't depend on each other, so their lookups can all be in flight at once */
+    for (s = 0; s < HUFF_STREAM_COUNT; s++) {
+      if (end[s] - cur[s] < 8)
+        room = 0;
+    }
+    if (!room || rawLength - pos < 5*HUFF_STREAM_COUNT)
+      break;
+
+    for (s = 0; s < HUFF_STREAM_COUNT; s++) {
+      bitBuf[s] |= HuffLoadLE64_(cur[s]) << bitCount[s];
+      cur[s] += (63 - bitCount[s]) >> 3;
+      bitCount[s] |= 56;
+    }
+    for (i = 0; i < 5; i++) {
+      for (s = 0; s < HUFF_STREAM_COUNT; s++) {
+        const struct HuffDecodeEntry *entry = &entries[bitBuf[s] & mask];
+        symbols |= entry->symbol;
+        dst[pos + i*HUFF_STREAM_COUNT + s] = (uint8_t)entry->symbol;
+        bitBuf[s] >>= entry->length;
+        bitCount[s] -= entry->length;
+      }
+    }
+    pos += 5*HUFF_STREAM_COUNT;
+  }
+
+  /* The rest a byte and a symbol at a time
+     Any bits above |bitCount| left by the refill above are from the same bytes that get ORed in here */
+  for (; pos < rawLength; pos++) {
+    const struct HuffDecodeEntry *entry;
+    s = (int)(pos % HUFF_STREAM_COUNT);
+
+    while (bitCount[s] <= 56 && cur[s] < end[s]) {
+      bitBuf[s] |= (uint64_t)*cur[s]++ << bitCount[s];
+      bitCount[s] += 8;
+    }
+
+    entry = &entries[bitBuf[s] & mask];
+    if (entry->length > bitCount[s])
+      goto out1;
+    symbols |= entry->symbol;
+    dst[pos] = (uint8_t)entry->symbol;
+    bitBuf[s] >>= entry->length;
+    bitCount[s] -= entry->length;
+  }
+
+  /* The EOF has a code, but it can't be in the data, and every stream has to end where its padding does */
+  if (symbols > 0xFF)
+    goto out1;
+  for (s = 0; s < HUFF_STREAM_COUNT; s++) {
+    if ((end[s] - cur[s])*8 + bitCount[s] >= 8)
+      goto out1;
+  }
+
+  ret = HUFF_SUCCESS;
+out1:
+  HuffDecodeTableDestroy(table);
+out:
+  HuffCodeTableDestroy(codes);
+  return ret;
+}
+static int HuffBlockDecompressRepeat_(const uint8_t *src, const struct HuffBlockRef_ *block, uint8_t *dst)
+{
+  struct HuffTable_ table;
+  uint8_t lengths[257];
+  size_t written;
+  int headerSize;
+  int res;
+  assert(src != NULL);
+  assert(block != NULL);
+  assert(block->payloadLength >= 4);
+
+  if (HuffHeaderReadLengths(src + block->tablePos, HuffClamp_(block->tableLength), lengths, &headerSize))
+    return HUFF_BADDATA;
+
+  res = HuffTableInitState_(&table, lengths);
+  if (res != HUFF_SUCCESS)
+    return res;
+
+  res = HuffDecompressWithTable(&table, src + block->srcPos + 4, block->payloadLength - 4, dst, block->rawLength,
+                                &written);
+  HuffDecodeTableDestroy(table.decode);
+  HuffCodeTableDestroy(table.codes);
+
+  if (res == HUFF_TOOMUCHDATA || (res == HUFF_SUCCESS && written != block->rawLength))
+    return HUFF_BADDATA;
+
+  return res;
+}
+static int HuffBlockDecompressRuns_(const uint8_t *payload, size_t payloadLength, uint8_t *dst, size_t rawLength)
+{
+  size_t in = 0;
+  size_t pos = 0;
+  assert(payload != NULL);
+  assert(rawLength == 0 || dst != NULL);
+
+  while (in < payloadLength) {
+    uint8_t c = payload[in++];
+    size_t run = 0;
+    int shift;
+
+    /* Runs are no longer than a block, so the varint is at most 4 bytes */
+    for (shift = 0;; shift += 7) {
+      if (in == payloadLength || shift > 21)
+        return HUFF_BADDATA;
+      run |= (size_t)(payload[in] & 0x7F) << shift;
+      if (!(payload[in++] & 0x80))
+        break;
+    }
+
+    if (run >= rawLength - pos)
+      return HUFF_BADDATA;
+    memset(dst + pos, c, run + 1);
+    pos += run + 1;
+  }
+
+  return (pos == rawLength) ? HUFF_SUCCESS : HUFF_BADDATA;
+}
+static int HuffFrameSplit_(const uint8_t *src, size_t srcLength, int blockSize, struct HuffFrameSegment_ **segments,
+                           size_t *segmentCount, size_t *size)
+{
+  struct HuffFrameSplitter_ splitter;
+  ctr counts[256];
+  ctr merged[256];
+  uint8_t lengths[257];
+  uint8_t mergedLengths[257];
+  size_t window = (blockSize < HUFF_SPLIT_WINDOW) ? (size_t)blockSize : HUFF_SPLIT_WINDOW;
+  size_t pos = 0;
+  int i;
+  assert(srcLength == 0 || src != NULL);
+  assert(blockSize >= HUFF_MINBLOCKSIZE && blockSize <= HUFF_MAXBLOCKSIZE);
+  assert(segments != NULL);
+  assert(segmentCount != NULL);
+  assert(size != NULL);
+
+  /* A block starts with a whole window unless it's the last, so there's at most one block a window */
+  splitter.src = src;
+  splitter.segments = malloc((srcLength / window + 1)*sizeof(*splitter.segments));
+  if (splitter.segments == NULL)
+    return HUFF_NOMEM;
+  splitter.segmentCount = 0;
+  splitter.totalSize = 0;
+  splitter.length = 0;
+  splitter.haveTable = 0;
+
+  while (pos < srcLength) {
+    size_t length = window;
+    size_t windowSize;
+    int merge = 0;
+    if (length > (size_t)blockSize - splitter.length)
+      length = (size_t)blockSize - splitter.length;
+    if (length > srcLength - pos)
+      length = srcLength - pos;
+
+    memset(counts, 0, sizeof(counts));
+    HuffCounterHistogram_(src + pos, length, counts);
+    windowSize = HuffFrameBlockSize_(counts, lengths);
+    if (windowSize == 0)
+      goto out;
+
+    if (splitter.length > 0) {
+      size_t mergedSize;
+
+      for (i = 0; i < 256; i++)
+        merged[i] = splitter.counts[i] + counts[i];
+      mergedSize = HuffFrameBlockSize_(merged, mergedLengths);
+      if (mergedSize == 0)
+        goto out;
+
+      /* Cut here if the window does better with a table of its own, header and all */
+      merge = (HuffBlockCountsSize_(merged, splitter.length + length, mergedSize)
+               <= HuffBlockCountsSize_(splitter.counts, splitter.length, splitter.size)
+                  + HuffBlockCountsSize_(counts, length, windowSize));
+      if (merge) {
+        memcpy(splitter.counts, merged, sizeof(merged));
+        memcpy(splitter.lengths, mergedLengths, sizeof(mergedLengths));
+        splitter.length += length;
+        splitter.size = mergedSize;
+      } else {
+        HuffFrameSplitEnd_(&splitter);
+      }
+    }
+
+    if (!merge) {
+      memcpy(splitter.counts, counts, sizeof(counts));
+      memcpy(splitter.lengths, lengths, sizeof(lengths));
+      splitter.length = length;
+      splitter.size = windowSize;
+      splitter.start = pos;
+    }
+
+    pos += length;
+    if (splitter.length == (size_t)blockSize)
+      HuffFrameSplitEnd_(&splitter);
+  }
+  if (splitter.length > 0)
+    HuffFrameSplitEnd_(&splitter);
+
+  *segments = splitter.segments;
+  *segmentCount = splitter.segmentCount;
+  *size = splitter.totalSize;
+  return HUFF_SUCCESS;
+out:
+  free(splitter.segments);
+  return HUFF_NOMEM;
+}
+static void HuffFrameSplitEnd_(struct HuffFrameSplitter_ *splitter)
+{
+  struct HuffFrameSegment_ *segment;
+  uint64_t repeatBits = UINT64_MAX;
+  size_t size;
+  int type;
+  assert(splitter != NULL);
+  assert(splitter->length > 0);
+
+  segment = &splitter->segments[splitter->segmentCount++];
+  segment->length = splitter->length;
+
+  /* The same choice HuffBlockCompress_ will make */
+  type = HuffBlockChooseType_(splitter->src + splitter->start, splitter->length, splitter->counts, splitter->size,
+                              &size);
+
+  if (splitter->haveTable && splitter->start - splitter->tableStart <= HUFF_REPEAT_MAX_DISTANCE)
+    repeatBits = HuffCodeBits_(splitter->counts, splitter->tableLengths);
+
+  if (repeatBits != UINT64_MAX && HUFF_BLOCK_HEADER_SIZE + 4 + (repeatBits + 7) / 8 <= size) {
+    segment->repeat = 1;
+    segment->size = HUFF_BLOCK_HEADER_SIZE + 4 + (size_t)((repeatBits + 7) / 8);
+    memcpy(segment->lengths, splitter->tableLengths, sizeof(segment->lengths));
+  } else {
+    segment->repeat = 0;
+    segment->size = size;
+    /* Only Huffman blocks have a table to repeat */
+    if (type == HUFF_BLOCK_HUFFMAN) {
+      memcpy(splitter->tableLengths, splitter->lengths, sizeof(splitter->tableLengths));
+      splitter->tableStart = splitter->start;
+      splitter->haveTable = 1;
+    }
+  }
+
+  splitter->totalSize += segment->size;
+  splitter->length = 0;
+}
+static size_t HuffFrameBlockSize_(const ctr *counts, uint8_t *lengths)
+{
+  struct HuffCounter_ counter;
+  size_t size;
+  int i;
+  assert(counts != NULL);
+  assert(lengths != NULL);
+
+  /* The same counter HuffCompress would have, so the same code */
+  HuffCounterInitState_(&counter);
+  for (i = 0; i < 256; i++) {
+    counter.counts[i] = counts[i];
+    counter.totalCount += counts[i];
+  }
+
+  size = HuffCanonicalStreamSize_(&counter, 0, lengths);
+  return (size == 0) ? 0 : HUFF_BLOCK_HEADER_SIZE + size;
+}
+static void HuffFrameRunJob_(void *job)
+{
+  struct HuffFrameJob_ *frameJob = job;
+
+  frameJob->res = HuffBlockCompress_(frameJob->src, frameJob->srcLength, frameJob->dst, &frameJob->dstLength,
+                                     frameJob->flags, frameJob->lengths);
+}
+static void HuffFrameRunDecodeJob_(void *job)
+{
+  struct HuffFrameDecodeJob_ *decodeJob = job;
+  size_t i;
+
+  decodeJob->res = HUFF_SUCCESS;
+  for (i = 0; i < decodeJob->blockCount && decodeJob->res == HUFF_SUCCESS; i++) {
+    const struct HuffBlockRef_ *block = &decodeJob->blocks[i];
+    decodeJob->res = HuffBlockDecompress_(decodeJob->src, block, decodeJob->dst + (size_t)block->rawPos);
+  }
+}
+static void HuffFrameCursorInit_(struct HuffFrameCursor_ *cursor, const uint8_t *src, size_t srcLength)
+{
+  assert(cursor != NULL);
+  assert(srcLength == 0 || src != NULL);
+
+  cursor->src = src;
+  cursor->srcLength = srcLength;
+  cursor->pos = 0;
+  cursor->rawPos = 0;
+  cursor->blockSize = 0;
+  cursor->frameStart = 0;
+  cursor->inFrame = 0;
+}
+static int HuffFrameCursorNext_(struct HuffFrameCursor_ *cursor, struct HuffBlockRef_ *block)
+{
+  assert(cursor != NULL);
+  assert(block != NULL);
+
+  for (;;) {
+    const uint8_t *p = cursor->src + cursor->pos;
+    size_t left = cursor->srcLength - cursor->pos;
+    int type;
+    uint32_t rawLength;
+    uint32_t payloadLength;
+
+    if (!cursor->inFrame) {
+      /* Whatever follows the last frame is left alone, as it is after any other stream */
+      if (!HuffFrameIsFramed_(p, left))
+        return (cursor->pos == 0) ? -1 : 0;
+      if (left < HUFF_FRAME_HEADER_SIZE)
+        return -1;
+
+      cursor->blockSize = HuffLoadLE32_(p + HUFF_MAGIC_SIZE);
+      if (cursor->blockSize < HUFF_MINBLOCKSIZE || cursor->blockSize > HUFF_MAXBLOCKSIZE)
+        return -1;
+
+      cursor->frameStart = cursor->pos;
+      cursor->pos += HUFF_FRAME_HEADER_SIZE;
+      cursor->inFrame = 1;
+      continue;
+    }
+
+    if (left == 0)
+      return -1;
+    if (p[0] == HUFF_BLOCK_END) {
+      cursor->pos++;
+      cursor->inFrame = 0;
+      continue;
+    }
+
+    if (left < HUFF_BLOCK_HEADER_SIZE)
+      return -1;
+    type = p[0];
+    rawLength = HuffLoadLE32_(p + 1);
+    payloadLength = HuffLoadLE32_(p + 5);
+    if (payloadLength > left - HUFF_BLOCK_HEADER_SIZE)
+      return -1;
+
+    if (type == HUFF_BLOCK_INDEX) {
+      if (rawLength != 0)
+        return -1;
+      cursor->pos += HUFF_BLOCK_HEADER_SIZE + payloadLength;
+      continue;
+    }
+
+    if (type < HUFF_BLOCK_HUFFMAN || type > HUFF_BLOCK_RUNS || type == HUFF_BLOCK_INDEX
+        || rawLength > cursor->blockSize)
+      return -1;
+    if ((type == HUFF_BLOCK_STORED && payloadLength != rawLength) || (type == HUFF_BLOCK_SINGLE && payloadLength != 1))
+      return -1;
+
+    block->type = type;
+    block->srcPos = cursor->pos + HUFF_BLOCK_HEADER_SIZE;
+    block->payloadLength = payloadLength;
+    block->rawLength = rawLength;
+    block->rawPos = cursor->rawPos;
+    block->tablePos = block->srcPos;
+    block->tableLength = payloadLength;
+
+    if (type == HUFF_BLOCK_REPEAT) {
+      uint32_t distance;
+      const uint8_t *tableBlock;
+
+      /* The block with the table has to be a whole Huffman block, earlier in the same frame */
+      if (payloadLength < 4)
+        return -1;
+      distance = HuffLoadLE32_(p + HUFF_BLOCK_HEADER_SIZE);
+      if (distance < HUFF_BLOCK_HEADER_SIZE || distance > cursor->pos - cursor->frameStart - HUFF_FRAME_HEADER_SIZE)
+        return -1;
+      tableBlock = p - distance;
+      if (tableBlock[0] != HUFF_BLOCK_HUFFMAN || HuffLoadLE32_(tableBlock + 5) > distance - HUFF_BLOCK_HEADER_SIZE)
+        return -1;
+
+      block->tablePos = (size_t)(tableBlock - cursor->src) + HUFF_BLOCK_HEADER_SIZE;
+      block->tableLength = HuffLoadLE32_(tableBlock + 5);
+    }
+
+    cursor->pos += HUFF_BLOCK_HEADER_SIZE + payloadLength;
+    cursor->rawPos += rawLength;
+    return 1;
+  }
+}
+static int64_t HuffFrameFindIndex_(const uint8_t *src, size_t srcLength, const uint8_t **entries)
+{
+  const uint8_t *footer;
+  const uint8_t *indexBlock;
+  uint32_t entryCount;
+  size_t indexLength;
+  assert(srcLength == 0 || src != NULL);
+  assert(entries != NULL);
+
+  if (srcLength < HUFF_FRAME_HEADER_SIZE + HUFF_BLOCK_HEADER_SIZE + HUFF_INDEX_FOOTER_SIZE + 1)
+    return -1;
+  if (!HuffFrameIsFramed_(src, srcLength) || src[srcLength - 1] != HUFF_BLOCK_END)
+    return -1;
+
+  footer = src + srcLength - 1 - HUFF_INDEX_FOOTER_SIZE;
+  if (memcmp(footer + 20, "HIDX", 4) != 0)
+    return -1;
+
+  entryCount = HuffLoadLE32_(footer + 16);
+  if (entryCount > srcLength / HUFF_INDEX_ENTRY_SIZE)
+    return -1;
+  indexLength = (size_t)entryCount*HUFF_INDEX_ENTRY_SIZE + HUFF_INDEX_FOOTER_SIZE;
+  if (indexLength + HUFF_BLOCK_HEADER_SIZE + 1 + HUFF_FRAME_HEADER_SIZE > srcLength)
+    return -1;
+
+  /* The index has to be where it says it is, which also means the frame it belongs to starts at |src| */
+  indexBlock = src + srcLength - 1 - indexLength - HUFF_BLOCK_HEADER_SIZE;
+  if (HuffLoadLE64_(footer + 8) != (uint64_t)(indexBlock - src))
+    return -1;
+  if (indexBlock[0] != HUFF_BLOCK_INDEX || HuffLoadLE32_(indexBlock + 1) != 0
+      || HuffLoadLE32_(indexBlock + 5) != indexLength)
+    return -1;
+
+  *entries = indexBlock + HUFF_BLOCK_HEADER_SIZE;
+  return entryCount;
+}
+
+/* symbol streams
+   Canonical streams for alphabets of up to HUFF_MAXALPHABET symbols rather than bytes, with the EOF after the last one
+   The header is the magic, the alphabet size less one (2 bytes), the size of the rest of the header (4 bytes), then
+   the length limit and the code length of every symbol as tokens, as in a canonical header
+   Code lengths come from sorting the symbols once and pairing them off in two queues, which takes no longer for 65536
+   symbols than sorting them does, and no code is longer than HUFF_SYMBOL_MAX_LENGTH - so the decode table is a first
+   level of HUFF_SYMBOL_ROOT_BITS and subtables of at most 8 bits, however big the alphabet */
+struct HuffSymbolCounter_
+{
+  int alphabetSize;
+  ctr totalCount;
+  /* |alphabetSize| of them, allocated along with the counter */
+  ctr *counts;
+};
+struct HuffSymbolEncoder_
+{
+  int alphabetSize;
+  /* Of every symbol and the EOF - codes first bit in the lowest position, and a length of 0 for no code */
+  uint32_t *codes;
+  uint8_t *lengths;
+
+  /* Bytes that are ready to be written are the ones from readIdx up to byteIdx, starting with the header */
+  uint8_t *buffer;
+  size_t bufferSize;
+  size_t readIdx;
+  size_t byteIdx;
+
+  /* Always fewer than 8 bits between symbols */
+  uint64_t bitBuf;
+  int bitCount;
+  int ended;
+};
+/* Decode tables for symbol streams are flat arrays of 32 bit entries, the low 6 bits of which are the code length
+   and the rest from bit 8 up the symbol - or for link entries, which have HUFF_SYMBOL_LINK set, the index width of
+   the subtable and where it starts, and the code lengths in subtables don't count the first level's bits
+   Entries that no code starts with are 0 */
+#define HUFF_SYMBOL_LINK 0x80
+struct HuffSymbolDecoder_
+{
+  /* The fixed part of the header comes first, and the rest is added once its size is known */
+  uint8_t *header;
+  size_t headerSize;
+  size_t headerBytesRead;
+
+  int alphabetSize;
+  /* NULL until the header has been read */
+  uint32_t *entries;
+  int rootBits;
+
+  /* Bits above bitCount are either clear or the same as the bits of the bytes still to come */
+  uint64_t bitBuf;
+  int bitCount;
+
+  /* Symbols that are ready to be written are the ones from readIdx up to symbolIdx */
+  uint16_t *symbols;
+  size_t symbolsSize;
+  size_t readIdx;
+  size_t symbolIdx;
+  int finished;
+};
+
+/* Works out code lengths no longer than HUFF_SYMBOL_MAX_LENGTH for the symbols |counts| has and an EOF after them,
+   leaving the rest at 0
+   Returns -1 if there isn't enough memory
+   0 otherwise */
+static int HuffSymbolLengths_(const ctr *counts, int alphabetSize, uint8_t *lengths);
+/* Sets |depths| to the depth of each leaf of a Huffman tree for |weights|, lightest first, of which there are at
+   least 2 - joining nodes are made in order of weight, so a second queue keeps them sorted without a heap
+   Returns -1 if there isn't enough memory
+   0 otherwise */
+static int HuffSortedDepths_(const ctr *weights, int count, int *depths);
+/* qsort comparison for symbols with their weights, lightest first, and higher symbols first within a weight */
+static int HuffSymbolWeightCompare_(const void *a, const void *b);
+/* Assigns canonical codes from code lengths, as HuffCodeTableInitCanonical does */
+static void HuffSymbolCodes_(const uint8_t *lengths, int count, uint32_t *codes);
+/* Makes sure there are at least |byteCount| bytes free past byteIdx
+   Returns -1 if the buffer couldn't be made big enough
+   0 otherwise */
+static int HuffSymbolEncoderExpand_(HuffSymbolEncoder encoder, size_t byteCount);
+/* Reads the code lengths from the header and builds the decode table
+   Returns HUFF_SUCCESS, or an error code */
+static int HuffSymbolDecoderReadHeader_(HuffSymbolDecoder decoder);
+/* Returns the decode table for the |count| code lengths, none longer than |maxLength|, or NULL if there isn't enough
+   memory */
+static uint32_t *HuffSymbolDecodeTableInit_(const uint8_t *lengths, int count, int maxLength, int *rootBits);
+/* Makes room for at least one more symbol past symbolIdx
+   Returns -1 if there isn't enough memory
+   0 otherwise */
+static int HuffSymbolDecoderExpand_(HuffSymbolDecoder decoder);
+
+struct HuffSymbolWeight_
+{
+  ctr weight;
+  int symbol;
+};
+
+HuffSymbolCounter HuffSymbolCounterInit(int alphabetSize)
+{
+  HuffSymbolCounter counter;
+  assert(alphabetSize > 0 && alphabetSize <= HUFF_MAXALPHABET);
+
+  counter = calloc(1, sizeof(*counter) + alphabetSize*sizeof(*counter->counts));
+  if (counter == NULL)
+    return NULL;
+
+  counter->alphabetSize = alphabetSize;
+  /* One EOF, as in HuffCounterInitState_ */
+  counter->totalCount = 1;
+  counter->counts = (ctr *)(counter + 1);
+  return counter;
+}
+void HuffSymbolCounterDestroy(HuffSymbolCounter counter)
+{
+  assert(counter != NULL);
+
+  free(counter);
+}
+int HuffSymbolCounterFeedData(HuffSymbolCounter counter, const uint16_t *symbols, size_t count)
+{
+  size_t i;
+  assert(counter != NULL);
+  assert(count == 0 || symbols != NULL);
+
+  if (count > (size_t)(CTR_MAX - counter->totalCount))
+    return HUFF_TOOMUCHDATA;
+
+  /* Checked first, so that nothing is counted if any of them is out of range */
+  if (counter->alphabetSize < HUFF_MAXALPHABET) {
+    for (i = 0; i < count; i++) {
+      if (symbols[i] >= counter->alphabetSize)
+        return HUFF_BADDATA;
+    }
+  }
+
+  for (i = 0; i < count; i++)
+    counter->counts[symbols[i]]++;
+  counter->totalCount += count;
+
+  return HUFF_SUCCESS;
+}
+
+HuffSymbolEncoder HuffSymbolEncoderInit(HuffSymbolCounter counter)
+{
+  HuffSymbolEncoder enc;
+  int symbolCount;
+  int maxLength = 0;
+  int bitPos;
+  int i;
+  assert(counter != NULL);
+
+  symbolCount = counter->alphabetSize + 1;
+
+  enc = calloc(1, sizeof(*enc));
+  if (enc == NULL)
+    goto out;
+
+  enc->alphabetSize = counter->alphabetSize;
+  enc->lengths = malloc(symbolCount);
+  enc->codes = malloc(symbolCount*sizeof(*enc->codes));
+  enc->bufferSize = HUFF_SYMBOL_HEADER_MAX(symbolCount) + HUFF_BUFFER_START;
+  enc->buffer = calloc(1, enc->bufferSize);
+  if (enc->lengths == NULL || enc->codes == NULL || enc->buffer == NULL)
+    goto out1;
 
-  enc->buffer = calloc(1, initialBufferSize);
-  if (enc->buffer == NULL)
-    goto out3;
+  if (HuffSymbolLengths_(counter->counts, counter->alphabetSize, enc->lengths))
+    goto out1;
+  HuffSymbolCodes_(enc->lengths, symbolCount, enc->codes);
+  for (i = 0; i < symbolCount; i++) {
+    if (enc->lengths[i] > maxLength)
+      maxLength = enc->lengths[i];
+  }
 
-  enc->bufferSize = initialBufferSize;
-  enc->byteIdx = 0;
-  enc->bitIdx = 0;
+  enc->buffer[0] = 'H';
+  enc->buffer[1] = 'U';
+  enc->buffer[2] = 'F';
+  enc->buffer[3] = HUFF_FORMAT_FLAG | HUFF_FORMAT_SYMBOLS;
+  enc->buffer[4] = (uint8_t)(counter->alphabetSize - 1);
+  enc->buffer[5] = (uint8_t)((counter->alphabetSize - 1) >> 8);
+  enc->buffer[HUFF_SYMBOL_HEADER_SIZE] = (uint8_t)maxLength;
+  bitPos = (HUFF_SYMBOL_HEADER_SIZE + 1)*8;
+  HuffHeaderPutLengths_(enc->buffer, &bitPos, enc->lengths, symbolCount, maxLength);
+  enc->byteIdx = (bitPos + 7)/8;
+  assert(enc->byteIdx <= HUFF_SYMBOL_HEADER_MAX(symbolCount));
+  HuffStoreLE32_(enc->buffer + HUFF_MAGIC_SIZE + 2, (uint32_t)(enc->byteIdx - HUFF_SYMBOL_HEADER_SIZE));
 
   return enc;
-out3:
-  HuffTreeDestroy(enc->tree);
-out2:
-  HuffCounterDestroy(enc->counter);
+
 out1:
-  free(enc);
-  enc = NULL;
+  HuffSymbolEncoderDestroy(enc);
 out:
   return NULL;
 }
-void HuffEncoderDestroy(HuffEncoder encoder)
+void HuffSymbolEncoderDestroy(HuffSymbolEncoder encoder)
 {
   assert(encoder != NULL);
 
-  HuffCounterDestroy(encoder->counter);
-  HuffTreeDestroy(encoder->tree);
+  free(encoder->codes);
+  free(encoder->lengths);
   free(encoder->buffer);
   free(encoder);
 }
-int HuffEncoderFeedData(HuffEncoder encoder, const uint8_t *data, int length, int *processed)
+int HuffSymbolEncoderFeedData(HuffSymbolEncoder encoder, const uint16_t *symbols, size_t count, size_t *processed)
 {
-  int i;
-  int ret = HUFF_NOMEM;
+  const uint32_t *codes;
+  const uint8_t *lengths;
+  uint8_t *buffer;
+  size_t byteIdx;
+  uint64_t bitBuf;
+  int bitCount;
+  size_t i = 0;
+  int ret = HUFF_SUCCESS;
   assert(encoder != NULL);
-  assert(length >= 0);
-  assert(length == 0 || data != NULL);
-  assert(length == 0 || processed != NULL);
+  assert(!encoder->ended);
+  assert(count == 0 || symbols != NULL);
+  assert(count == 0 || processed != NULL);
 
-  for (i = 0; i < length; i++) {
-    ret = HuffEncoderFeedSingle_(encoder, data[i]);
+  codes = encoder->codes;
+  lengths = encoder->lengths;
+  bitBuf = encoder->bitBuf;
+  bitCount = encoder->bitCount;
+
+  while (i < count) {
+    size_t chunkEnd = (count - i < HUFF_SYMBOL_CHUNK) ? count : i + HUFF_SYMBOL_CHUNK;
+
+    /* Room for the longest code of every symbol in the chunk, and the 8 bytes the last store writes */
+    if (HuffSymbolEncoderExpand_(encoder, (chunkEnd - i)*HUFF_SYMBOL_MAX_LENGTH/8 + 8)) {
+      ret = HUFF_NOMEM;
+      break;
+    }
+    buffer = encoder->buffer;
+    byteIdx = encoder->byteIdx;
+
+    for (; i < chunkEnd; i++) {
+      int c = symbols[i];
+      if (c >= encoder->alphabetSize || lengths[c] == 0) {
+        ret = HUFF_BADDATA;
+        break;
+      }
+
+      bitBuf |= (uint64_t)codes[c] << bitCount;
+      bitCount += lengths[c];
+      HuffStoreLE64_(buffer + byteIdx, bitBuf);
+      byteIdx += bitCount >> 3;
+      bitBuf >>= bitCount & ~7;
+      bitCount &= 7;
+    }
+
+    encoder->byteIdx = byteIdx;
     if (ret != HUFF_SUCCESS)
       break;
   }
 
-  *processed = i;
+  encoder->bitBuf = bitBuf;
+  encoder->bitCount = bitCount;
+
+  if (count > 0)
+    *processed = i;
   return ret;
 }
-int HuffEncoderEndData(HuffEncoder encoder)
-{
-  assert(encoder != NULL);
-  return HuffEncoderFeedSingle_(encoder, HUFF_EOF_CHAR);
-}
-int HuffEncoderByteCount(HuffEncoder encoder)
-{
-  assert(encoder != NULL);
-  return encoder->byteIdx + encoder->counterBytesToWrite;
-}
-int HuffEncoderWriteBytes(HuffEncoder encoder, uint8_t *buf, int length)
+int HuffSymbolEncoderEndData(HuffSymbolEncoder encoder)
 {
-  int headerWriteCount;
-  int toWrite;
-  int byteCount;
-  int toShift;
-  int i;
+  int eof;
   assert(encoder != NULL);
-  assert(length >= 0);
-  assert(length == 0 || buf != NULL);
-
-  headerWriteCount = HuffEncoderWriteHeaderBytes_(encoder, buf, length);
-
-  length -= headerWriteCount;
-
-  byteCount = encoder->byteIdx;
-  toWrite = (length < byteCount) ? length : byteCount;
-
-  if (toWrite > 0) {
-    memcpy(buf+headerWriteCount, encoder->buffer, toWrite);
-    
-    /* Shift data down in the internal buffer */
-    toShift = encoder->bufferSize - toWrite;
-    for (i = 0; i < toShift; i++)
-      encoder->buffer[i] = encoder->buffer[i+toWrite];
-
-    encoder->byteIdx -= toWrite;
-  }
+  assert(!encoder->ended);
 
-  return headerWriteCount + toWrite;
-}
-static int HuffEncoderFeedSingle_(HuffEncoder encoder, int data)
-{
-  const uint8_t *bits;
-  int totalBitCount;
-  int bitCount;
-  int byteCount;
-  int byteLookup;
-  int bitLookup;
-  int j;
-  int res;
- 
-  assert(data >= 0);
-  assert(data <= 256);
-  res = HuffTreeEncode(encoder->tree, data, &bits, &totalBitCount);
-  if (res)
+  if (HuffSymbolEncoderExpand_(encoder, 8 + 1))
     return HUFF_NOMEM;
-  
-  byteCount = totalBitCount / 8;
-  bitCount = totalBitCount %  8;
-  res = HuffEncoderExpandBufferToFit_(encoder, byteCount, bitCount);
-  if (res)
-    return HUFF_TOOMUCHDATA;
-
-  /* Actually add the encoded bits to the buffer */
-  byteLookup = 0;
-  bitLookup = 0;
-  for (j = 0; j < totalBitCount; j++) {
-    int bit;
-    assert(bitLookup >= 0);
-    assert(bitLookup < 8);
-    assert(byteLookup >= 0);
-    bit = (bits[byteLookup] & (1<<bitLookup)) >> bitLookup;
-    
-    assert(encoder->bitIdx >= 0);
-    assert(encoder->bitIdx < 8);
-    assert(encoder->byteIdx >= 0);
-    assert(encoder->byteIdx < encoder->bufferSize);
-    /* If you can't tell what this does at a glance, you're not a real a C programmer */
-    *(encoder->buffer+encoder->byteIdx) = (uint8_t)(((*(encoder->buffer+encoder->byteIdx)) & (~(1<<encoder->bitIdx))) | (bit<<encoder->bitIdx));
 
-    bitLookup++;
-    if (bitLookup == 8) {
-      bitLookup = 0;
-      byteLookup++;
-    }
+  eof = encoder->alphabetSize;
+  encoder->bitBuf |= (uint64_t)encoder->codes[eof] << encoder->bitCount;
+  encoder->bitCount += encoder->lengths[eof];
 
-    encoder->bitIdx++;
-    if (encoder->bitIdx == 8) {
-      encoder->bitIdx = 0;
-      encoder->byteIdx++;
-    }
+  /* Every bit goes out, the last partial byte padded with zeros */
+  while (encoder->bitCount > 0) {
+    encoder->buffer[encoder->byteIdx++] = (uint8_t)encoder->bitBuf;
+    encoder->bitBuf >>= 8;
+    encoder->bitCount -= 8;
   }
+  encoder->bitBuf = 0;
+  encoder->bitCount = 0;
+  encoder->ended = 1;
 
   return HUFF_SUCCESS;
 }
-static int HuffEncoderExpandBufferToFit_(HuffEncoder encoder, int byteCount, int bitCount)
+size_t HuffSymbolEncoderByteCount(HuffSymbolEncoder encoder)
 {
-  int freeBytes;
-  int freeBits;
-  int notEnoughSpace;
   assert(encoder != NULL);
-  assert(encoder->byteIdx >= 0);
-  assert(encoder->bitIdx >= 0);
-  /* Check if we already have enough space in the buffer */
-  freeBytes = encoder->bufferSize - encoder->byteIdx - (encoder->bitIdx + 7)/8;
-  freeBits = (8 - encoder->bitIdx) % 8;
-  notEnoughSpace = freeBytes < byteCount || (freeBytes == byteCount && freeBits < bitCount);
-  while (notEnoughSpace) {
-    uint8_t *newBuffer;
-    /* There isn't enough space - attempt to get bigger */
-    if (encoder->bufferSize > INT_MAX / 2)
-      /* Can't get bigger due to overflow */
-      break;
-
-    newBuffer = realloc(encoder->buffer, encoder->bufferSize*2);
-    if (newBuffer == NULL)
-      /* Couldn't get bigger due to lack of memory */
-      break;
-    
-    memset(newBuffer+encoder->bufferSize, 0, encoder->bufferSize);
-
-    freeBytes += encoder->bufferSize;
-    encoder->buffer = newBuffer;
-    encoder->bufferSize *= 2;
-  }
 
-  notEnoughSpace = freeBytes < byteCount || (freeBytes == byteCount && freeBits < bitCount);
-  if (notEnoughSpace)
-    return -1;
-  else
-    return 0;
+  return encoder->byteIdx - encoder->readIdx;
 }
-static int HuffEncoderWriteHeaderBytes_(HuffEncoder encoder, uint8_t *buf, int length)
+size_t HuffSymbolEncoderWriteBytes(HuffSymbolEncoder encoder, uint8_t *buf, size_t length)
 {
-  int toWrite;
-  int byteIdx;
-  int countLookup;
-  int byteLookup;
-  int i;
+  size_t toWrite;
   assert(encoder != NULL);
   assert(length == 0 || buf != NULL);
 
-  toWrite = (length < encoder->counterBytesToWrite) ? length : encoder->counterBytesToWrite;
-
-  byteIdx = (256*sizeof(ctr) - encoder->counterBytesToWrite);
-  countLookup = byteIdx / sizeof(ctr);
-  byteLookup = byteIdx % sizeof(ctr);
+  toWrite = encoder->byteIdx - encoder->readIdx;
+  if (length < toWrite)
+    toWrite = length;
 
-  for (i = 0; i < toWrite; i++) {
-    /* This expression is simpler than the other ones, at least
-       It's a little-endian serializationm by the way */
-    uint8_t byte = (uint8_t)((HuffCounterCount(encoder->counter, countLookup) & ((ctr)0xFF) << ((ctr)(byteLookup*8))) >> ((ctr)(byteLookup*8)));
-    buf[i] = byte;
+  if (toWrite > 0) {
+    memcpy(buf, encoder->buffer + encoder->readIdx, toWrite);
+    encoder->readIdx += toWrite;
 
-    byteLookup++;
-    if (byteLookup == sizeof(ctr)) {
-      byteLookup = 0;
-      countLookup++;
+    /* Once everything has been written, start over at the front for free - the pending bits are still in bitBuf */
+    if (encoder->readIdx == encoder->byteIdx) {
+      encoder->readIdx = 0;
+      encoder->byteIdx = 0;
     }
   }
 
-  encoder->counterBytesToWrite -= toWrite;
   return toWrite;
 }
 
-/* decoder */
-struct HuffDecoder_
+HuffSymbolDecoder HuffSymbolDecoderInit(void)
 {
-  HuffCounter counter;
-  int counterBytesRead;
-  ctr countHolder;
-
-  HuffTree tree;
-
-  uint8_t* buffer;
-  int bufferSize;
-  int byteIdx;
-
-  int dataHolderInUse;
-  uint8_t dataHolder;
-
-  int bitIdx;
-};
-
-static int HuffDecoderFeedHeaderData_(HuffDecoder decoder, const uint8_t *data, int length);
-static int HuffDecoderExpandToFitByte_(HuffDecoder decoder);
-static void HuffDecoderProcessHolder_(HuffDecoder decoder);
+  HuffSymbolDecoder dec;
 
-HuffDecoder HuffDecoderInit(int initialBufferSize)
-{
-  HuffDecoder dec = malloc(sizeof(*dec));
+  dec = calloc(1, sizeof(*dec));
   if (dec == NULL)
     goto out;
 
-  dec->counter = HuffCounterInit();
-  if (dec->counter == NULL)
+  dec->headerSize = HUFF_SYMBOL_HEADER_SIZE;
+  dec->header = malloc(dec->headerSize);
+  dec->symbolsSize = HUFF_BUFFER_START;
+  dec->symbols = malloc(dec->symbolsSize*sizeof(*dec->symbols));
+  if (dec->header == NULL || dec->symbols == NULL)
     goto out1;
 
-  dec->counterBytesRead = 0;
-  dec->countHolder = 0;
-
-  dec->tree = NULL;
-
-  if (initialBufferSize == 0)
-    initialBufferSize = HUFF_BUFFER_START;
-
-  dec->buffer = malloc(initialBufferSize);
-  if (dec->buffer == NULL)
-    goto out2;
-
-  dec->bufferSize = initialBufferSize;
-  dec->byteIdx = 0;
-
-  dec->dataHolder = 0;
-  dec->dataHolderInUse = 0;
-
-  dec->bitIdx = 0;
-
   return dec;
 
-out2:
-  HuffCounterDestroy(dec->counter);
 out1:
-  free(dec);
-  dec = NULL;
+  HuffSymbolDecoderDestroy(dec);
 out:
   return NULL;
 }
-
-void HuffDecoderDestroy(HuffDecoder decoder)
+void HuffSymbolDecoderDestroy(HuffSymbolDecoder decoder)
 {
   assert(decoder != NULL);
 
-  HuffCounterDestroy(decoder->counter);
-  if (decoder->tree != NULL)
-    HuffTreeDestroy(decoder->tree);
-  free(decoder->buffer);
+  free(decoder->header);
+  free(decoder->entries);
+  free(decoder->symbols);
   free(decoder);
 }
-
-int HuffDecoderFeedData(HuffDecoder decoder, const uint8_t *data, int length, int *processed)
+int HuffSymbolDecoderFeedData(HuffSymbolDecoder decoder, const uint8_t *data, size_t length, size_t *processed)
 {
-  int ret = HUFF_NOMEM;
-  int headerBytesRead = 0;
-  int charBytesRead = 0;
+  const uint32_t *entries;
+  const uint8_t *cur = data;
+  const uint8_t *end = data + length;
+  uint64_t bitBuf;
+  uint32_t rootMask;
+  int rootBits;
+  int bitCount;
+  int ret = HUFF_SUCCESS;
   assert(decoder != NULL);
   assert(length == 0 || data != NULL);
   assert(length == 0 || processed != NULL);
 
-  headerBytesRead = HuffDecoderFeedHeaderData_(decoder, data, length);
+  /* The header is gathered up until all of it is here, its size being in the fixed part */
+  while (decoder->entries == NULL && cur < end) {
+    size_t toRead = decoder->headerSize - decoder->headerBytesRead;
+    if (toRead > (size_t)(end - cur))
+      toRead = (size_t)(end - cur);
+    memcpy(decoder->header + decoder->headerBytesRead, cur, toRead);
+    decoder->headerBytesRead += toRead;
+    cur += toRead;
+    if (decoder->headerBytesRead < decoder->headerSize)
+      break;
 
-  length -= headerBytesRead;
-  data += headerBytesRead;
+    if (decoder->headerSize == HUFF_SYMBOL_HEADER_SIZE) {
+      const uint8_t *header = decoder->header;
+      uint8_t *newHeader;
+      size_t rest;
+
+      if (header[0] != 'H' || header[1] != 'U' || header[2] != 'F'
+          || header[3] != (HUFF_FORMAT_FLAG | HUFF_FORMAT_SYMBOLS)) {
+        ret = HUFF_BADDATA;
+        goto out;
+      }
+      decoder->alphabetSize = (header[4] | header[5] << 8) + 1;
+      rest = HuffLoadLE32_(header + HUFF_MAGIC_SIZE + 2);
+      if (rest == 0 || rest > HUFF_SYMBOL_HEADER_MAX(decoder->alphabetSize + 1) - HUFF_SYMBOL_HEADER_SIZE) {
+        ret = HUFF_BADDATA;
+        goto out;
+      }
+
+      newHeader = realloc(decoder->header, HUFF_SYMBOL_HEADER_SIZE + rest);
+      if (newHeader == NULL) {
+        ret = HUFF_NOMEM;
+        goto out;
+      }
+      decoder->header = newHeader;
+      decoder->headerSize += rest;
+      continue;
+    }
 
-  if (decoder->counterBytesRead == 256*sizeof(ctr) && decoder->tree == NULL) {
-    /* We just finished reading the header */
-    decoder->tree = HuffTreeInit(decoder->counter);
-    if (decoder->tree == NULL)
+    ret = HuffSymbolDecoderReadHeader_(decoder);
+    if (ret != HUFF_SUCCESS)
       goto out;
   }
 
-  if (decoder->tree != NULL) {
-    /* TODO - fix holder logic here (it's seriously broken) */
-    /*HuffDecoderProcessHolder_(decoder);*/
-    int bufferSpace = (decoder->bufferSize - decoder->byteIdx);
-    int toRead = (bufferSpace < length) ? bufferSpace : length;
-
-    while (length > 0) {
-      int out;
-      int bit = (data[0] & (1<<decoder->bitIdx)) >> decoder->bitIdx;
-      int res = HuffTreeDecode(decoder->tree, bit, &out);
-
-      decoder->bitIdx++;
-      if (decoder->bitIdx == 8) {
-        decoder->bitIdx = 0;
-        length--;
-        if (length != 0)
-          data++;
-        charBytesRead++;
+  if (decoder->entries == NULL || decoder->finished)
+    goto out;
+
+  /* Work on locals so the compiler can keep them in registers */
+  entries = decoder->entries;
+  rootBits = decoder->rootBits;
+  rootMask = ((uint32_t)1 << rootBits) - 1;
+  bitBuf = decoder->bitBuf;
+  bitCount = decoder->bitCount;
+
+  for (;;) {
+    uint32_t entry;
+    int lookupBits = rootBits;
+    int codeLength;
+    int c;
+
+    if (end - cur >= 8) {
+      bitBuf |= HuffLoadLE64_(cur) << bitCount;
+      cur += (63 - bitCount) >> 3;
+      bitCount |= 56;
+    } else {
+      while (bitCount <= 56 && cur < end) {
+        bitBuf |= (uint64_t)*cur++ << bitCount;
+        bitCount += 8;
       }
+    }
 
-      if (res) {
-        if (out == HUFF_EOF_CHAR) {
-          /* If it didn't end on a byte boundary, ignore the rest and mark as processing the rest of the byte */
-          if (decoder->bitIdx != 0) {
-            charBytesRead++;
-            length = 0;
-          }
-        } else {
-          int res = HuffDecoderExpandToFitByte_(decoder);
-          if (res) {
-            decoder->dataHolder = out;
-            decoder->dataHolderInUse = 1;
-            ret = HUFF_TOOMUCHDATA;
-            goto out;
-          }
-          else {
-            decoder->buffer[decoder->byteIdx++] = out;
-          }
-        }
+    entry = entries[bitBuf & rootMask];
+    codeLength = entry & 0x3F;
+    if (entry & HUFF_SYMBOL_LINK) {
+      lookupBits += codeLength;
+      entry = entries[(entry >> 8) + ((bitBuf >> rootBits) & (((uint32_t)1 << codeLength) - 1))];
+      codeLength = (entry & 0x3F) ? rootBits + (entry & 0x3F) : 0;
+    }
+
+    /* With fewer bits than the lookup took, the rest of them were taken as 0 - a code that fits in the bits there
+       are is still the right one, but otherwise it has to wait for more input */
+    if (codeLength == 0 || codeLength > bitCount) {
+      if (bitCount >= lookupBits) {
+        ret = HUFF_BADDATA;
+        break;
       }
+      assert(cur == end);
+      break;
     }
+
+    c = (int)(entry >> 8);
+    bitBuf >>= codeLength;
+    bitCount -= codeLength;
+
+    if (c == decoder->alphabetSize) {
+      /* The bytes after the one the EOF ends in aren't part of the stream, so they're given back */
+      cur -= bitCount / 8;
+      assert(cur >= data);
+      bitBuf = 0;
+      bitCount = 0;
+      decoder->finished = 1;
+      break;
+    }
+
+    if (decoder->symbolIdx == decoder->symbolsSize && HuffSymbolDecoderExpand_(decoder)) {
+      ret = HUFF_NOMEM;
+      break;
+    }
+    decoder->symbols[decoder->symbolIdx++] = (uint16_t)c;
   }
 
-  ret = HUFF_SUCCESS;
+  decoder->bitBuf = bitBuf;
+  decoder->bitCount = bitCount;
+
 out:
-  *processed = headerBytesRead + charBytesRead;
+  if (length > 0)
+    *processed = (size_t)(cur - data);
   return ret;
 }
-
-int HuffDecoderByteCount(HuffDecoder decoder)
+size_t HuffSymbolDecoderSymbolCount(HuffSymbolDecoder decoder)
 {
   assert(decoder != NULL);
 
-  return decoder->byteIdx;
+  return decoder->symbolIdx - decoder->readIdx;
 }
-
-int HuffDecoderWriteBytes(HuffDecoder decoder, uint8_t *buf, int length)
+size_t HuffSymbolDecoderWriteSymbols(HuffSymbolDecoder decoder, uint16_t *buf, size_t count)
 {
-  int toWrite;
+  size_t toWrite;
   assert(decoder != NULL);
-  assert(length == 0 || buf != NULL);
+  assert(count == 0 || buf != NULL);
 
-  toWrite = (length < decoder->byteIdx) ? length : decoder->byteIdx;
+  toWrite = decoder->symbolIdx - decoder->readIdx;
+  if (count < toWrite)
+    toWrite = count;
 
   if (toWrite > 0) {
-    int toShift;
-    int i;
-    memcpy(buf, decoder->buffer, toWrite);
-    
-    /* Shift data down in the internal buffer */
-    toShift = decoder->bufferSize - toWrite;
-    for (i = 0; i < toShift; i++)
-      decoder->buffer[i] = decoder->buffer[i+toWrite];
+    memcpy(buf, decoder->symbols + decoder->readIdx, toWrite*sizeof(*buf));
+    decoder->readIdx += toWrite;
 
-    decoder->byteIdx -= toWrite;
+    if (decoder->readIdx == decoder->symbolIdx) {
+      decoder->readIdx = 0;
+      decoder->symbolIdx = 0;
+    }
   }
 
-  /* There might have been space freed up */
-  HuffDecoderProcessHolder_(decoder);
-
   return toWrite;
 }
+int HuffSymbolDecoderFinished(HuffSymbolDecoder decoder)
+{
+  assert(decoder != NULL);
+
+  return decoder->finished;
+}
 
-static int HuffDecoderFeedHeaderData_(HuffDecoder decoder, const uint8_t *data, int length)
+static int HuffSymbolLengths_(const ctr *counts, int alphabetSize, uint8_t *lengths)
 {
-  int bytesLeft;
-  int toRead;
+  struct HuffSymbolWeight_ *sorted;
+  ctr *weights;
+  int *depths;
+  int maxDepth = 0;
+  int count = 0;
+  int ret = -1;
+  int i;
+  assert(counts != NULL);
+  assert(lengths != NULL);
 
-  assert(decoder != NULL);
-  assert(length == 0 || data != NULL);
+  memset(lengths, 0, alphabetSize + 1);
+
+  sorted = malloc((alphabetSize + 1)*sizeof(*sorted));
+  weights = malloc((alphabetSize + 1)*sizeof(*weights));
+  depths = malloc((alphabetSize + 1)*sizeof(*depths));
+  if (sorted == NULL || weights == NULL || depths == NULL)
+    goto out;
+
+  for (i = 0; i <= alphabetSize; i++) {
+    ctr weight = (i == alphabetSize) ? 1 : counts[i];
+    if (weight == 0)
+      continue;
+    sorted[count].weight = weight;
+    sorted[count].symbol = i;
+    count++;
+  }
+
+  /* A lone EOF still needs a code to be written with */
+  if (count == 1) {
+    lengths[alphabetSize] = 1;
+    ret = 0;
+    goto out;
+  }
+
+  qsort(sorted, count, sizeof(*sorted), HuffSymbolWeightCompare_);
+  for (i = 0; i < count; i++)
+    weights[i] = sorted[i].weight;
 
-  bytesLeft = 256*sizeof(ctr) - decoder->counterBytesRead;
+  if (HuffSortedDepths_(weights, count, depths))
+    goto out;
+  for (i = 0; i < count; i++) {
+    if (depths[i] > maxDepth)
+      maxDepth = depths[i];
+  }
+  if (maxDepth > HUFF_SYMBOL_MAX_LENGTH && HuffLimitedLengths_(weights, count, HUFF_SYMBOL_MAX_LENGTH, depths))
+    goto out;
 
-  toRead = (length < bytesLeft) ? length : bytesLeft;
+  for (i = 0; i < count; i++)
+    lengths[sorted[i].symbol] = (uint8_t)depths[i];
 
-  if (toRead > 0) {
-    int i;
-    int byteOffset = decoder->counterBytesRead % sizeof(ctr);
-    int countIdx = decoder->counterBytesRead / sizeof(ctr);
+  ret = 0;
+out:
+  free(sorted);
+  free(weights);
+  free(depths);
+  return ret;
+}
+static int HuffSortedDepths_(const ctr *weights, int count, int *depths)
+{
+  /* Node i is leaf i for i < count, and joining node i - count otherwise, so every node's parent comes after it */
+  ctr *joinWeights;
+  int *nodes;
+  int leafHead = 0;
+  int joinHead = 0;
+  int i;
+  int j;
+  assert(weights != NULL);
+  assert(depths != NULL);
+  assert(count >= 2);
+
+  joinWeights = malloc((count - 1)*sizeof(*joinWeights));
+  nodes = malloc((2*count - 1)*sizeof(*nodes));
+  if (joinWeights == NULL || nodes == NULL) {
+    free(joinWeights);
+    free(nodes);
+    return -1;
+  }
 
-    for (i = 0; i < toRead; i++) {
-      decoder->countHolder |= data[i]<<(byteOffset*8);
-      
-      byteOffset++;
-      if (byteOffset == sizeof(ctr)) {
-        HuffCounterSetCount(decoder->counter, countIdx, decoder->countHolder);
-        decoder->countHolder = 0;
-        byteOffset = 0;
-        countIdx++;
+  /* |nodes| holds each node's parent */
+  for (i = 0; i < count - 1; i++) {
+    ctr weight = 0;
+
+    for (j = 0; j < 2; j++) {
+      int node;
+      if (joinHead < i && (leafHead == count || joinWeights[joinHead] < weights[leafHead])) {
+        weight += joinWeights[joinHead];
+        node = count + joinHead++;
+      } else {
+        assert(leafHead < count);
+        weight += weights[leafHead];
+        node = leafHead++;
       }
+      nodes[node] = count + i;
     }
 
-    decoder->counterBytesRead += toRead;
+    joinWeights[i] = weight;
   }
 
-  return toRead;
+  /* Then its depth - going backwards reaches every parent before its children */
+  nodes[2*count - 2] = 0;
+  for (i = 2*count - 3; i >= 0; i--)
+    nodes[i] = nodes[nodes[i]] + 1;
+
+  for (i = 0; i < count; i++)
+    depths[i] = nodes[i];
+
+  free(joinWeights);
+  free(nodes);
+  return 0;
 }
+static int HuffSymbolWeightCompare_(const void *a, const void *b)
+{
+  const struct HuffSymbolWeight_ *weightA = a;
+  const struct HuffSymbolWeight_ *weightB = b;
+
+  if (weightA->weight != weightB->weight)
+    return (weightA->weight < weightB->weight) ? -1 : 1;
 
-static int HuffDecoderExpandToFitByte_(HuffDecoder decoder)
+  return weightB->symbol - weightA->symbol;
+}
+static void HuffSymbolCodes_(const uint8_t *lengths, int count, uint32_t *codes)
 {
-  assert(decoder != NULL);
+  int lengthCounts[HUFF_SYMBOL_MAX_LENGTH + 1];
+  uint32_t nextCode[HUFF_SYMBOL_MAX_LENGTH + 1];
+  uint32_t code;
+  int i;
+  assert(lengths != NULL);
+  assert(codes != NULL);
+
+  for (i = 0; i <= HUFF_SYMBOL_MAX_LENGTH; i++)
+    lengthCounts[i] = 0;
+  for (i = 0; i < count; i++) {
+    assert(lengths[i] <= HUFF_SYMBOL_MAX_LENGTH);
+    lengthCounts[lengths[i]]++;
+  }
+  lengthCounts[0] = 0;
 
-  assert(decoder->byteIdx <= decoder->bufferSize);
+  code = 0;
+  nextCode[0] = 0;
+  for (i = 1; i <= HUFF_SYMBOL_MAX_LENGTH; i++) {
+    code = (code + lengthCounts[i-1]) << 1;
+    nextCode[i] = code;
+  }
 
-  HuffDecoderProcessHolder_(decoder);
+  for (i = 0; i < count; i++) {
+    int length = lengths[i];
+    int bitIdx;
 
-  if (decoder->byteIdx == decoder->bufferSize) {
-    int newSize;
-    uint8_t *newBuf;
+    codes[i] = 0;
+    if (length == 0)
+      continue;
 
-    /* Prevent overflow conditions */
-    if (decoder->bufferSize > INT_MAX / 2)
-      return -1;
+    /* Canonical codes are assigned most significant bit first, and written first bit first */
+    code = nextCode[length]++;
+    for (bitIdx = 0; bitIdx < length; bitIdx++)
+      codes[i] |= ((code >> (length - 1 - bitIdx)) & 1) << bitIdx;
+  }
+}
+static int HuffSymbolEncoderExpand_(HuffSymbolEncoder encoder, size_t byteCount)
+{
+  assert(encoder != NULL);
+  assert(encoder->byteIdx >= encoder->readIdx);
+
+  /* Reclaim the written bytes at the front if that pays for itself - see HuffEncoderExpandBufferToFit_ */
+  if (encoder->bufferSize - encoder->byteIdx < byteCount
+      && encoder->readIdx >= encoder->byteIdx - encoder->readIdx) {
+    size_t pending = encoder->byteIdx - encoder->readIdx;
+    memmove(encoder->buffer, encoder->buffer + encoder->readIdx, pending);
+    encoder->readIdx = 0;
+    encoder->byteIdx = pending;
+  }
 
-    /* The holder will take another byte, so 2 bytes will not be sufficient */
-    if (decoder->bufferSize == 1 && decoder->dataHolderInUse)
-      newSize = 4;
-    else
-      newSize = decoder->bufferSize*2;
+  while (encoder->bufferSize - encoder->byteIdx < byteCount) {
+    uint8_t *newBuffer;
+    if (encoder->bufferSize > SIZE_MAX / 2)
+      return -1;
 
-    newBuf = realloc(decoder->buffer, newSize);
-    if (newBuf == NULL)
+    newBuffer = realloc(encoder->buffer, encoder->bufferSize*2);
+    if (newBuffer == NULL)
       return -1;
 
-    decoder->bufferSize = newSize;
-    decoder->buffer = newBuf;
+    encoder->buffer = newBuffer;
+    encoder->bufferSize *= 2;
   }
 
-  HuffDecoderProcessHolder_(decoder);
-  assert(decoder->byteIdx < decoder->bufferSize);
   return 0;
 }
+static int HuffSymbolDecoderReadHeader_(HuffSymbolDecoder decoder)
+{
+  uint8_t *lengths;
+  uint64_t kraftSum = 0;
+  int symbolCount;
+  int maxLength;
+  int bitPos;
+  int ret = HUFF_BADDATA;
+  int i;
+  assert(decoder != NULL);
+  assert(decoder->headerBytesRead == decoder->headerSize);
+
+  symbolCount = decoder->alphabetSize + 1;
+  maxLength = decoder->header[HUFF_SYMBOL_HEADER_SIZE];
+  if (maxLength == 0 || maxLength > HUFF_SYMBOL_MAX_LENGTH)
+    return HUFF_BADDATA;
+
+  lengths = malloc(symbolCount);
+  if (lengths == NULL)
+    return HUFF_NOMEM;
+
+  /* The size is checked against the most the tokens could take, so it fits in an int */
+  bitPos = (HUFF_SYMBOL_HEADER_SIZE + 1)*8;
+  if (HuffHeaderGetLengths_(decoder->header, (int)decoder->headerSize*8, &bitPos, lengths, symbolCount, maxLength))
+    goto out;
+
+  /* As with canonical headers, the codes have to fit in the code space, and the end of the stream has to be
+     markable */
+  for (i = 0; i < symbolCount; i++) {
+    if (lengths[i] != 0)
+      kraftSum += (uint64_t)1 << (maxLength - lengths[i]);
+  }
+  if (kraftSum > ((uint64_t)1 << maxLength) || lengths[decoder->alphabetSize] == 0)
+    goto out;
+
+  decoder->entries = HuffSymbolDecodeTableInit_(lengths, symbolCount, maxLength, &decoder->rootBits);
+  ret = (decoder->entries == NULL) ? HUFF_NOMEM : HUFF_SUCCESS;
+out:
+  free(lengths);
+  return ret;
+}
+static uint32_t *HuffSymbolDecodeTableInit_(const uint8_t *lengths, int count, int maxLength, int *rootBits)
+{
+  uint8_t subBits[1 << HUFF_SYMBOL_ROOT_BITS];
+  uint32_t *entries;
+  uint32_t *codes;
+  uint32_t rootSize;
+  uint32_t entryCount;
+  uint32_t i;
+  int c;
+  assert(lengths != NULL);
+  assert(rootBits != NULL);
+  assert(maxLength > 0 && maxLength <= HUFF_SYMBOL_MAX_LENGTH);
+
+  codes = malloc(count*sizeof(*codes));
+  if (codes == NULL)
+    return NULL;
+  HuffSymbolCodes_(lengths, count, codes);
+
+  *rootBits = (maxLength < HUFF_SYMBOL_ROOT_BITS) ? maxLength : HUFF_SYMBOL_ROOT_BITS;
+  rootSize = (uint32_t)1 << *rootBits;
+
+  /* Each subtable is sized for the longest code that goes through it */
+  memset(subBits, 0, rootSize);
+  for (c = 0; c < count; c++) {
+    int rest = lengths[c] - *rootBits;
+    if (rest > subBits[codes[c] & (rootSize - 1)])
+      subBits[codes[c] & (rootSize - 1)] = (uint8_t)rest;
+  }
+  entryCount = rootSize;
+  for (i = 0; i < rootSize; i++) {
+    if (subBits[i] != 0)
+      entryCount += (uint32_t)1 << subBits[i];
+  }
+
+  entries = calloc(entryCount, sizeof(*entries));
+  if (entries == NULL)
+    goto out;
+
+  /* At most 2^12 subtables of at most 2^8 entries, so where they start always fits above the low 8 bits */
+  entryCount = rootSize;
+  for (i = 0; i < rootSize; i++) {
+    if (subBits[i] == 0)
+      continue;
+    entries[i] = entryCount << 8 | HUFF_SYMBOL_LINK | subBits[i];
+    entryCount += (uint32_t)1 << subBits[i];
+  }
+
+  /* Every index that starts with a code decodes to it */
+  for (c = 0; c < count; c++) {
+    int length = lengths[c];
+    if (length == 0)
+      continue;
+
+    if (length <= *rootBits) {
+      for (i = codes[c]; i < rootSize; i += (uint32_t)1 << length)
+        entries[i] = (uint32_t)c << 8 | (uint32_t)length;
+    } else {
+      uint32_t link = entries[codes[c] & (rootSize - 1)];
+      uint32_t *sub = entries + (link >> 8);
+      int rest = length - *rootBits;
+      for (i = codes[c] >> *rootBits; i < ((uint32_t)1 << (link & 0x3F)); i += (uint32_t)1 << rest)
+        sub[i] = (uint32_t)c << 8 | (uint32_t)rest;
+    }
+  }
 
-static void HuffDecoderProcessHolder_(HuffDecoder decoder)
+out:
+  free(codes);
+  return entries;
+}
+static int HuffSymbolDecoderExpand_(HuffSymbolDecoder decoder)
 {
+  uint16_t *newSymbols;
   assert(decoder != NULL);
-  
-  if (decoder->dataHolderInUse && decoder->byteIdx < decoder->bufferSize) {
-    decoder->buffer[decoder->byteIdx++] = decoder->dataHolder;
-    decoder->dataHolderInUse = 0;
+  assert(decoder->symbolIdx >= decoder->readIdx);
+
+  if (decoder->symbolIdx < decoder->symbolsSize)
+    return 0;
+
+  /* Reclaim the written symbols at the front if that pays for itself - see HuffEncoderExpandBufferToFit_ */
+  if (decoder->readIdx > 0 && decoder->readIdx >= decoder->symbolIdx - decoder->readIdx) {
+    size_t pending = decoder->symbolIdx - decoder->readIdx;
+
+    memmove(decoder->symbols, decoder->symbols + decoder->readIdx, pending*sizeof(*decoder->symbols));
+    decoder->readIdx = 0;
+    decoder->symbolIdx = pending;
+    return 0;
   }
-}
\ No newline at end of file
+
+  if (decoder->symbolsSize > SIZE_MAX / 2 / sizeof(*decoder->symbols))
+    return -1;
+
+  newSymbols = realloc(decoder->symbols, decoder->symbolsSize*2*sizeof(*decoder->symbols));
+  if (newSymbols == NULL)
+    return -1;
+
+  decoder->symbolsSize *= 2;
+  decoder->symbols = newSymbols;
+  return 0;
+}
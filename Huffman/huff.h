@@ -5,11 +5,19 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define HUFF_SUCCESS 0
 #define HUFF_NOMEM -1
 #define HUFF_TOOMUCHDATA -2
+#define HUFF_BADDATA -3
+/* Returned by the stream functions once the whole stream is done */
+#define HUFF_STREAMEND 1
+
+/* Range for the code length limit of canonical streams (0 means no limit) */
+#define HUFF_MINCODELENGTH 9
+#define HUFF_MAXCODELENGTH 56
 
 struct HuffCounter_;
 typedef struct HuffCounter_ *HuffCounter;
@@ -17,24 +25,203 @@ struct HuffEncoder_;
 typedef struct HuffEncoder_ *HuffEncoder;
 struct HuffDecoder_;
 typedef struct HuffDecoder_ *HuffDecoder;
+struct HuffTable_;
+typedef struct HuffTable_ *HuffTable;
+struct HuffDecodeCache_;
+typedef struct HuffDecodeCache_ *HuffDecodeCache;
+struct HuffSymbolCounter_;
+typedef struct HuffSymbolCounter_ *HuffSymbolCounter;
+struct HuffSymbolEncoder_;
+typedef struct HuffSymbolEncoder_ *HuffSymbolEncoder;
+struct HuffSymbolDecoder_;
+typedef struct HuffSymbolDecoder_ *HuffSymbolDecoder;
+
+/* zlib-style stream - point nextIn/availIn at the input and nextOut/availOut at room for the output,
+   and the stream functions move them along as they go
+   The stream only holds on to a few bytes of its own, however much data goes through it */
+typedef struct HuffStream
+{
+  const uint8_t *nextIn;
+  size_t availIn;
+  uint64_t totalIn;
+
+  uint8_t *nextOut;
+  size_t availOut;
+  uint64_t totalOut;
+
+  /* Internal */
+  void *state;
+} HuffStream;
+
+/* Flush values for HuffEncodeStream */
+#define HUFF_NOFLUSH 0
+#define HUFF_FINISH 1
 
 HuffCounter HuffCounterInit(void);
 HuffCounter HuffCounterCopy(HuffCounter from);
 void HuffCounterDestroy(HuffCounter counter);
 int HuffCounterFeedData(HuffCounter counter, const uint8_t *data, int length);
+/* Counts are 64 bit, so a counter takes up to 2^56 bytes in all, and the 64 functions take lengths of any size
+   Streams in the original format (HuffEncoderInit) still can't hold more than INT32_MAX bytes, since the counts go
+   in their header - canonical streams only hold code lengths, so they don't have a limit */
+int HuffCounterFeedData64(HuffCounter counter, const uint8_t *data, size_t length);
+/* Counts |data| on up to |threadCount| threads - the counts come out the same however many threads there are */
+int HuffCounterFeedDataParallel(HuffCounter counter, const uint8_t *data, size_t length, int threadCount);
+/* Adds the counts of |from| to |into|, as if everything fed to |from| had been fed to |into| */
+int HuffCounterMerge(HuffCounter into, HuffCounter from);
+
+/* Exact size of the stream a canonical encoder with |maxCodeLength| writes for everything |counter| has counted,
+   header and all - what HuffEncoderByteCount adds up to once it's all been fed and ended, without coding anything
+   Returns 0 if there isn't enough memory to work it out
+   HuffCounterEntropyBound is quicker but rougher - the entropy of the counts in bytes, which no code can get under,
+   header aside */
+size_t HuffCounterEncodedSize(HuffCounter counter, int maxCodeLength);
+size_t HuffCounterEntropyBound(HuffCounter counter);
 
+/* As |initialBufferSize|, makes the encoder's buffer just big enough for all the code |counter| adds up to, so it's
+   allocated once and never has to grow */
+#define HUFF_BUFFER_EXACT -1
 HuffEncoder HuffEncoderInit(HuffCounter counter, int initialBufferSize);
+HuffEncoder HuffEncoderInitCanonical(HuffCounter counter, int initialBufferSize, int maxCodeLength);
 void HuffEncoderDestroy(HuffEncoder encoder);
+/* Canonical encoders only have codes for the bytes |counter| counted - feeding one any other byte gives HUFF_BADDATA,
+   with |*processed| set to its index, so the bytes before it are coded and it and the rest aren't
+   The original format has a code for every byte */
 int HuffEncoderFeedData(HuffEncoder encoder, const uint8_t *data, int length, int *processed);
 int HuffEncoderEndData(HuffEncoder encoder);
+/* Returns at most INT_MAX, even if more is waiting - HuffEncoderByteCount64 has the real number */
 int HuffEncoderByteCount(HuffEncoder encoder);
 int HuffEncoderWriteBytes(HuffEncoder encoder, uint8_t *buf, int length);
+int HuffEncoderFeedData64(HuffEncoder encoder, const uint8_t *data, size_t length, size_t *processed);
+size_t HuffEncoderByteCount64(HuffEncoder encoder);
+size_t HuffEncoderWriteBytes64(HuffEncoder encoder, uint8_t *buf, size_t length);
 
 HuffDecoder HuffDecoderInit(int initialBufferSize);
 void HuffDecoderDestroy(HuffDecoder decoder);
 int HuffDecoderFeedData(HuffDecoder decoder, const uint8_t *data, int length, int *processed);
+/* Returns at most INT_MAX, like HuffEncoderByteCount */
 int HuffDecoderByteCount(HuffDecoder decoder);
 int HuffDecoderWriteBytes(HuffDecoder decoder, uint8_t *buf, int length);
+int HuffDecoderFeedData64(HuffDecoder decoder, const uint8_t *data, size_t length, size_t *processed);
+size_t HuffDecoderByteCount64(HuffDecoder decoder);
+size_t HuffDecoderWriteBytes64(HuffDecoder decoder, uint8_t *buf, size_t length);
+
+/* A cache of decode tables, for decoders that keep seeing the same few headers
+   Decoders given the cache (before they're fed anything) look the header up there, and only build the table if it
+   isn't there, adding it for next time - the cache holds at most |capacity| tables, dropping the least recently used
+   Any number of decoders can use one cache at once, on any threads, and it has to outlive them
+   HuffDecodeCacheStats gives the number of headers that were and weren't found */
+HuffDecodeCache HuffDecodeCacheInit(int capacity);
+void HuffDecodeCacheDestroy(HuffDecodeCache cache);
+void HuffDecodeCacheStats(HuffDecodeCache cache, uint64_t *hits, uint64_t *misses);
+void HuffDecoderSetCache(HuffDecoder decoder, HuffDecodeCache cache);
+
+/* Streams write canonical streams, and every byte fed in has to have been counted by |counter|
+   HuffEncodeStream returns HUFF_SUCCESS while there's more to do - with HUFF_NOFLUSH that's until all the input is
+   taken, with HUFF_FINISH it's until the stream is complete, at which point it returns HUFF_STREAMEND
+   HUFF_BADDATA means the input had a byte that wasn't counted */
+int HuffEncodeStreamInit(HuffStream *stream, HuffCounter counter, int maxCodeLength);
+/* Adaptive streams need no counter - the code is worked out as the data goes by, so the data only has to be seen once
+   and every finished byte comes out straight away, which suits pipes and sockets
+   They take longer to code than canonical streams and come out a little bigger for data that doesn't change,
+   and decode through HuffDecodeStream, HuffDecoderFeedData and HuffDecompress like the rest */
+int HuffEncodeStreamInitAdaptive(HuffStream *stream);
+int HuffEncodeStream(HuffStream *stream, int flush);
+void HuffEncodeStreamEnd(HuffStream *stream);
+/* HuffDecodeStream returns HUFF_SUCCESS when it needs more input or more room for output, and HUFF_STREAMEND
+   once the whole stream has been decoded - nextIn is then left just past the end of the stream */
+int HuffDecodeStreamInit(HuffStream *stream);
+int HuffDecodeStream(HuffStream *stream);
+void HuffDecodeStreamSetCache(HuffStream *stream, HuffDecodeCache cache);
+void HuffDecodeStreamEnd(HuffStream *stream);
+
+/* Whole buffers in one call, straight into |dst| - |*dstLength| is set to the number of bytes written
+   HUFF_TOOMUCHDATA means |dst| was too small, which can't happen to HuffCompress with HuffCompressBound bytes
+   HuffCompress writes canonical streams, and HuffDecompress reads either format */
+size_t HuffCompressBound(size_t length);
+int HuffCompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength);
+int HuffDecompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength);
+/* Codes every byte with a table picked by the byte before it, for data like logs and protocol messages, where what
+   comes next depends a lot on what just came - the busiest contexts get tables of their own where they pay for
+   themselves, up to 32 of them, and the rest share one
+   Writes a canonical stream instead when that's no bigger, so the output fits in HuffCompressBound bytes too
+   HuffDecompress reads order-1 streams, but the decoders and HuffDecodeStream don't */
+int HuffCompressContext(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength);
+
+/* Shared tables, for lots of small messages that look alike
+   A table is worked out once from a counter fed with sample data, and then used by encoders and decoders in place of
+   a header - their streams are nothing but the code, so both ends have to have the same table
+   Every byte value gets a code, including ones the samples didn't have
+   The ID is up to the caller, to tell tables apart by (in a message's envelope, say), and is saved with the table
+   A table can be used by any number of encoders and decoders at once, on any threads, and has to outlive them
+   HuffTableLoad returns HUFF_BADDATA if |src| isn't a saved table
+   Streams from HuffCompressWithTable fit in HuffTableCompressBound bytes */
+HuffTable HuffTableInit(HuffCounter counter, int maxCodeLength, uint32_t id);
+void HuffTableDestroy(HuffTable table);
+uint32_t HuffTableId(HuffTable table);
+size_t HuffTableSaveSize(HuffTable table);
+void HuffTableSave(HuffTable table, uint8_t *dst);
+int HuffTableLoad(const uint8_t *src, size_t srcLength, HuffTable *table);
+HuffEncoder HuffEncoderInitWithTable(HuffTable table, int initialBufferSize);
+HuffDecoder HuffDecoderInitWithTable(HuffTable table, int initialBufferSize);
+size_t HuffTableCompressBound(HuffTable table, size_t length);
+int HuffCompressWithTable(HuffTable table, const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity,
+                          size_t *dstLength);
+int HuffDecompressWithTable(HuffTable table, const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity,
+                            size_t *dstLength);
+
+/* Framed streams are cut into blocks of |blockSize| bytes (0 for the default) with a table each
+   HuffFrameCompress codes the blocks on up to |threadCount| threads, and the output is the same for any number of
+   threads - it fits in HuffFrameCompressBound bytes
+   Blocks that wouldn't come out smaller for being Huffman coded are stored as they are, or as the one byte they hold,
+   or as runs of bytes if that's smaller still - so a frame is never more than a few bytes a block bigger than its data,
+   and data like that decodes about as fast as it can be copied
+   With HUFF_FRAME_INDEX in |flags|, an index of the blocks goes at the end, for HuffDecodeRange to seek with
+   With HUFF_FRAME_STREAMS in |flags|, each block's symbols are split between several bitstreams that decode side by
+   side, for faster decoding at the cost of a few bytes a block and codes no longer than 11 bits
+   With HUFF_FRAME_SPLIT in |flags|, blocks are cut where the data changes enough for a new table to pay for itself
+   rather than every |blockSize| bytes, which is then just the most a block can hold, and blocks that code at least as
+   well with the table before them repeat it instead of having a header - it can't be used with HUFF_FRAME_STREAMS
+   HuffFrameDecompress reads frames, including several written one after another, and decodes the blocks on up to
+   |threadCount| threads - HuffDecompress reads them too, on one thread */
+#define HUFF_MINBLOCKSIZE (4*1024)
+#define HUFF_DEFAULTBLOCKSIZE (1024*1024)
+#define HUFF_MAXBLOCKSIZE (64*1024*1024)
+#define HUFF_FRAME_INDEX 1
+#define HUFF_FRAME_STREAMS 2
+#define HUFF_FRAME_SPLIT 4
+size_t HuffFrameCompressBound(size_t length, int blockSize);
+int HuffFrameCompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength,
+                      int blockSize, int threadCount, int flags);
+int HuffFrameDecompress(const uint8_t *src, size_t srcLength, uint8_t *dst, size_t dstCapacity, size_t *dstLength,
+                        int threadCount);
+/* Decodes up to |length| bytes of a frame's data, starting |offset| bytes in, decoding only the blocks that hold them
+   |*dstLength| is set to the number of bytes written, which is less than |length| only at the end of the data */
+int HuffDecodeRange(const uint8_t *src, size_t srcLength, uint64_t offset, uint8_t *dst, size_t length,
+                    size_t *dstLength);
+
+/* Symbol streams code 16 bit symbols from an alphabet of |alphabetSize| (LZ tokens, quantized samples and the like)
+   the way canonical streams code bytes - count them all, make an encoder from the counter, feed it the same symbols,
+   end it and write out its bytes, then feed those to a decoder and write out its symbols
+   The alphabet size goes in the header, so the decoder doesn't need to be told it, and no code is longer than 20 bits
+   Feeding a counter a symbol outside its alphabet, or an encoder one its counter didn't count, gives HUFF_BADDATA
+   Decoders stop taking input at the end of the stream, which HuffSymbolDecoderFinished then returns 1 for */
+#define HUFF_MAXALPHABET 65536
+HuffSymbolCounter HuffSymbolCounterInit(int alphabetSize);
+void HuffSymbolCounterDestroy(HuffSymbolCounter counter);
+int HuffSymbolCounterFeedData(HuffSymbolCounter counter, const uint16_t *symbols, size_t count);
+HuffSymbolEncoder HuffSymbolEncoderInit(HuffSymbolCounter counter);
+void HuffSymbolEncoderDestroy(HuffSymbolEncoder encoder);
+int HuffSymbolEncoderFeedData(HuffSymbolEncoder encoder, const uint16_t *symbols, size_t count, size_t *processed);
+int HuffSymbolEncoderEndData(HuffSymbolEncoder encoder);
+size_t HuffSymbolEncoderByteCount(HuffSymbolEncoder encoder);
+size_t HuffSymbolEncoderWriteBytes(HuffSymbolEncoder encoder, uint8_t *buf, size_t length);
+HuffSymbolDecoder HuffSymbolDecoderInit(void);
+void HuffSymbolDecoderDestroy(HuffSymbolDecoder decoder);
+int HuffSymbolDecoderFeedData(HuffSymbolDecoder decoder, const uint8_t *data, size_t length, size_t *processed);
+size_t HuffSymbolDecoderSymbolCount(HuffSymbolDecoder decoder);
+size_t HuffSymbolDecoderWriteSymbols(HuffSymbolDecoder decoder, uint16_t *buf, size_t count);
+int HuffSymbolDecoderFinished(HuffSymbolDecoder decoder);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,609 @@
+#ifndef HUFF_HPP
+#define HUFF_HPP
+
+/* Header-only C++ front end
+   huff::Codec<AlphabetSize, MaxCodeLength, StreamCount> fixes the alphabet, the code length limit and the number of
+   interleaved bitstreams at compile time, so every table has a constant size, the decode table is a single flat
+   level, and the loops over the codes of one refill and over the streams unroll completely
+   Encoders and decoders own their tables and are move-only, and coding itself never allocates
+   Only the return codes come from huff.h - nothing here calls into huff.c
+   Needs C++20, for std::span
+
+   Blocks have a format of their own:
+     "HUF" and the format byte
+     the alphabet size less one (2 bytes), the length limit and the stream count (1 byte each)
+     every symbol's code length in LengthBits bits, first symbol in the lowest bits, padded out to a byte
+     the number of symbols (8 bytes)
+     the byte length of every bitstream but the last (4 bytes each)
+     the bitstreams
+   Symbol i goes in bitstream i % StreamCount, codes are canonical with their first bit in the lowest position,
+   and every bitstream is padded out to a byte - there's no EOF, the symbol count says where to stop
+   All numbers are little-endian */
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "huff.h"
+
+namespace huff
+{
+
+namespace detail
+{
+
+/* The format byte after "HUF" - the formats in huff.c use 0 to 5 */
+constexpr std::uint8_t kFormat = 0x80 | 6;
+constexpr std::size_t kMagicSize = 4;
+
+inline std::uint64_t LoadLE64(const std::uint8_t *p) noexcept
+{
+  std::uint64_t v = 0;
+  if constexpr (std::endian::native == std::endian::little) {
+    std::memcpy(&v, p, sizeof(v));
+  } else {
+    for (int i = 7; i >= 0; i--)
+      v = v << 8 | p[i];
+  }
+  return v;
+}
+
+inline void StoreLE64(std::uint8_t *p, std::uint64_t v) noexcept
+{
+  if constexpr (std::endian::native == std::endian::little) {
+    std::memcpy(p, &v, sizeof(v));
+  } else {
+    for (int i = 0; i < 8; i++)
+      p[i] = std::uint8_t(v >> 8*i);
+  }
+}
+
+inline std::uint32_t LoadLE32(const std::uint8_t *p) noexcept
+{
+  return std::uint32_t(p[0]) | std::uint32_t(p[1]) << 8 | std::uint32_t(p[2]) << 16 | std::uint32_t(p[3]) << 24;
+}
+
+inline void StoreLE32(std::uint8_t *p, std::uint32_t v) noexcept
+{
+  p[0] = std::uint8_t(v);
+  p[1] = std::uint8_t(v >> 8);
+  p[2] = std::uint8_t(v >> 16);
+  p[3] = std::uint8_t(v >> 24);
+}
+
+/* Calls |f| with std::integral_constant 0 to N - 1, written out one after the other rather than as a loop */
+template <std::size_t... I, class F>
+inline void UnrollImpl(std::index_sequence<I...>, F &&f)
+{
+  (f(std::integral_constant<std::size_t, I>{}), ...);
+}
+
+template <std::size_t N, class F>
+inline void Unroll(F &&f)
+{
+  UnrollImpl(std::make_index_sequence<N>{}, std::forward<F>(f));
+}
+
+/* Package-merge, as in huff.c - |weights| are sorted lightest first, and |lengths| gets the optimal lengths no
+   longer than |maxLength| for them, in the same order
+   Needs 2 <= weights.size() <= 2^maxLength */
+inline void LimitedLengths(const std::vector<std::uint64_t> &weights, int maxLength, std::vector<int> &lengths)
+{
+  /* Each level's list is the symbols merged with the pairs ("packages") of the level below it,
+     cut off at the 2*count - 2 lightest, and only whether each item is a package has to be kept */
+  std::size_t count = weights.size();
+  std::size_t maxItems = 2*count - 2;
+  std::vector<std::uint64_t> prevWeights(weights);
+  std::vector<std::uint64_t> curWeights(maxItems);
+  std::vector<std::uint8_t> isPackage(std::size_t(maxLength)*maxItems);
+  std::size_t prevSize = count;
+  std::size_t take;
+  assert(count >= 2 && count <= (std::size_t{1} << maxLength));
+
+  for (int level = 1; level < maxLength; level++) {
+    std::size_t packages = prevSize/2;
+    std::size_t leafIdx = 0;
+    std::size_t packageIdx = 0;
+    std::size_t curSize = 0;
+
+    while (curSize < maxItems && (leafIdx < count || packageIdx < packages)) {
+      std::uint64_t packageWeight = 0;
+      if (packageIdx < packages)
+        packageWeight = prevWeights[2*packageIdx] + prevWeights[2*packageIdx + 1];
+
+      if (packageIdx == packages || (leafIdx < count && weights[leafIdx] <= packageWeight)) {
+        curWeights[curSize] = weights[leafIdx++];
+      } else {
+        curWeights[curSize] = packageWeight;
+        isPackage[level*maxItems + curSize] = 1;
+        packageIdx++;
+      }
+      curSize++;
+    }
+
+    std::swap(prevWeights, curWeights);
+    curWeights.resize(maxItems);
+    prevSize = curSize;
+  }
+
+  /* Take the lightest 2*count - 2 items from the top level and follow their packages down -
+     each symbol's length is the number of levels it gets taken at */
+  lengths.assign(count, 0);
+  take = maxItems;
+  for (int level = maxLength - 1; level >= 0; level--) {
+    std::size_t packages = 0;
+    for (std::size_t i = 0; i < take; i++)
+      packages += isPackage[level*maxItems + i];
+    for (std::size_t i = 0; i < take - packages; i++)
+      lengths[i]++;
+    take = 2*packages;
+  }
+  assert(take == 0);
+}
+
+inline std::uint32_t ReverseBits(std::uint32_t code, int length) noexcept
+{
+  std::uint32_t reversed = 0;
+  for (int i = 0; i < length; i++) {
+    reversed = reversed << 1 | (code & 1);
+    code >>= 1;
+  }
+  return reversed;
+}
+
+/* Canonical codes for |lengths|, bit-reversed so that the first bit is the lowest - symbols with length 0 get 0 */
+template <std::size_t N>
+inline void CanonicalCodes(std::span<const std::uint8_t, N> lengths, int maxLength,
+                           std::span<std::uint32_t, N> codes) noexcept
+{
+  std::array<std::uint32_t, 33> next{};
+  std::uint32_t code = 0;
+
+  for (std::size_t i = 0; i < N; i++)
+    next[lengths[i]]++;
+  for (int len = 1; len <= maxLength; len++) {
+    std::uint32_t lengthCount = next[len];
+    next[len] = code;
+    code = (code + lengthCount) << 1;
+  }
+
+  for (std::size_t i = 0; i < N; i++)
+    codes[i] = lengths[i] == 0 ? 0 : ReverseBits(next[lengths[i]]++, lengths[i]);
+}
+
+} /* namespace detail */
+
+/* AlphabetSize symbols (2 to 65536), codes no longer than MaxCodeLength bits (1 to 16), and StreamCount
+   interleaved bitstreams (1 to 255) - more streams let the decoder work on several codes at once */
+template <std::size_t AlphabetSize, int MaxCodeLength, int StreamCount = 1>
+class Codec
+{
+  static_assert(AlphabetSize >= 2 && AlphabetSize <= HUFF_MAXALPHABET, "alphabet size out of range");
+  static_assert(MaxCodeLength >= 1 && MaxCodeLength <= 16, "the decode table has 2^MaxCodeLength entries");
+  static_assert(AlphabetSize <= (std::size_t{1} << MaxCodeLength), "too short a length limit for the alphabet");
+  static_assert(StreamCount >= 1 && StreamCount <= 255, "stream count out of range");
+
+public:
+  using Symbol = std::conditional_t<(AlphabetSize <= 256), std::uint8_t, std::uint16_t>;
+  using Histogram = std::array<std::uint64_t, AlphabetSize>;
+
+  /* Bits each code length takes in the header */
+  static constexpr int LengthBits = std::bit_width(unsigned(MaxCodeLength));
+  static constexpr std::size_t LengthsSize = (AlphabetSize*LengthBits + 7)/8;
+  static constexpr std::size_t HeaderSize = detail::kMagicSize + 4 + LengthsSize + 8 + 4*(StreamCount - 1);
+  /* Every refill leaves at least 56 bits in a stream's bit buffer, so this many codes can be read or written
+     between refills */
+  static constexpr int CodesPerRefill = 56/MaxCodeLength;
+  static constexpr std::size_t TableSize = std::size_t{1} << MaxCodeLength;
+
+  /* Largest block |count| symbols can make */
+  static constexpr std::size_t Bound(std::size_t count) noexcept
+  {
+    return HeaderSize + (count*MaxCodeLength + 7)/8 + StreamCount;
+  }
+
+  /* Adds the symbols of |data| to |counts|
+     Returns HUFF_BADDATA if a symbol is outside the alphabet, leaving |counts| alone */
+  static int Count(std::span<const Symbol> data, std::span<std::uint64_t, AlphabetSize> counts) noexcept
+  {
+    if constexpr (AlphabetSize < (std::size_t{1} << 8*sizeof(Symbol))) {
+      for (Symbol s : data) {
+        if (s >= AlphabetSize)
+          return HUFF_BADDATA;
+      }
+    }
+    for (Symbol s : data)
+      counts[s]++;
+    return HUFF_SUCCESS;
+  }
+
+  class Encoder
+  {
+  public:
+    /* Builds the code for |counts| - symbols with a count of 0 get no code
+       Throws std::bad_alloc if the tables can't be allocated */
+    explicit Encoder(std::span<const std::uint64_t, AlphabetSize> counts)
+      : tables_(std::make_unique<Tables>())
+    {
+      std::vector<std::pair<std::uint64_t, std::size_t>> used;
+      std::vector<std::uint64_t> weights;
+      std::vector<int> lengths;
+      Tables &tables = *tables_;
+
+      for (std::size_t i = 0; i < AlphabetSize; i++) {
+        if (counts[i] != 0)
+          used.emplace_back(counts[i], i);
+      }
+      /* Package-merge needs two symbols - take unused ones with a count of 0 to make them up, which also keeps
+         every code complete */
+      for (std::size_t i = 0; used.size() < 2; i++) {
+        if (counts[i] == 0)
+          used.emplace_back(0, i);
+      }
+      std::sort(used.begin(), used.end());
+
+      for (auto &u : used)
+        weights.push_back(u.first);
+      detail::LimitedLengths(weights, MaxCodeLength, lengths);
+      tables.symbolLengths.fill(0);
+      for (std::size_t i = 0; i < used.size(); i++)
+        tables.symbolLengths[used[i].second] = std::uint8_t(lengths[i]);
+
+      detail::CanonicalCodes<AlphabetSize>(tables.symbolLengths, MaxCodeLength, tables.entries);
+      for (std::size_t i = 0; i < AlphabetSize; i++)
+        tables.entries[i] |= std::uint32_t(tables.symbolLengths[i]) << 16;
+      PackLengths(tables.symbolLengths, tables.lengths);
+    }
+
+    Encoder(Encoder &&) noexcept = default;
+    Encoder &operator=(Encoder &&) noexcept = default;
+    Encoder(const Encoder &) = delete;
+    Encoder &operator=(const Encoder &) = delete;
+
+    /* Writes |src| as one block at the start of |dst|, with its size in |*dstLength|
+       Returns HUFF_BADDATA if |src| has a symbol with no code, or HUFF_TOOMUCHDATA if |dst| is too small
+       (Bound is always enough) or a bitstream but the last would be 4 GB or more */
+    int Encode(std::span<const Symbol> src, std::span<std::uint8_t> dst, std::size_t &dstLength) const noexcept
+    {
+      constexpr std::size_t group = std::size_t(CodesPerRefill)*StreamCount;
+      const std::uint32_t *entries;
+      const Symbol *in = src.data();
+      std::size_t count = src.size();
+      std::array<std::uint64_t, StreamCount> bits{};
+      std::array<std::uint8_t *, StreamCount> pos;
+      std::array<std::uint8_t *, StreamCount> end;
+      std::array<std::uint64_t, StreamCount> bitBuf{};
+      std::array<unsigned, StreamCount> bitCount{};
+      std::uint32_t missing = 0;
+      std::size_t total = HeaderSize;
+      std::uint8_t *out;
+      std::size_t i;
+      assert(tables_ != nullptr);
+      entries = tables_->entries.data();
+      dstLength = 0;
+
+      /* Size every bitstream first, so each one can be written straight into its place */
+      for (i = 0; count - i >= StreamCount; i += StreamCount) {
+        detail::Unroll<StreamCount>([&](auto s) {
+          std::uint32_t entry = Lookup(entries, in[i + s]);
+          bits[s] += entry >> 16;
+          missing |= entry == 0;
+        });
+      }
+      for (; i < count; i++) {
+        std::uint32_t entry = Lookup(entries, in[i]);
+        bits[i % StreamCount] += entry >> 16;
+        missing |= entry == 0;
+      }
+      if (missing)
+        return HUFF_BADDATA;
+
+      for (int s = 0; s < StreamCount; s++) {
+        if (s < StreamCount - 1 && (bits[s] + 7)/8 > 0xFFFFFFFF)
+          return HUFF_TOOMUCHDATA;
+        total += (bits[s] + 7)/8;
+      }
+      if (total > dst.size())
+        return HUFF_TOOMUCHDATA;
+
+      out = dst.data();
+      out[0] = 'H';
+      out[1] = 'U';
+      out[2] = 'F';
+      out[3] = detail::kFormat;
+      out[4] = std::uint8_t(AlphabetSize - 1);
+      out[5] = std::uint8_t((AlphabetSize - 1) >> 8);
+      out[6] = std::uint8_t(MaxCodeLength);
+      out[7] = std::uint8_t(StreamCount);
+      std::memcpy(out + 8, tables_->lengths.data(), LengthsSize);
+      detail::StoreLE64(out + 8 + LengthsSize, count);
+      for (int s = 0; s < StreamCount - 1; s++)
+        detail::StoreLE32(out + 16 + LengthsSize + 4*s, std::uint32_t((bits[s] + 7)/8));
+
+      out += HeaderSize;
+      for (int s = 0; s < StreamCount; s++) {
+        pos[s] = out;
+        out += (bits[s] + 7)/8;
+        end[s] = out;
+      }
+
+      for (i = 0; count - i >= group; i += group) {
+        detail::Unroll<CodesPerRefill>([&](auto k) {
+          detail::Unroll<StreamCount>([&](auto s) {
+            std::uint32_t entry = entries[in[i + k*StreamCount + s]];
+            bitBuf[s] |= std::uint64_t(entry & 0xFFFF) << bitCount[s];
+            bitCount[s] += entry >> 16;
+          });
+        });
+        detail::Unroll<StreamCount>([&](auto s) { Flush(pos[s], end[s], bitBuf[s], bitCount[s]); });
+      }
+      for (; i < count; i++) {
+        std::size_t s = i % StreamCount;
+        std::uint32_t entry = entries[in[i]];
+        bitBuf[s] |= std::uint64_t(entry & 0xFFFF) << bitCount[s];
+        bitCount[s] += entry >> 16;
+        Flush(pos[s], end[s], bitBuf[s], bitCount[s]);
+      }
+      for (int s = 0; s < StreamCount; s++) {
+        if (bitCount[s] > 0)
+          *pos[s]++ = std::uint8_t(bitBuf[s]);
+        assert(pos[s] == end[s]);
+      }
+
+      dstLength = total;
+      return HUFF_SUCCESS;
+    }
+
+  private:
+    struct Tables
+    {
+      /* Code in the low 16 bits, length above that - 0 for symbols with no code */
+      std::array<std::uint32_t, AlphabetSize> entries;
+      /* The code lengths as they go in the header */
+      std::array<std::uint8_t, LengthsSize> lengths;
+      std::array<std::uint8_t, AlphabetSize> symbolLengths;
+    };
+
+    static std::uint32_t Lookup(const std::uint32_t *entries, Symbol s) noexcept
+    {
+      if constexpr (AlphabetSize < (std::size_t{1} << 8*sizeof(Symbol)))
+        return s < AlphabetSize ? entries[s] : 0;
+      else
+        return entries[s];
+    }
+
+    /* Writes out the whole bytes of a bit buffer - with a single store while there's room for it in the stream */
+    static void Flush(std::uint8_t *&pos, std::uint8_t *end, std::uint64_t &bitBuf, unsigned &bitCount) noexcept
+    {
+      if (end - pos >= 8) {
+        detail::StoreLE64(pos, bitBuf);
+        pos += bitCount >> 3;
+        bitBuf >>= bitCount & ~7u;
+        bitCount &= 7;
+      } else {
+        while (bitCount >= 8) {
+          *pos++ = std::uint8_t(bitBuf);
+          bitBuf >>= 8;
+          bitCount -= 8;
+        }
+      }
+    }
+
+    std::unique_ptr<Tables> tables_;
+  };
+
+  class Decoder
+  {
+  public:
+    /* Throws std::bad_alloc if the tables can't be allocated */
+    Decoder()
+      : tables_(std::make_unique<Tables>())
+    {
+    }
+
+    Decoder(Decoder &&) noexcept = default;
+    Decoder &operator=(Decoder &&) noexcept = default;
+    Decoder(const Decoder &) = delete;
+    Decoder &operator=(const Decoder &) = delete;
+
+    /* Decodes the block that makes up all of |src| into |dst|, with the number of symbols in |*dstLength|
+       The decode table is only rebuilt when the code lengths differ from the last block's
+       Returns HUFF_BADDATA if |src| isn't a block from a codec with the same parameters,
+       or HUFF_TOOMUCHDATA if |dst| is too small */
+    int Decode(std::span<const std::uint8_t> src, std::span<Symbol> dst, std::size_t &dstLength) noexcept
+    {
+      constexpr std::size_t group = std::size_t(CodesPerRefill)*StreamCount;
+      const std::uint8_t *data = src.data();
+      const std::uint8_t *srcEnd = data + src.size();
+      const Entry *entries;
+      Symbol *out = dst.data();
+      std::array<const std::uint8_t *, StreamCount> cur;
+      std::array<const std::uint8_t *, StreamCount> end;
+      std::array<std::uint64_t, StreamCount> bitBuf{};
+      std::array<unsigned, StreamCount> bitCount{};
+      std::uint64_t count;
+      std::size_t left;
+      std::size_t i;
+      assert(tables_ != nullptr);
+      dstLength = 0;
+
+      if (src.size() < HeaderSize)
+        return HUFF_BADDATA;
+      if (data[0] != 'H' || data[1] != 'U' || data[2] != 'F' || data[3] != detail::kFormat ||
+          data[4] != std::uint8_t(AlphabetSize - 1) || data[5] != std::uint8_t((AlphabetSize - 1) >> 8) ||
+          data[6] != MaxCodeLength || data[7] != StreamCount)
+        return HUFF_BADDATA;
+
+      if (!tables_->built || std::memcmp(tables_->lengths.data(), data + 8, LengthsSize) != 0) {
+        tables_->built = false;
+        if (!BuildTable(data + 8))
+          return HUFF_BADDATA;
+        std::memcpy(tables_->lengths.data(), data + 8, LengthsSize);
+        tables_->built = true;
+      }
+      entries = tables_->entries.data();
+
+      count = detail::LoadLE64(data + 8 + LengthsSize);
+      left = src.size() - HeaderSize;
+      cur[0] = data + HeaderSize;
+      for (int s = 0; s < StreamCount - 1; s++) {
+        std::uint32_t size = detail::LoadLE32(data + 16 + LengthsSize + 4*s);
+        if (size > left)
+          return HUFF_BADDATA;
+        left -= size;
+        end[s] = cur[s] + size;
+        cur[s + 1] = end[s];
+      }
+      end[StreamCount - 1] = srcEnd;
+      if (count > dst.size())
+        return HUFF_TOOMUCHDATA;
+
+      /* Bulk refills may read past the end of a stream into the next one - a stream that does that was bad
+         anyway, which the check at the end catches */
+      for (i = 0; count - i >= group; i += group) {
+        bool room = true;
+        detail::Unroll<StreamCount>([&](auto s) { room &= srcEnd - cur[s] >= 8; });
+        if (!room)
+          break;
+
+        detail::Unroll<StreamCount>([&](auto s) {
+          bitBuf[s] |= detail::LoadLE64(cur[s]) << bitCount[s];
+          cur[s] += (63 - bitCount[s]) >> 3;
+          bitCount[s] |= 56;
+        });
+        detail::Unroll<CodesPerRefill>([&](auto k) {
+          detail::Unroll<StreamCount>([&](auto s) {
+            Entry entry = entries[bitBuf[s] & (TableSize - 1)];
+            out[i + k*StreamCount + s] = Symbol(entry & kSymbolMask);
+            bitBuf[s] >>= entry >> kSymbolBits;
+            bitCount[s] -= entry >> kSymbolBits;
+          });
+        });
+      }
+      for (; i < count; i++) {
+        std::size_t s = i % StreamCount;
+        Entry entry;
+        unsigned length;
+        while (bitCount[s] <= 56 && cur[s] < end[s]) {
+          bitBuf[s] |= std::uint64_t(*cur[s]++) << bitCount[s];
+          bitCount[s] += 8;
+        }
+        entry = entries[bitBuf[s] & (TableSize - 1)];
+        length = entry >> kSymbolBits;
+        if (length > bitCount[s])
+          return HUFF_BADDATA;
+        out[i] = Symbol(entry & kSymbolMask);
+        bitBuf[s] >>= length;
+        bitCount[s] -= length;
+      }
+
+      /* Every stream has to have been used up, bar its padding */
+      for (int s = 0; s < StreamCount; s++) {
+        std::ptrdiff_t unused = (end[s] - cur[s])*8 + std::ptrdiff_t(bitCount[s]);
+        if (unused < 0 || unused >= 8)
+          return HUFF_BADDATA;
+      }
+
+      dstLength = std::size_t(count);
+      return HUFF_SUCCESS;
+    }
+
+  private:
+    /* Symbol in the low bits, code length above it */
+    using Entry = std::conditional_t<(AlphabetSize <= 256), std::uint16_t, std::uint32_t>;
+    static constexpr int kSymbolBits = AlphabetSize <= 256 ? 8 : 16;
+    static constexpr Entry kSymbolMask = Entry((1u << kSymbolBits) - 1);
+
+    struct Tables
+    {
+      std::array<Entry, TableSize> entries;
+      /* Header lengths the table was built from */
+      std::array<std::uint8_t, LengthsSize> lengths;
+      bool built;
+      /* Room to build the table in, too big for the stack with the largest alphabets */
+      std::array<std::uint8_t, AlphabetSize> symbolLengths;
+      std::array<std::uint32_t, AlphabetSize> codes;
+    };
+
+    /* Returns false if the lengths don't make a complete code no longer than MaxCodeLength */
+    bool BuildTable(const std::uint8_t *packed) noexcept
+    {
+      std::array<std::uint8_t, AlphabetSize> &lengths = tables_->symbolLengths;
+      std::array<std::uint32_t, AlphabetSize> &codes = tables_->codes;
+      std::uint64_t kraft = 0;
+
+      UnpackLengths(packed, lengths);
+      for (std::size_t i = 0; i < AlphabetSize; i++) {
+        if (lengths[i] > MaxCodeLength)
+          return false;
+        if (lengths[i] != 0)
+          kraft += TableSize >> lengths[i];
+      }
+      if (kraft != TableSize)
+        return false;
+
+      detail::CanonicalCodes<AlphabetSize>(lengths, MaxCodeLength, codes);
+      for (std::size_t i = 0; i < AlphabetSize; i++) {
+        Entry entry = Entry(i | std::size_t(lengths[i]) << kSymbolBits);
+        if (lengths[i] == 0)
+          continue;
+        for (std::size_t j = codes[i]; j < TableSize; j += std::size_t{1} << lengths[i])
+          tables_->entries[j] = entry;
+      }
+      return true;
+    }
+
+    std::unique_ptr<Tables> tables_;
+  };
+
+private:
+  static void PackLengths(const std::array<std::uint8_t, AlphabetSize> &lengths,
+                          std::array<std::uint8_t, LengthsSize> &packed) noexcept
+  {
+    std::uint32_t bitBuf = 0;
+    int bitCount = 0;
+    std::size_t pos = 0;
+
+    for (std::size_t i = 0; i < AlphabetSize; i++) {
+      bitBuf |= std::uint32_t(lengths[i]) << bitCount;
+      bitCount += LengthBits;
+      while (bitCount >= 8) {
+        packed[pos++] = std::uint8_t(bitBuf);
+        bitBuf >>= 8;
+        bitCount -= 8;
+      }
+    }
+    if (bitCount > 0)
+      packed[pos++] = std::uint8_t(bitBuf);
+    assert(pos == LengthsSize);
+  }
+
+  static void UnpackLengths(const std::uint8_t *packed, std::array<std::uint8_t, AlphabetSize> &lengths) noexcept
+  {
+    std::uint32_t bitBuf = 0;
+    int bitCount = 0;
+
+    for (std::size_t i = 0; i < AlphabetSize; i++) {
+      if (bitCount < LengthBits) {
+        bitBuf |= std::uint32_t(*packed++) << bitCount;
+        bitCount += 8;
+      }
+      lengths[i] = std::uint8_t(bitBuf & ((1u << LengthBits) - 1));
+      bitBuf >>= LengthBits;
+      bitCount -= LengthBits;
+    }
+  }
+};
+
+} /* namespace huff */
+
+#endif
@@ -1,106 +1,619 @@
+/* huff - compresses or decompresses a file, or stdin to stdout
+
+   huff [-d] [-a] [-q] [-t threads] [-l limit] [input [output]]
+   huff -h
+
+   Without -d the input is compressed into a canonical stream, and with -d a stream (or several written one after
+   another) is decompressed - an input or output of "-", or none at all, means stdin or stdout
+   Compressing takes two passes over the input, one to count and one to encode, so input files are mapped rather
+   than read into memory, and stdin is spooled to a temporary file first
+   With -a the input is compressed into an adaptive stream in one pass instead, and whatever has been read so far is
+   coded and flushed without waiting for more - for pipes that never end or can't wait
+   Output goes out a chunk at a time, so memory use doesn't depend on the size of the data
+
+   On Linux: cc -O2 -o huff main.c huff.c -lpthread */
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "huff.h"
 
-#define _CRTDBG_MAP_ALLOC
-#include <stdlib.h>
-#include <crtdbg.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/* Size of the pieces output is written in, and non-mapped input is read in */
+#define HUFF_CLI_CHUNK (1024*1024)
+
+/* Errors of our own, next to the library's */
+#define HUFF_CLI_READERROR -100
+#define HUFF_CLI_WRITEERROR -101
+
+/* An input file mapped into memory */
+struct HuffInput
+{
+  const uint8_t *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+};
+
+struct HuffOptions
+{
+  int decompress;
+  int adaptive;
+  int quiet;
+  int threadCount;
+  int maxCodeLength;
+  const char *inputName;
+  const char *outputName;
+};
+
+static int HuffParseOptions(int argc, char **argv, struct HuffOptions *options);
+static void HuffUsage(void);
+/* Maps all of |file|
+   Returns 0, or -1 if it can't be mapped (a pipe, say) */
+static int HuffMapInput(FILE *file, struct HuffInput *input);
+static void HuffUnmapInput(struct HuffInput *input);
+/* Copies everything left in |in| to a temporary file, for input that can't be mapped
+   Returns the temporary file, or NULL on failure */
+static FILE *HuffSpoolInput(FILE *in);
+static int HuffCompressFile(FILE *in, FILE *out, const struct HuffOptions *options, uint64_t *inBytes, uint64_t *outBytes);
+static int HuffCompressAdaptive(FILE *in, FILE *out, uint64_t *inBytes, uint64_t *outBytes);
+static int HuffDecompressFile(FILE *in, FILE *out, uint64_t *inBytes, uint64_t *outBytes);
+static int HuffWriteAll(FILE *out, const uint8_t *data, size_t length);
+/* Reads whatever |in| has ready, up to |length| bytes, waiting only if there's nothing at all
+   Returns the number of bytes read, 0 at the end of the input, or -1 on failure */
+static long HuffReadSome(FILE *in, uint8_t *buf, int length);
+/* Seconds from some fixed point, for timing */
+static double HuffNow(void);
+static const char *HuffErrorString(int res);
 
-int main(int argc, char* argv)
+int main(int argc, char **argv)
 {
-  uint8_t *original;
-  int originalSize;
+  struct HuffOptions options;
+  FILE *in = stdin;
+  FILE *out = stdout;
+  /* Set once the output file has been created, so it can be removed if anything goes wrong */
+  const char *outputFile = NULL;
+  uint64_t inBytes = 0;
+  uint64_t outBytes = 0;
+  double start;
+  double seconds;
   int res;
+
+  if (argc == 2 && strcmp(argv[1], "-h") == 0) {
+    HuffUsage();
+    return 0;
+  }
+  if (HuffParseOptions(argc, argv, &options)) {
+    HuffUsage();
+    return 2;
+  }
+
+  if (options.inputName != NULL && strcmp(options.inputName, "-") != 0) {
+    in = fopen(options.inputName, "rb");
+    if (in == NULL) {
+      fprintf(stderr, "huff: %s: %s\n", options.inputName, strerror(errno));
+      return 1;
+    }
+  }
+  if (options.outputName != NULL && strcmp(options.outputName, "-") != 0) {
+    out = fopen(options.outputName, "wb");
+    if (out == NULL) {
+      fprintf(stderr, "huff: %s: %s\n", options.outputName, strerror(errno));
+      if (in != stdin)
+        fclose(in);
+      return 1;
+    }
+    outputFile = options.outputName;
+  }
+
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+  start = HuffNow();
+  if (options.decompress)
+    res = HuffDecompressFile(in, out, &inBytes, &outBytes);
+  else if (options.adaptive)
+    res = HuffCompressAdaptive(in, out, &inBytes, &outBytes);
+  else
+    res = HuffCompressFile(in, out, &options, &inBytes, &outBytes);
+  seconds = HuffNow() - start;
+
+  if (res == HUFF_SUCCESS && fflush(out) != 0)
+    res = HUFF_CLI_WRITEERROR;
+
+  if (in != stdin)
+    fclose(in);
+  if (out != stdout && fclose(out) != 0 && res == HUFF_SUCCESS)
+    res = HUFF_CLI_WRITEERROR;
+
+  if (res != HUFF_SUCCESS) {
+    /* Like gzip and zstd, don't leave an empty or partial output file behind */
+    if (outputFile != NULL)
+      remove(outputFile);
+    fprintf(stderr, "huff: %s\n", HuffErrorString(res));
+    return 1;
+  }
+
+  if (!options.quiet) {
+    uint64_t rawBytes = options.decompress ? outBytes : inBytes;
+    uint64_t packedBytes = options.decompress ? inBytes : outBytes;
+
+    fprintf(stderr, "huff: %llu -> %llu bytes", (unsigned long long)inBytes, (unsigned long long)outBytes);
+    if (rawBytes > 0)
+      fprintf(stderr, " (%.2f%%)", 100.0 * (double)packedBytes / (double)rawBytes);
+    if (seconds > 0)
+      fprintf(stderr, " in %.3f s, %.1f MB/s", seconds, (double)rawBytes / seconds / 1e6);
+    fprintf(stderr, "\n");
+  }
+
+  return 0;
+}
+
+static int HuffParseOptions(int argc, char **argv, struct HuffOptions *options)
+{
   int i;
-  int processed;
-  uint8_t *encoded;
-  int encodedSize;
-  uint8_t *decoded;
-  int decodedSize;
 
-  HuffCounter counter;
-  HuffEncoder encoder;
-  HuffDecoder decoder;
+  options->decompress = 0;
+  options->adaptive = 0;
+  options->quiet = 0;
+  options->threadCount = 1;
+  options->maxCodeLength = 0;
+  options->inputName = NULL;
+  options->outputName = NULL;
+
+  for (i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+
+    if (strcmp(arg, "-d") == 0) {
+      options->decompress = 1;
+    } else if (strcmp(arg, "-a") == 0) {
+      options->adaptive = 1;
+    } else if (strcmp(arg, "-q") == 0) {
+      options->quiet = 1;
+    } else if (strcmp(arg, "-t") == 0 && i + 1 < argc) {
+      options->threadCount = atoi(argv[++i]);
+      if (options->threadCount < 1)
+        return -1;
+    } else if (strcmp(arg, "-l") == 0 && i + 1 < argc) {
+      options->maxCodeLength = atoi(argv[++i]);
+      if (options->maxCodeLength < HUFF_MINCODELENGTH || options->maxCodeLength > HUFF_MAXCODELENGTH)
+        return -1;
+    } else if (arg[0] == '-' && arg[1] != '\0') {
+      return -1;
+    } else if (options->inputName == NULL) {
+      options->inputName = arg;
+    } else if (options->outputName == NULL) {
+      options->outputName = arg;
+    } else {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+static void HuffUsage(void)
+{
+  fprintf(stderr,
+          "usage: huff [-d] [-a] [-q] [-t threads] [-l limit] [input [output]]\n"
+          "  -d          decompress\n"
+          "  -a          compress adaptively, in one pass as the input comes in\n"
+          "  -q          don't print sizes and throughput\n"
+          "  -t threads  threads to count the input with\n"
+          "  -l limit    longest code allowed, %d to %d\n"
+          "  input and output default to stdin and stdout, as does -\n",
+          HUFF_MINCODELENGTH, HUFF_MAXCODELENGTH);
+}
+
+static int HuffMapInput(FILE *file, struct HuffInput *input)
+{
+#ifdef _WIN32
+  HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+  LARGE_INTEGER size;
+
+  input->data = NULL;
+  input->size = 0;
+  input->mapping = NULL;
+
+  if (handle == INVALID_HANDLE_VALUE || GetFileType(handle) != FILE_TYPE_DISK || !GetFileSizeEx(handle, &size))
+    return -1;
+  if ((uint64_t)size.QuadPart > (size_t)-1)
+    return -1;
+  if (size.QuadPart == 0)
+    return 0;
 
-  /* Load file */
-  FILE* in = fopen("E:/Users/Andy/Downloads/bananastand.sdf", "rb");
-  if (in == NULL)
-    exit(1);
+  input->mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (input->mapping == NULL)
+    return -1;
+  input->data = MapViewOfFile(input->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (input->data == NULL) {
+    CloseHandle(input->mapping);
+    input->mapping = NULL;
+    return -1;
+  }
+  input->size = (size_t)size.QuadPart;
+  return 0;
+#else
+  struct stat info;
+  void *data;
+
+  input->data = NULL;
+  input->size = 0;
+
+  if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode))
+    return -1;
+  if ((uint64_t)info.st_size > (size_t)-1)
+    return -1;
+  /* mmap won't take an empty mapping */
+  if (info.st_size == 0)
+    return 0;
 
-  originalSize = 2445312;
-  original = malloc(originalSize);
-  if (original == NULL)
-    exit(1);
+  data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (data == MAP_FAILED)
+    return -1;
+  /* Both passes go front to back */
+  posix_madvise(data, (size_t)info.st_size, POSIX_MADV_SEQUENTIAL);
 
-  res = fread(original, 1, originalSize, in);
-  if (res != originalSize)
-    exit(1);
+  input->data = data;
+  input->size = (size_t)info.st_size;
+  return 0;
+#endif
+}
+static void HuffUnmapInput(struct HuffInput *input)
+{
+  if (input->data == NULL)
+    return;
 
+#ifdef _WIN32
+  UnmapViewOfFile(input->data);
+  CloseHandle(input->mapping);
+#else
+  munmap((void *)input->data, input->size);
+#endif
+  input->data = NULL;
+  input->size = 0;
+}
+static FILE *HuffSpoolInput(FILE *in)
+{
+  FILE *spool;
+  uint8_t *buf;
+  size_t length;
+
+  spool = tmpfile();
+  if (spool == NULL)
+    return NULL;
+
+  buf = malloc(HUFF_CLI_CHUNK);
+  if (buf == NULL)
+    goto out;
+
+  while ((length = fread(buf, 1, HUFF_CLI_CHUNK, in)) > 0) {
+    if (fwrite(buf, 1, length, spool) != length)
+      goto out1;
+  }
+  if (ferror(in) || fflush(spool) != 0)
+    goto out1;
+
+  free(buf);
+  return spool;
+out1:
+  free(buf);
+out:
+  fclose(spool);
+  return NULL;
+}
+
+static int HuffCompressFile(FILE *in, FILE *out, const struct HuffOptions *options, uint64_t *inBytes, uint64_t *outBytes)
+{
+  struct HuffInput input;
+  FILE *spool = NULL;
+  HuffCounter counter;
+  HuffStream stream;
+  uint8_t *buf;
+  int ret;
+  int res;
+
+  if (HuffMapInput(in, &input)) {
+    spool = HuffSpoolInput(in);
+    if (spool == NULL)
+      return HUFF_CLI_READERROR;
+    if (HuffMapInput(spool, &input)) {
+      fclose(spool);
+      return HUFF_CLI_READERROR;
+    }
+  }
+
+  ret = HUFF_NOMEM;
+  buf = malloc(HUFF_CLI_CHUNK);
+  if (buf == NULL)
+    goto out;
   counter = HuffCounterInit();
   if (counter == NULL)
-    exit(1);
+    goto out1;
 
-  res = HuffCounterFeedData(counter, original, originalSize);
-  if (res != HUFF_SUCCESS)
-    exit(1);
+  /* First pass */
+  ret = HuffCounterFeedDataParallel(counter, input.data, input.size, options->threadCount);
+  if (ret != HUFF_SUCCESS)
+    goto out2;
 
-  encoder = HuffEncoderInit(counter, 0);
-  if (encoder == NULL)
-    exit(1);
+  ret = HuffEncodeStreamInit(&stream, counter, options->maxCodeLength);
+  if (ret != HUFF_SUCCESS)
+    goto out2;
 
-  res = HuffEncoderFeedData(encoder, original, originalSize, &processed);
-  if (res != HUFF_SUCCESS || processed != originalSize)
-    exit(1);
+  /* Second pass, a chunk of output at a time */
+  stream.nextIn = input.data;
+  stream.availIn = input.size;
+  do {
+    stream.nextOut = buf;
+    stream.availOut = HUFF_CLI_CHUNK;
 
-  res = HuffEncoderEndData(encoder);
-  if (res != HUFF_SUCCESS)
-    exit(1);
+    res = HuffEncodeStream(&stream, HUFF_FINISH);
+    if (res < 0) {
+      ret = res;
+      break;
+    }
 
-  encodedSize = HuffEncoderByteCount(encoder);
+    if (HuffWriteAll(out, buf, HUFF_CLI_CHUNK - stream.availOut)) {
+      ret = HUFF_CLI_WRITEERROR;
+      break;
+    }
+  } while (res != HUFF_STREAMEND);
 
-  encoded = malloc(encodedSize);
-  if (encoded == NULL)
-    exit(1);
+  *inBytes = stream.totalIn;
+  *outBytes = stream.totalOut;
+  HuffEncodeStreamEnd(&stream);
 
-  res = HuffEncoderWriteBytes(encoder, encoded, encodedSize);
-  if (res != encodedSize)
-    exit(1);
+out2:
+  HuffCounterDestroy(counter);
+out1:
+  free(buf);
+out:
+  HuffUnmapInput(&input);
+  if (spool != NULL)
+    fclose(spool);
+  return ret;
+}
+static int HuffCompressAdaptive(FILE *in, FILE *out, uint64_t *inBytes, uint64_t *outBytes)
+{
+  HuffStream stream;
+  uint8_t *inBuf;
+  uint8_t *outBuf;
+  int ret = HUFF_NOMEM;
+  int res;
 
-  decoder = HuffDecoderInit(0);
-  if (decoder == NULL)
-    exit(1);
+  inBuf = malloc(HUFF_CLI_CHUNK);
+  if (inBuf == NULL)
+    goto out;
+  outBuf = malloc(HUFF_CLI_CHUNK);
+  if (outBuf == NULL)
+    goto out1;
 
-  res = HuffDecoderFeedData(decoder, encoded, encodedSize, &processed);
-  if (res != HUFF_SUCCESS || processed != encodedSize)
-    exit(1);
+  ret = HuffEncodeStreamInitAdaptive(&stream);
+  if (ret != HUFF_SUCCESS)
+    goto out2;
 
-  decodedSize = HuffDecoderByteCount(decoder);
+  do {
+    long length;
+    int flush;
 
-  decoded = malloc(decodedSize);
-  if (decoded == NULL)
-    exit(1);
+    length = HuffReadSome(in, inBuf, HUFF_CLI_CHUNK);
+    if (length < 0) {
+      ret = HUFF_CLI_READERROR;
+      break;
+    }
+    stream.nextIn = inBuf;
+    stream.availIn = (size_t)length;
+    flush = (length == 0) ? HUFF_FINISH : HUFF_NOFLUSH;
 
-  res = HuffDecoderWriteBytes(decoder, decoded, decodedSize);
-  if (res != decodedSize)
-    exit(1);
+    /* Everything that's been coded goes out before the next read */
+    do {
+      stream.nextOut = outBuf;
+      stream.availOut = HUFF_CLI_CHUNK;
 
-  /* Verify that the data is the same after going through */
-  /*if (decodedSize != originalSize)
-    exit(1);
+      res = HuffEncodeStream(&stream, flush);
+      if (res < 0) {
+        ret = res;
+        break;
+      }
 
-  for (i = 0; i < decodedSize; i++)
-    if (original[i] != decoded[i])
-      exit(1);*/
-  
-  HuffCounterDestroy(counter);
-  HuffEncoderDestroy(encoder);
-  HuffDecoderDestroy(decoder);
-  free(original);
-  free(encoded);
-  free(decoded);
+      if (HuffWriteAll(out, outBuf, HUFF_CLI_CHUNK - stream.availOut)) {
+        res = ret = HUFF_CLI_WRITEERROR;
+        break;
+      }
+    } while (stream.availOut == 0 || (flush == HUFF_FINISH && res != HUFF_STREAMEND));
 
-  printf("Good!\n");
-  _CrtDumpMemoryLeaks();
-  getchar();
+    if (res < 0)
+      break;
+    if (fflush(out) != 0) {
+      ret = HUFF_CLI_WRITEERROR;
+      break;
+    }
+  } while (res != HUFF_STREAMEND);
 
-  return 0;
-}
\ No newline at end of file
+  *inBytes = stream.totalIn;
+  *outBytes = stream.totalOut;
+  HuffEncodeStreamEnd(&stream);
+
+out2:
+  free(outBuf);
+out1:
+  free(inBuf);
+out:
+  return ret;
+}
+static int HuffDecompressFile(FILE *in, FILE *out, uint64_t *inBytes, uint64_t *outBytes)
+{
+  struct HuffInput input;
+  HuffStream stream;
+  uint8_t *inBuf = NULL;
+  uint8_t *outBuf;
+  const uint8_t *nextIn;
+  size_t availIn;
+  int mapped;
+  int inputDone;
+  int ret = HUFF_NOMEM;
+  int res;
+
+  /* Mapped input can be handed over all at once, anything else is read a chunk at a time */
+  mapped = !HuffMapInput(in, &input);
+  nextIn = input.data;
+  availIn = input.size;
+  inputDone = mapped;
+
+  outBuf = malloc(HUFF_CLI_CHUNK);
+  if (outBuf == NULL)
+    goto out;
+  if (!mapped) {
+    inBuf = malloc(HUFF_CLI_CHUNK);
+    if (inBuf == NULL)
+      goto out1;
+  }
+
+  /* Streams written one after another are decoded one after another, like gzip members */
+  for (;;) {
+    if (availIn == 0 && !inputDone) {
+      availIn = fread(inBuf, 1, HUFF_CLI_CHUNK, in);
+      nextIn = inBuf;
+      if (availIn == 0) {
+        if (ferror(in)) {
+          ret = HUFF_CLI_READERROR;
+          goto out2;
+        }
+        inputDone = 1;
+      }
+    }
+    if (availIn == 0 && inputDone)
+      break;
+
+    ret = HuffDecodeStreamInit(&stream);
+    if (ret != HUFF_SUCCESS)
+      goto out2;
+
+    for (;;) {
+      stream.nextIn = nextIn;
+      stream.availIn = availIn;
+      stream.nextOut = outBuf;
+      stream.availOut = HUFF_CLI_CHUNK;
+
+      res = HuffDecodeStream(&stream);
+
+      *inBytes += availIn - stream.availIn;
+      nextIn = stream.nextIn;
+      availIn = stream.availIn;
+
+      if (res < 0) {
+        ret = res;
+        break;
+      }
+      if (HuffWriteAll(out, outBuf, HUFF_CLI_CHUNK - stream.availOut)) {
+        ret = HUFF_CLI_WRITEERROR;
+        break;
+      }
+      *outBytes += HUFF_CLI_CHUNK - stream.availOut;
+
+      if (res == HUFF_STREAMEND)
+        break;
+
+      if (availIn == 0 && stream.availOut > 0) {
+        /* The stream wants more input */
+        if (inputDone) {
+          ret = HUFF_BADDATA;
+          break;
+        }
+        availIn = fread(inBuf, 1, HUFF_CLI_CHUNK, in);
+        nextIn = inBuf;
+        if (availIn == 0) {
+          /* Ends partway through a stream */
+          ret = ferror(in) ? HUFF_CLI_READERROR : HUFF_BADDATA;
+          break;
+        }
+      }
+    }
+
+    HuffDecodeStreamEnd(&stream);
+    if (ret != HUFF_SUCCESS)
+      goto out2;
+  }
+
+  ret = HUFF_SUCCESS;
+out2:
+  free(inBuf);
+out1:
+  free(outBuf);
+out:
+  HuffUnmapInput(&input);
+  return ret;
+}
+static int HuffWriteAll(FILE *out, const uint8_t *data, size_t length)
+{
+  if (length == 0)
+    return 0;
+
+  return (fwrite(data, 1, length, out) == length) ? 0 : -1;
+}
+static long HuffReadSome(FILE *in, uint8_t *buf, int length)
+{
+  /* Straight from the descriptor, since fread would wait for the whole length */
+#ifdef _WIN32
+  return _read(_fileno(in), buf, (unsigned)length);
+#else
+  ssize_t res;
+
+  do {
+    res = read(fileno(in), buf, (size_t)length);
+  } while (res < 0 && errno == EINTR);
+
+  return (long)res;
+#endif
+}
+
+static double HuffNow(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER count;
+  LARGE_INTEGER frequency;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&frequency);
+  return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+static const char *HuffErrorString(int res)
+{
+  switch (res) {
+  case HUFF_NOMEM:
+    return "out of memory";
+  case HUFF_TOOMUCHDATA:
+    return "the input is too big";
+  case HUFF_BADDATA:
+    return "the input isn't a valid stream";
+  case HUFF_CLI_READERROR:
+    return "couldn't read the input";
+  case HUFF_CLI_WRITEERROR:
+    return "couldn't write the output";
+  default:
+    return "unknown error";
+  }
+}